@@ -0,0 +1,382 @@
+/*
+ * bench-tl.c
+ *
+ * benchmark driver for transfer-logs (see make bench). It is built on top of
+ * transfer-logs.c, without its main, so the code timed here is the code that
+ * ships. Input is a data set written by gen-rrd:
+ *
+ *   bench-tl [-r <runs>] [-j <threads>] <dir>
+ *
+ * Every case starts from a fresh copy of <dir>/rra in <dir>/work, made
+ * outside the timed part. All console output of transfer-logs itself goes to
+ * /dev/null while timing.
+ */
+
+#define TL_NO_MAIN
+
+#include "../transfer-logs.c"
+
+#define BENCH_UNZIP      0
+#define BENCH_LOAD       1
+#define BENCH_MERGE      2
+#define BENCH_MERGE_MEM  3
+#define BENCH_CONVERT    4
+#define BENCH_CONVERT_B  5
+#define BENCH_PWRUSAGE   6
+#define BENCH_PLAN       7
+#define N_BENCH          8
+
+typedef struct bench_s {
+  char   *dir;
+  char   rra_dir[MAX_LEN];
+  char   work_dir[MAX_LEN];
+  char   unz_dir[MAX_LEN];
+  char   csv_dir[MAX_LEN];
+  char   old_dir[MAX_LEN];
+  char   pw_path[MAX_LEN];
+  char   pw_work[MAX_LEN];
+  int    n_threads;
+  int    n_runs;
+  int    n_dbs;
+  long   n_samples;
+  int    n_months;
+  exports_s *exports;
+  tl_ctx_s *ctx;
+  int    stdout_fd;
+  int    stderr_fd;
+} bench_s;
+
+void   bench_usage( char* );
+int    bench_count( bench_s* );
+int    bench_prepare( bench_s*, int );
+double bench_run( bench_s*, int );
+int    reset_dir( char*, char* );
+void   quiet( bench_s*, int );
+
+
+
+int main( int argc, char *argv[] ) {
+
+  static char* names[N_BENCH] = { "unzip", "unzip -m", "merge", "merge -m",
+				  "convert", "convert -B", "pwrusage", 
+				  "plan" };
+  bench_s bench;
+  tl_opts_s opts;
+  char cfg_path[2 * MAX_LEN];
+  struct rusage usage;
+  double t;
+  double t_min;
+  double t_sum;
+  long n;
+  int i;
+  int k;
+
+  memset( &bench, 0, sizeof( bench ) );
+  bench.n_threads = 1;
+  bench.n_runs    = 5;
+
+  for ( i = 1; i < argc; i++ ) {
+    if ( !strcmp( "-h", argv[i] ) ) {
+      bench_usage( argv[0] );
+      return 0;
+    } else if ( !strcmp( "-r", argv[i] ) && ( i + 1 < argc ) ) {
+      bench.n_runs = atoi( argv[++i] );
+    } else if ( !strcmp( "-j", argv[i] ) && ( i + 1 < argc ) ) {
+      bench.n_threads = atoi( argv[++i] );
+    } else if ( argv[i][0] != '-' ) {
+      bench.dir = argv[i];
+    } else {
+      bench_usage( argv[0] );
+      return 1;
+    }
+  }
+
+  if ( ( bench.dir == NULL ) || ( bench.n_runs < 1 ) ||
+       ( bench.n_threads < 1 ) ) {
+    bench_usage( argv[0] );
+    return 1;
+  }
+
+  /* transfer-logs expects directories with a trailing slash */
+
+  snprintf( bench.rra_dir,  MAX_LEN, "%s/rra/", bench.dir );
+  snprintf( bench.work_dir, MAX_LEN, "%s/work/", bench.dir );
+  snprintf( bench.unz_dir,  MAX_LEN, "%s/unz/", bench.dir );
+  snprintf( bench.csv_dir,  MAX_LEN, "%s/csv/", bench.dir );
+  snprintf( bench.old_dir,  MAX_LEN, "%s/old", bench.dir );
+  snprintf( bench.pw_path,  MAX_LEN, "%s/config_happ_pwrusage.xml",
+	    bench.dir );
+  snprintf( bench.pw_work,  MAX_LEN, "%s/pw.xml", bench.dir );
+  snprintf( cfg_path, sizeof( cfg_path ), "%sconfig_hcb_rrd.xml",
+	    bench.work_dir );
+
+  if ( bench_count( &bench ) )
+    return 1;
+
+  /* one context for all runs, as a long-lived caller would use it */
+
+  memset( &opts, 0, sizeof( opts ) );
+  opts.rra_location = bench.work_dir;
+  opts.hcb_rrd_cfg  = cfg_path;
+  opts.n_threads    = bench.n_threads;
+  if ( ( bench.ctx = tl_open( &opts ) ) == NULL )
+    return 1;
+
+  printf( "%s: %d databases, %ld samples, %d runs, %d threads\n\n",
+	  bench.dir, bench.n_dbs, bench.n_samples, bench.n_runs,
+	  bench.n_threads );
+  printf( "  %-12s %10s %10s %12s\n", "case", "min ms", "avg ms",
+	  "Msamples/s" );
+
+  for ( k = 0; k < N_BENCH; k++ ) {
+    t_min = 0.0;
+    t_sum = 0.0;
+    for ( i = 0; i < bench.n_runs; i++ ) {
+      if ( bench_prepare( &bench, k ) )
+	return 1;
+      if ( ( t = bench_run( &bench, k ) ) < 0.0 ) {
+	fprintf( stderr, "%s failed\n", names[k] );
+	return 1;
+      }
+      t_sum += t;
+      if ( ( i == 0 ) || ( t < t_min ) )
+	t_min = t;
+    }
+
+    /* monthly data has no samples, rate is in monthInfo entries for it */
+
+    n = ( k == BENCH_PWRUSAGE ) ? bench.n_months : bench.n_samples;
+    printf( "  %-12s %10.3f %10.3f %12.3f\n", names[k], 1000.0 * t_min,
+	    1000.0 * t_sum / bench.n_runs,
+	    ( t_min > 0.0 ) ? n / t_min / 1e6 : 0.0 );
+  }
+
+  getrusage( RUSAGE_SELF, &usage );
+  printf( "\npeak RSS: %ld kB\n", usage.ru_maxrss );
+
+  if ( bench.exports )
+    free_exports( bench.exports );
+  tl_close( bench.ctx );
+  return 0;
+}
+
+
+
+void bench_usage( char* exec_name ) {
+  printf( "call:\n\n%s [-r <runs>] [-j <threads>] <dir>\n\n", exec_name );
+  printf( "    -r <runs>       Number of runs of every case. Default: 5.\n" );
+  printf( "    -j <threads>    Number of worker threads for merge and\n" );
+  printf( "                    convert. Default: 1.\n" );
+  printf( "    <dir>           Data set written by gen-rrd.\n" );
+}
+
+
+
+int bench_count( bench_s* bench ) {
+
+  manifest_s *man;
+  char path[2 * MAX_LEN];
+  arena_s arena = { NULL, 0, 0, NULL };
+  dat_s *data;
+  ezxml_t doc;
+  ezxml_t month;
+  int i;
+  int k;
+
+  /* samples in all ring buffers, and monthInfo entries of the old file */
+
+  if ( ( man = read_manifest( bench->rra_dir, &arena ) ) == NULL ) {
+    fprintf( stderr, "Cannot open %s: %s\n", bench->rra_dir,
+	     strerror( errno ) );
+    return 1;
+  }
+
+  for ( k = 0; k < man->n_dats; k++ ) {
+    snprintf( path, sizeof( path ), "%s%s", bench->rra_dir, 
+	      man->dats[k].name );
+    if ( data = read_dat_file( path, &arena ) ) {
+      bench->n_dbs++;
+      for ( i = 0; i < data->n_sets; i++ ) {
+	bench->n_samples += data->subset[i]->n_samples;
+      }
+    }
+  }
+  arena_free( &arena );
+
+  if ( bench->n_dbs == 0 ) {
+    fprintf( stderr, "No .dat files in %s\n", bench->rra_dir );
+    return 1;
+  }
+
+  snprintf( path, sizeof( path ), "%s/config_happ_pwrusage.xml",
+	    bench->old_dir );
+  if ( doc = ezxml_parse_file( path ) ) {
+    for ( month = ezxml_child( doc, "monthInfo" ); month;
+	  month = month->next ) {
+      bench->n_months++;
+    }
+    ezxml_free( doc );
+  }
+  return 0;
+}
+
+
+
+int bench_prepare( bench_s* bench, int k ) {
+
+  char src[2 * MAX_LEN];
+  char dst[2 * MAX_LEN];
+
+  /* untimed set-up for one run of case k */
+
+  switch ( k ) {
+  case BENCH_UNZIP:
+    mkdir( bench->unz_dir, 0755 );
+    snprintf( src, sizeof( src ), "%s/export.zip", bench->dir );
+    snprintf( dst, sizeof( dst ), "%sexport.zip", bench->unz_dir );
+    return copy_file( src, dst );
+  case BENCH_LOAD:
+    return 0;
+  case BENCH_MERGE_MEM:
+    if ( bench->exports == NULL ) {
+      quiet( bench, 1 );
+      snprintf( src, sizeof( src ), "%s/", bench->dir );
+      bench->exports = load_exports( src, "export.zip" );
+      quiet( bench, 0 );
+      if ( bench->exports == NULL )
+	return 1;
+    }
+    return reset_dir( bench->rra_dir, bench->work_dir );
+  case BENCH_MERGE:
+  case BENCH_CONVERT:
+  case BENCH_CONVERT_B:
+  case BENCH_PLAN:
+    return reset_dir( bench->rra_dir, bench->work_dir );
+  case BENCH_PWRUSAGE:
+    return copy_file( bench->pw_path, bench->pw_work );
+  }
+  return 1;
+}
+
+
+
+double bench_run( bench_s* bench, int k ) {
+
+  char path[2 * MAX_LEN];
+  exports_s *exports;
+  double t0;
+  double t;
+  int err = 0;
+
+  quiet( bench, 1 );
+  t0 = stats_clock();
+
+  switch ( k ) {
+  case BENCH_UNZIP:
+    err = unzip_exports( bench->unz_dir, 0 );
+    break;
+  case BENCH_LOAD:
+    snprintf( path, sizeof( path ), "%s/", bench->dir );
+    if ( exports = load_exports( path, "export.zip" ) ) {
+      free_exports( exports );
+    } else {
+      err = 1;
+    }
+    break;
+  case BENCH_MERGE:
+    err = inject_data( bench->ctx, bench->csv_dir, NULL, 0, NULL ) != 
+      bench->n_dbs;
+    break;
+  case BENCH_MERGE_MEM:
+    err = inject_data( bench->ctx, bench->csv_dir, bench->exports, 0, 
+		       NULL ) != bench->n_dbs;
+    break;
+  case BENCH_CONVERT:
+    err = rra_to_csv( bench->ctx, bench->work_dir, 0 ) != bench->n_dbs;
+    break;
+  case BENCH_CONVERT_B:
+    err = rra_to_csv( bench->ctx, bench->work_dir, 1 ) != bench->n_dbs;
+    break;
+  case BENCH_PWRUSAGE:
+    err = read_pwrusage_and_merge( bench->old_dir, bench->pw_work, NULL );
+    break;
+  case BENCH_PLAN:
+    bench->ctx->plan = 1;
+    err = inject_data( bench->ctx, bench->csv_dir, NULL, 0, NULL ) != 
+      bench->n_dbs;
+    bench->ctx->plan = 0;
+    break;
+  }
+
+  t = stats_clock() - t0;
+  quiet( bench, 0 );
+  return err ? -1.0 : t;
+}
+
+
+
+int reset_dir( char* src_dir, char* dst_dir ) {
+
+  DIR* dir;
+  struct dirent* entry;
+  struct stat st;
+  char src[2 * MAX_LEN];
+  char dst[2 * MAX_LEN];
+
+  /* empty dst_dir, then copy all regular files of src_dir into it */
+
+  mkdir( dst_dir, 0755 );
+  if ( ( dir = opendir( dst_dir ) ) == NULL ) {
+    fprintf( stderr, "Cannot open %s: %s\n", dst_dir, strerror( errno ) );
+    return 1;
+  }
+  while ( entry = readdir( dir ) ) {
+    snprintf( dst, sizeof( dst ), "%s%s", dst_dir, entry->d_name );
+    if ( !lstat( dst, &st ) && S_ISREG( st.st_mode ) )
+      unlink( dst );
+  }
+  closedir( dir );
+
+  if ( ( dir = opendir( src_dir ) ) == NULL ) {
+    fprintf( stderr, "Cannot open %s: %s\n", src_dir, strerror( errno ) );
+    return 1;
+  }
+  while ( entry = readdir( dir ) ) {
+    snprintf( src, sizeof( src ), "%s%s", src_dir, entry->d_name );
+    snprintf( dst, sizeof( dst ), "%s%s", dst_dir, entry->d_name );
+    if ( !stat( src, &st ) && S_ISREG( st.st_mode ) && copy_file( src, dst ) ) {
+      fprintf( stderr, "Cannot copy %s to %s\n", src, dst );
+      closedir( dir );
+      return 1;
+    }
+  }
+  closedir( dir );
+  return 0;
+}
+
+
+
+void quiet( bench_s* bench, int on ) {
+
+  int fd;
+
+  /* send stdout and stderr to /dev/null, or back again */
+
+  fflush( stdout );
+  fflush( stderr );
+
+  if ( on ) {
+    bench->stdout_fd = dup( STDOUT_FILENO );
+    bench->stderr_fd = dup( STDERR_FILENO );
+    if ( ( fd = open( "/dev/null", O_WRONLY ) ) >= 0 ) {
+      dup2( fd, STDOUT_FILENO );
+      dup2( fd, STDERR_FILENO );
+      close( fd );
+    }
+  } else {
+    dup2( bench->stdout_fd, STDOUT_FILENO );
+    dup2( bench->stderr_fd, STDERR_FILENO );
+    close( bench->stdout_fd );
+    close( bench->stderr_fd );
+  }
+}
@@ -0,0 +1,519 @@
+/*
+ * gen-rrd.c
+ *
+ * synthetic data sets for benchmarking transfer-logs (see make bench).
+ *
+ * Writes, below <dir>:
+ *
+ *   rra/       .dat/.rra pairs in hcb_rrd_09082011A format, one integer and
+ *              one double database per device, plus config_hcb_rrd.xml
+ *   csv/       matching csv files, as found in export.zip
+ *   export.zip usage.zip and thermostat.zip with those csv files, nested in
+ *              the same way the toon's data export does
+ *   old/config_happ_pwrusage.xml, config_happ_pwrusage.xml
+ *              monthly data, old and new, partly overlapping
+ *
+ * Every 17th rra slot is left empty, the csv files cover the newest part of
+ * the ring buffer window and a few samples beyond it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#define MAGIC            "hcb_rrd_09082011A"
+#define MAX_LEN          1024
+#define MAX_ZIP_FILES    256
+
+/* growing byte buffer for .dat, .rra, csv and zip contents */
+
+typedef struct buf_s {
+  char   *p;
+  size_t len;
+  size_t size;
+} buf_s;
+
+/* in-memory zip archive, deflated entries */
+
+typedef struct zip_s {
+  buf_s  data;
+  int    n_files;
+  char   *names[MAX_ZIP_FILES];
+  unsigned long crc[MAX_ZIP_FILES];
+  size_t c_size[MAX_ZIP_FILES];
+  size_t u_size[MAX_ZIP_FILES];
+  size_t offset[MAX_ZIP_FILES];
+} zip_s;
+
+typedef struct opts_s {
+  int    n_samples;
+  int    interval;
+  int    offset;     /* file_offset, -1: two thirds into the ring */
+  int    types;      /* 1: integer, 2: double, 3: both */
+  int    n_devices;
+  int    n_months;
+  int    coverage;   /* percentage of the window covered by csv data */
+  int    t_newest;
+} opts_s;
+
+void   usage( char* );
+void   buf_add( buf_s*, void*, size_t );
+void   buf_int( buf_s*, int );
+void   buf_double( buf_s*, double );
+void   buf_string( buf_s*, char* );
+int    write_buf( char*, buf_s* );
+void   zip_put16( zip_s*, int );
+void   zip_put32( zip_s*, unsigned long );
+void   zip_add( zip_s*, char*, void*, size_t );
+void   zip_finish( zip_s* );
+int    gen_database( opts_s*, char*, int, int, FILE*, zip_s*, zip_s* );
+int    gen_pwrusage( opts_s*, char*, int, int );
+
+
+
+int main( int argc, char *argv[] ) {
+
+  opts_s opts = { 10000, 300, -1, 3, 1, 120, 60, 1560000000 };
+  char path[MAX_LEN];
+  char *dir = NULL;
+  FILE *cfg;
+  zip_s usage_zip = { 0 };
+  zip_s therm_zip = { 0 };
+  zip_s export_zip = { 0 };
+  int i;
+  int k;
+
+  for ( i = 1; i < argc; i++ ) {
+    if ( !strcmp( "-h", argv[i] ) ) {
+      usage( argv[0] );
+      return 0;
+    } else if ( !strcmp( "-n", argv[i] ) && ( i + 1 < argc ) ) {
+      opts.n_samples = atoi( argv[++i] );
+    } else if ( !strcmp( "-s", argv[i] ) && ( i + 1 < argc ) ) {
+      opts.interval = atoi( argv[++i] );
+    } else if ( !strcmp( "-o", argv[i] ) && ( i + 1 < argc ) ) {
+      opts.offset = atoi( argv[++i] );
+    } else if ( !strcmp( "-t", argv[i] ) && ( i + 1 < argc ) ) {
+      i++;
+      opts.types = !strcmp( argv[i], "int" ) ? 1 :
+	!strcmp( argv[i], "double" ) ? 2 : 3;
+    } else if ( !strcmp( "-d", argv[i] ) && ( i + 1 < argc ) ) {
+      opts.n_devices = atoi( argv[++i] );
+    } else if ( !strcmp( "-m", argv[i] ) && ( i + 1 < argc ) ) {
+      opts.n_months = atoi( argv[++i] );
+    } else if ( !strcmp( "-c", argv[i] ) && ( i + 1 < argc ) ) {
+      opts.coverage = atoi( argv[++i] );
+    } else if ( argv[i][0] != '-' ) {
+      dir = argv[i];
+    } else {
+      usage( argv[0] );
+      return 1;
+    }
+  }
+
+  if ( ( dir == NULL ) || ( opts.n_samples < 1 ) || ( opts.interval < 1 ) ||
+       ( opts.n_devices < 1 ) || ( opts.offset >= opts.n_samples ) ||
+       ( 2 * opts.n_devices + 1 > MAX_ZIP_FILES ) ) {
+    usage( argv[0] );
+    return 1;
+  }
+  if ( opts.offset < 0 ) {
+    opts.offset = ( 2 * opts.n_samples ) / 3;
+  }
+
+  mkdir( dir, 0755 );
+  snprintf( path, sizeof( path ), "%s/rra", dir );
+  mkdir( path, 0755 );
+  snprintf( path, sizeof( path ), "%s/csv", dir );
+  mkdir( path, 0755 );
+  snprintf( path, sizeof( path ), "%s/old", dir );
+  mkdir( path, 0755 );
+
+  snprintf( path, sizeof( path ), "%s/rra/config_hcb_rrd.xml", dir );
+  if ( ( cfg = fopen( path, "w" ) ) == NULL ) {
+    fprintf( stderr, "Cannot write %s: %s\n", path, strerror( errno ) );
+    return 1;
+  }
+  fprintf( cfg, "<Config>\n" );
+
+  for ( k = 0; k < opts.n_devices; k++ ) {
+    if ( ( ( opts.types & 1 ) &&
+	   gen_database( &opts, dir, k, 1, cfg, &usage_zip, &therm_zip ) ) ||
+	 ( ( opts.types & 2 ) &&
+	   gen_database( &opts, dir, k, 0, cfg, &usage_zip, &therm_zip ) ) ) {
+      return 1;
+    }
+  }
+
+  /* one thermostat database, its csv file goes into thermostat.zip */
+
+  if ( opts.types & 2 ) {
+    if ( gen_database( &opts, dir, -1, 0, cfg, &usage_zip, &therm_zip ) )
+      return 1;
+  }
+
+  fprintf( cfg, "</Config>\n" );
+  fclose( cfg );
+
+  zip_finish( &usage_zip );
+  zip_finish( &therm_zip );
+  zip_add( &export_zip, "usage.zip", usage_zip.data.p, usage_zip.data.len );
+  zip_add( &export_zip, "thermostat.zip", therm_zip.data.p, 
+	   therm_zip.data.len );
+  zip_finish( &export_zip );
+
+  snprintf( path, sizeof( path ), "%s/export.zip", dir );
+  if ( write_buf( path, &export_zip.data ) )
+    return 1;
+
+  if ( gen_pwrusage( &opts, dir, 0, 1 ) || gen_pwrusage( &opts, dir, 1, 0 ) )
+    return 1;
+
+  printf( "%s: %d samples per database, interval %d s, offset %d, %d devices\n",
+	  dir, opts.n_samples, opts.interval, opts.offset, opts.n_devices );
+  return 0;
+}
+
+
+
+void usage( char* exec_name ) {
+  printf( "call:\n\n%s [-n <samples>] [-s <interval>] [-o <offset>] [-t int|double|both]\n"
+	  "    [-d <devices>] [-m <months>] [-c <percent>] <dir>\n\n", exec_name );
+  printf( "    -n <samples>    Ring buffer size of every database. Default: 10000.\n" );
+  printf( "    -s <interval>   Seconds between samples. Default: 300.\n" );
+  printf( "    -o <offset>     Slot of the newest sample (file_offset), where the ring\n" );
+  printf( "                    buffer wraps. Default: two thirds of <samples>.\n" );
+  printf( "    -t <type>       Sample type of the databases. Default: both.\n" );
+  printf( "    -d <devices>    Number of databases of each type. Default: 1.\n" );
+  printf( "    -m <months>     Number of monthInfo entries in the old\n" );
+  printf( "                    config_happ_pwrusage.xml. Default: 120.\n" );
+  printf( "    -c <percent>    Part of the ring buffer window covered by the csv\n" );
+  printf( "                    files. Default: 60.\n" );
+}
+
+
+
+int gen_database( opts_s* opts, char* dir, int k, int integer, FILE* cfg,
+		  zip_s* usage_zip, zip_s* therm_zip ) {
+
+  char path[2 * MAX_LEN];
+  char uuid[64];
+  char name[64];
+  char interval[64];
+  char csv_name[256];
+  char line[128];
+  char *var;
+  buf_s dat = { 0 };
+  buf_s rra = { 0 };
+  buf_s csv = { 0 };
+  int n;
+  int t1;
+  int t;
+  int j;
+  int len;
+
+  /*
+   * One database with a single subset: the .dat header, the ring buffer
+   * and the csv file of the same device. k < 0 is the thermostat.
+   */
+
+  n  = opts->n_samples;
+  t1 = ( opts->t_newest / opts->interval ) * opts->interval;
+
+  if ( k < 0 ) {
+    snprintf( uuid, sizeof( uuid ), "bench-therm-000" );
+    snprintf( name, sizeof( name ), "thermstat" );
+    var = "temperature";
+  } else {
+    snprintf( uuid, sizeof( uuid ), "bench-%s-%03d", integer ? "int" : "dbl",
+	      k );
+    snprintf( name, sizeof( name ), "%s_%03d", integer ? "elec" : "gas", k );
+    var = integer ? "quantity" : "flow";
+  }
+  snprintf( interval, sizeof( interval ), "%ds", opts->interval );
+
+  fprintf( cfg, "  <rrdLogger>\n    <uuid>%s</uuid>\n    <name>%s</name>\n"
+	   "  </rrdLogger>\n", uuid, name );
+
+  /* .dat header */
+
+  buf_add( &dat, MAGIC, 17 );
+  buf_string( &dat, uuid );
+  buf_string( &dat, var );
+  buf_string( &dat, "svc" );
+  buf_string( &dat, integer ? "integer" : "double" );
+  if ( integer ) {
+    buf_int( &dat, 1 );
+    buf_int( &dat, 2 );
+    buf_int( &dat, 3 );
+  } else {
+    buf_double( &dat, 1.5 );
+    buf_double( &dat, 1000.0 );
+  }
+  buf_int( &dat, t1 - opts->interval );
+  buf_int( &dat, t1 );
+  buf_int( &dat, 1 );
+  snprintf( line, sizeof( line ), "%d", opts->interval );
+  buf_string( &dat, line );
+  buf_int( &dat, opts->offset );
+  buf_int( &dat, n );
+  buf_int( &dat, 0 );
+  buf_string( &dat, interval );
+  buf_string( &dat, "average" );
+
+  /* ring buffer, slot j holds the sample of t1 - ((offset - j) mod n) */
+
+  for ( j = 0; j < n; j++ ) {
+    t = t1 - ( ( opts->offset - j + n ) % n ) * opts->interval;
+    if ( integer ) {
+      buf_int( &rra, ( j % 17 == 5 ) ? 0x7fffffff :
+	       ( t / opts->interval ) % 1000 );
+    } else {
+      buf_double( &rra, ( j % 17 == 5 ) ? 0.0 / 0.0 :
+		  ( ( t / opts->interval ) % 1000 ) / 7.0 );
+    }
+  }
+
+  /* csv data, newest part of the window and a few samples past t1 */
+
+  t = t1 - (int)( (long long)n * opts->coverage / 100 ) * opts->interval;
+  for ( ; t <= t1 + 5 * opts->interval; t += opts->interval ) {
+    if ( integer ) {
+      len = snprintf( line, sizeof( line ), "%d,%d\n", t,
+		      5000 + ( t / opts->interval ) % 777 );
+    } else {
+      len = snprintf( line, sizeof( line ), "%d,%.3f\n", t,
+		      3.25 + ( t / opts->interval ) % 777 / 13.0 );
+    }
+    buf_add( &csv, line, len );
+  }
+
+  if ( k < 0 ) {
+    snprintf( csv_name, sizeof( csv_name ), "%s_%s.csv", name, interval );
+  } else {
+    snprintf( csv_name, sizeof( csv_name ), "%s_%s_%s.csv", name, var,
+	      interval );
+  }
+
+  snprintf( path, sizeof( path ), "%s/rra/%s.dat", dir, uuid );
+  if ( write_buf( path, &dat ) )
+    return -1;
+  snprintf( path, sizeof( path ), "%s/rra/%s-%s.rra", dir, uuid, interval );
+  if ( write_buf( path, &rra ) )
+    return -1;
+  snprintf( path, sizeof( path ), "%s/csv/%s", dir, csv_name );
+  if ( write_buf( path, &csv ) )
+    return -1;
+
+  zip_add( k < 0 ? therm_zip : usage_zip, csv_name, csv.p, csv.len );
+
+  free( dat.p );
+  free( rra.p );
+  free( csv.p );
+  return 0;
+}
+
+
+
+int gen_pwrusage( opts_s* opts, char* dir, int first, int old ) {
+
+  char path[MAX_LEN];
+  char *types[] = { "elec", "gas" };
+  FILE *fp;
+  int n;
+  int m;
+  int k;
+
+  /*
+   * monthInfo entries, from 2010 on. The new file starts halfway the old
+   * one and runs a year past it, so both overlap.
+   */
+
+  if ( old ) {
+    snprintf( path, sizeof( path ), "%s/old/config_happ_pwrusage.xml", dir );
+    m = 0;
+    n = opts->n_months;
+  } else {
+    snprintf( path, sizeof( path ), "%s/config_happ_pwrusage.xml", dir );
+    m = opts->n_months / 2;
+    n = opts->n_months + 12;
+  }
+
+  if ( ( fp = fopen( path, "w" ) ) == NULL ) {
+    fprintf( stderr, "Cannot write %s: %s\n", path, strerror( errno ) );
+    return -1;
+  }
+  fprintf( fp, "<toFile>\n  <header>bench</header>\n" );
+  for ( ; m < n; m++ ) {
+    for ( k = 0; k < 2; k++ ) {
+      fprintf( fp, "  <monthInfo>\n    <year>%d</year>\n    <month>%d</month>\n"
+	       "    <type>%s</type>\n    <value>%d</value>\n"
+	       "    <lowValue>%d</lowValue>\n  </monthInfo>\n",
+	       110 + m / 12, m % 12, types[k], 100 * m + k + ( old ? 0 : 1 ),
+	       50 * m );
+    }
+  }
+  fprintf( fp, "</toFile>\n" );
+  fclose( fp );
+  return 0;
+}
+
+
+
+void buf_add( buf_s* buf, void* data, size_t len ) {
+  if ( buf->len + len > buf->size ) {
+    buf->size = 2 * ( buf->len + len ) + 4096;
+    buf->p = realloc( buf->p, buf->size );
+  }
+  memcpy( buf->p + buf->len, data, len );
+  buf->len += len;
+}
+
+
+
+void buf_int( buf_s* buf, int val ) {
+  buf_add( buf, &val, sizeof( int ) );
+}
+
+
+
+void buf_double( buf_s* buf, double val ) {
+  buf_add( buf, &val, sizeof( double ) );
+}
+
+
+
+void buf_string( buf_s* buf, char* str ) {
+
+  /* length prefixed string, the length counts the terminating NUL */
+
+  buf_int( buf, (int)strlen( str ) + 1 );
+  buf_add( buf, str, strlen( str ) + 1 );
+}
+
+
+
+int write_buf( char* path, buf_s* buf ) {
+
+  FILE *fp;
+
+  if ( ( fp = fopen( path, "wb" ) ) == NULL ||
+       fwrite( buf->p, 1, buf->len, fp ) != buf->len || fclose( fp ) ) {
+    fprintf( stderr, "Cannot write %s: %s\n", path, strerror( errno ) );
+    return -1;
+  }
+  return 0;
+}
+
+
+
+void zip_put16( zip_s* zip, int val ) {
+
+  unsigned char b[2];
+
+  b[0] = val & 0xff;
+  b[1] = ( val >> 8 ) & 0xff;
+  buf_add( &zip->data, b, 2 );
+}
+
+
+
+void zip_put32( zip_s* zip, unsigned long val ) {
+  zip_put16( zip, val & 0xffff );
+  zip_put16( zip, ( val >> 16 ) & 0xffff );
+}
+
+
+
+void zip_add( zip_s* zip, char* name, void* data, size_t len ) {
+
+  z_stream strm;
+  unsigned char *out;
+  size_t out_size;
+  int i;
+
+  /* deflate data and append it as a local file entry */
+
+  i = zip->n_files++;
+  zip->names[i]  = strdup( name );
+  zip->crc[i]    = crc32( crc32( 0L, Z_NULL, 0 ), data, len );
+  zip->u_size[i] = len;
+  zip->offset[i] = zip->data.len;
+
+  memset( &strm, 0, sizeof( strm ) );
+  deflateInit2( &strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+		Z_DEFAULT_STRATEGY );
+  out_size = deflateBound( &strm, len );
+  out = malloc( out_size );
+  strm.next_in   = data;
+  strm.avail_in  = len;
+  strm.next_out  = out;
+  strm.avail_out = out_size;
+  deflate( &strm, Z_FINISH );
+  zip->c_size[i] = strm.total_out;
+  deflateEnd( &strm );
+
+  zip_put32( zip, 0x04034b50 );
+  zip_put16( zip, 20 );          /* version needed */
+  zip_put16( zip, 0 );           /* flags */
+  zip_put16( zip, 8 );           /* deflate */
+  zip_put16( zip, 0 );           /* time */
+  zip_put16( zip, 0x4e21 );      /* date, 2019-01-01 */
+  zip_put32( zip, zip->crc[i] );
+  zip_put32( zip, zip->c_size[i] );
+  zip_put32( zip, zip->u_size[i] );
+  zip_put16( zip, strlen( name ) );
+  zip_put16( zip, 0 );
+  buf_add( &zip->data, name, strlen( name ) );
+  buf_add( &zip->data, out, zip->c_size[i] );
+  free( out );
+}
+
+
+
+void zip_finish( zip_s* zip ) {
+
+  size_t dir_start;
+  size_t dir_size;
+  int i;
+
+  /* central directory and end of central directory record */
+
+  dir_start = zip->data.len;
+  for ( i = 0; i < zip->n_files; i++ ) {
+    zip_put32( zip, 0x02014b50 );
+    zip_put16( zip, 20 );        /* version made by */
+    zip_put16( zip, 20 );        /* version needed */
+    zip_put16( zip, 0 );
+    zip_put16( zip, 8 );
+    zip_put16( zip, 0 );
+    zip_put16( zip, 0x4e21 );
+    zip_put32( zip, zip->crc[i] );
+    zip_put32( zip, zip->c_size[i] );
+    zip_put32( zip, zip->u_size[i] );
+    zip_put16( zip, strlen( zip->names[i] ) );
+    zip_put16( zip, 0 );         /* extra */
+    zip_put16( zip, 0 );         /* comment */
+    zip_put16( zip, 0 );         /* disk */
+    zip_put16( zip, 0 );         /* internal attributes */
+    zip_put32( zip, 0 );         /* external attributes */
+    zip_put32( zip, zip->offset[i] );
+    buf_add( &zip->data, zip->names[i], strlen( zip->names[i] ) );
+    free( zip->names[i] );
+  }
+
+  dir_size = zip->data.len - dir_start;
+
+  zip_put32( zip, 0x06054b50 );
+  zip_put16( zip, 0 );           /* disk */
+  zip_put16( zip, 0 );           /* disk of the central directory */
+  zip_put16( zip, zip->n_files );
+  zip_put16( zip, zip->n_files );
+  zip_put32( zip, dir_size );
+  zip_put32( zip, dir_start );
+  zip_put16( zip, 0 );           /* comment */
+}
@@ -227,6 +227,96 @@ int jzReadData(JZFile *zip, JZFileHeader *header, void *buffer) {
     return Z_OK;
 }
 
+// Read data from file stream, described by header, in fixed size chunks
+int jzReadDataStream(JZFile *zip, JZFileHeader *header,
+        JZDataCallback callback, void *user_data) {
+    unsigned char window[JZ_STREAM_WINDOW];
+    long compressedLeft, uncompressedLeft;
+    size_t chunk, produced;
+    z_stream strm;
+    int ret = Z_OK;
+
+    if(header->compressionMethod == 0) { // Store - just copy it in chunks
+        for(uncompressedLeft = header->uncompressedSize; uncompressedLeft;
+                uncompressedLeft -= chunk) {
+            chunk = (sizeof(window) < uncompressedLeft) ?
+                sizeof(window) : uncompressedLeft;
+
+            if(zip->read(zip, window, chunk) < chunk || zip->error(zip))
+                return Z_ERRNO;
+
+            if(!callback(window, chunk, user_data))
+                return Z_ERRNO;
+        }
+    } else if(header->compressionMethod == 8) { // Deflate - using zlib
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+
+        strm.avail_in = 0;
+        strm.next_in = Z_NULL;
+
+        // Use inflateInit2 with negative window bits to indicate raw data
+        if((ret = inflateInit2(&strm, -MAX_WBITS)) != Z_OK)
+            return ret; // Zlib errors are negative
+
+        compressedLeft = header->compressedSize;
+        uncompressedLeft = header->uncompressedSize;
+
+        while(uncompressedLeft && ret != Z_STREAM_END) {
+            // Read next chunk when zlib has consumed the previous one
+            if(strm.avail_in == 0) {
+                if(compressedLeft == 0) {
+                    inflateEnd(&strm);
+                    return Z_DATA_ERROR; // truncated stream
+                }
+
+                strm.avail_in = zip->read(zip, jzBuffer,
+                        (sizeof(window) < compressedLeft) ?
+                        sizeof(window) : compressedLeft);
+
+                if(strm.avail_in == 0 || zip->error(zip)) {
+                    inflateEnd(&strm);
+                    return Z_ERRNO;
+                }
+
+                strm.next_in = jzBuffer;
+                compressedLeft -= strm.avail_in;
+            }
+
+            strm.avail_out = (sizeof(window) < uncompressedLeft) ?
+                sizeof(window) : uncompressedLeft;
+            strm.next_out = window;
+
+            ret = inflate(&strm, Z_NO_FLUSH);
+
+            if(ret == Z_STREAM_ERROR) return ret; // shouldn't happen
+
+            switch (ret) {
+                case Z_NEED_DICT:
+                    ret = Z_DATA_ERROR;     /* and fall through */
+                case Z_DATA_ERROR: case Z_MEM_ERROR:
+                    (void)inflateEnd(&strm);
+                    return ret;
+            }
+
+            produced = strm.next_out - window;
+            uncompressedLeft -= produced;
+
+            if(produced && !callback(window, produced, user_data)) {
+                inflateEnd(&strm);
+                return Z_ERRNO;
+            }
+        }
+
+        inflateEnd(&strm);
+    } else {
+        return Z_ERRNO;
+    }
+
+    return Z_OK;
+}
+
 
 typedef struct {
     JZFile handle;
@@ -283,3 +373,81 @@ jzfile_from_stdio_file(FILE *fp)
 
     return &(handle->handle);
 }
+
+
+typedef struct {
+    JZFile handle;
+    unsigned char *data;
+    size_t size;
+    size_t pos;
+} MemoryJZFile;
+
+static size_t
+memory_file_handle_read(JZFile *file, void *buf, size_t size)
+{
+    MemoryJZFile *handle = (MemoryJZFile *)file;
+
+    if(size > handle->size - handle->pos)
+        size = handle->size - handle->pos;
+
+    memcpy(buf, handle->data + handle->pos, size);
+    handle->pos += size;
+
+    return size;
+}
+
+static size_t
+memory_file_handle_tell(JZFile *file)
+{
+    MemoryJZFile *handle = (MemoryJZFile *)file;
+    return handle->pos;
+}
+
+static int
+memory_file_handle_seek(JZFile *file, size_t offset, int whence)
+{
+    MemoryJZFile *handle = (MemoryJZFile *)file;
+    long pos;
+
+    switch(whence) {
+        case SEEK_SET: pos = (long)offset; break;
+        case SEEK_CUR: pos = (long)handle->pos + (long)offset; break;
+        case SEEK_END: pos = (long)handle->size + (long)offset; break;
+        default: return -1;
+    }
+
+    if(pos < 0 || pos > (long)handle->size)
+        return -1;
+
+    handle->pos = pos;
+    return 0;
+}
+
+static int
+memory_file_handle_error(JZFile *file)
+{
+    return 0;
+}
+
+static void
+memory_file_handle_close(JZFile *file)
+{
+    free(file);
+}
+
+JZFile *
+jzfile_from_memory(void *data, size_t size)
+{
+    MemoryJZFile *handle = (MemoryJZFile *)malloc(sizeof(MemoryJZFile));
+
+    handle->handle.read = memory_file_handle_read;
+    handle->handle.tell = memory_file_handle_tell;
+    handle->handle.seek = memory_file_handle_seek;
+    handle->handle.error = memory_file_handle_error;
+    handle->handle.close = memory_file_handle_close;
+    handle->data = (unsigned char *)data;
+    handle->size = size;
+    handle->pos = 0;
+
+    return &(handle->handle);
+}
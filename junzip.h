@@ -29,6 +29,11 @@ struct JZFile {
 JZFile *
 jzfile_from_stdio_file(FILE *fp);
 
+// Zip file in a memory region. The region is not copied, and not freed on
+// close, so it has to outlive the returned handle
+JZFile *
+jzfile_from_memory(void *data, size_t size);
+
 typedef struct __attribute__ ((__packed__)) {
     uint32_t signature;
     uint16_t versionNeededToExtract; // unsupported
@@ -107,6 +112,19 @@ int jzReadLocalFileHeader(JZFile *zip, JZFileHeader *header,
 // Return value is zlib coded, e.g. Z_OK, or error code
 int jzReadData(JZFile *zip, JZFileHeader *header, void *buffer);
 
+// Callback prototype for streamed data reading. Called for each chunk of
+// uncompressed data, until all data has been passed or callback returns zero
+typedef int (*JZDataCallback)(void *data, size_t size, void *user_data);
+
+#define JZ_STREAM_WINDOW 16384
+
+// Read data from file stream, described by header, in chunks of at most
+// JZ_STREAM_WINDOW bytes, so memory use doesn't depend on the file size.
+// Return value is zlib coded, e.g. Z_OK, or error code (Z_ERRNO also when
+// the callback aborted)
+int jzReadDataStream(JZFile *zip, JZFileHeader *header,
+        JZDataCallback callback, void *user_data);
+
 #ifdef __cplusplus
 };
 #endif /* __cplusplus */
@@ -18,13 +18,7 @@
 
 #define VERSION                      "0.1.0"
 
-#define E_DATABASE_DIR_NOT_FOUND     255
-#define E_INSUFFICIENT_CL_ARGS       254
-#define E_BAD_DL_URL                 253
-#define E_INVALID_DATA_DIR           252
-#define E_INVALID_END_DATE           251
-#define E_NO_DAT_FILES_FOUND         250
-#define E_CANNOT_OPEN_DIR            249
+/* exit codes, E_ definitions, are in transfer-logs.h */
 
 #define MAGIC            "hcb_rrd_09082011A"
 #define EXIT_FAILURE     -1
@@ -72,16 +66,36 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>      /* FICLONE */
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
 #include <curl/curl.h>
 
+#include <pthread.h>
+
 #include <zlib.h>
 #include "junzip.h"
 #include "ezxml.h"
+#include "transfer-logs.h"
 
 #include <math.h>
+#include <float.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#elif defined( __ARM_NEON )
+#include <arm_neon.h>
+#endif
 
 #include <time.h>
+#include <sys/resource.h>
 
 
 /* struct for rra file contents definition */
@@ -107,6 +121,28 @@ typedef struct dat_sub_s {
   struct dat_sub_s *next;
 } dat_sub_s;
 
+/* 
+ * Per-run arena. Everything that lives until the end of a run (parsed .dat 
+ * files, paths, jobs) is carved out of a few large blocks and released in
+ * one go, instead of a malloc/free pair for every string.
+ */
+
+#define ARENA_BLOCK      65536
+
+typedef struct arena_s {
+  char   *base;
+  size_t size;
+  size_t used;
+  struct arena_s *next;  /* block filled before this one */
+} arena_s;
+
+/* bounds checked read position in a .dat file image */
+
+typedef struct cursor_s {
+  char   *p;
+  char   *end;
+} cursor_s;
+
 /* struct for data source and type definition */
 
 typedef struct dat_s {
@@ -126,68 +162,697 @@ typedef struct dat_s {
 
 
 
+/* struct for csv contents, filled in a single pass over the file */
+
+typedef struct csv_s {
+  int    data_type;
+  int    t_max;
+  int    t_min;     /* merged by an earlier incremental run, up to here */
+  int    t_last;    /* latest sample that went into the rra file */
+  int    n;         /* samples stored */
+  int    size;      /* samples allocated */
+  int    *time;
+  int    *int_val;
+  double *dble_val;
+  int    line_len;  /* partial line carried over between chunks */
+  int    n_filled;  /* slots written that were still empty */
+  char   line[LINE_LEN];
+} csv_s;
+
+#define CSV_CHUNK_LEN    65536
+
+/* 
+ * Scratch vectors, one set per thread. They only grow, up to the largest 
+ * database seen, so after the first few subsets no more heap traffic.
+ */
+
+#define SCRATCH_CSV      0  /* the csv_s itself */
+#define SCRATCH_TIME     1
+#define SCRATCH_VAL      2
+#define SCRATCH_CHUNK    3  /* file read buffer, .rrb bitmap */
+#define SCRATCH_RAW      4  /* .rrb samples */
+#define SCRATCH_OUT      5  /* csv output buffer */
+#define N_SCRATCH        6
+
+typedef struct scratch_s {
+  void   *buf[N_SCRATCH];
+  size_t size[N_SCRATCH];
+} scratch_s;
+
+/* 
+ * Buffered csv output, formatted by hand and written in CSV_CHUNK_LEN 
+ * blocks. Every field formatted in place fits in CSV_FIELD_LEN.
+ */
+
+#define CSV_FIELD_LEN    64
+
+typedef struct csv_out_s {
+  FILE   *fp;
+  char   *buf;
+  size_t len;
+  int    err;       /* a block could not be written */
+} csv_out_s;
+
+/* 
+ * Buffered xml output straight to a file descriptor, used to write 
+ * config files back (see write_xml_file).
+ */
+
+#define XML_OUT_LEN      8192
+#define XML_INDENT_LEN   64
+
+typedef struct xml_out_s {
+  int    fd;
+  int    err;
+  size_t len;
+  char   buf[XML_OUT_LEN];
+} xml_out_s;
+
+/* 
+ * Binary alternative to the csv files written with -r (.rrb). A header, 
+ * a bitmap with a bit set for every slot that holds a sample, and the 
+ * samples themselves, packed in chronological order at full precision.
+ * Slot i of the series is at t_start + i * interval.
+ */
+
+#define RRB_MAGIC        "hcb_rrb1"
+#define RRB_EXT          ".rrb"
+
+typedef struct rrb_head_s {
+  char   magic[8];
+  int    data_type;
+  int    t_start;
+  int    interval;
+  int    n_samples;
+  int    n_valid;
+} rrb_head_s;
+
+/* 
+ * Geometry of an .rra ring buffer, from its .dat subset. The newest sample,
+ * at timestamp_1, lives at file_offset; every slot before it is one interval
+ * older, wrapping around at n_samples. The oldest sample is in the slot 
+ * right after the newest one.
+ */
+
+typedef struct ring_s {
+  int    n_samples;
+  int    interval;
+  int    newest;    /* slot of the newest sample */
+  int    t_newest;
+  int    oldest;    /* slot of the oldest sample */
+  int    t_oldest;
+} ring_s;
+
+/* 
+ * Consolidation of csv samples into a slot, as with rrdtool: the slot at 
+ * time T gets the samples in ( T - interval, T ], combined according to the
+ * subset's consolidator, when there are at least minSamplesPerBin of them.
+ */
+
+#define CONS_AVERAGE     0
+#define CONS_MIN         1
+#define CONS_MAX         2
+#define CONS_SUM         3
+#define CONS_FIRST       4
+#define CONS_LAST        5
+
+typedef struct bin_s {
+  int    slot;      /* -1: empty */
+  int    cons;
+  int    n;
+  int    aligned;   /* a sample at the slot time itself */
+  int    t_last;
+  double value;
+} bin_s;
+
+/* 
+ * .rra ring buffer, mapped into memory and accessed as int or double vector, 
+ * depending on the sample type in the .dat file.
+ */
+
+/* 
+ * An .rra file opened for writing is a copy next to the live file 
+ * (RRA_TMP_EXT appended). Once it has been merged and synced, the slots 
+ * the merge wrote are copied back into the live file, see commit_rra_files.
+ */
+
+#define RRA_TMP_EXT      ".tmp"
+#define RRA_MAX_SAMPLES  ( 1 << 22 )  /* about 8 years of 1 minute samples */
+#define COPY_BUF_LEN     16384
+#define COPY_CHUNK_LEN   ( 1 << 24 )  /* per copy_file_range/sendfile call */
+
+typedef struct rra_s {
+  int    fd;
+  int    data_type;
+  int    n_samples;
+  int    writable;
+  int    mapped;    /* 0: short file, contents copied to heap instead */
+  int    dirty;     /* writable only: keep the copy at rra_close */
+  int    dirty_slot; /* the slots written, dirty_n of them from dirty_slot */
+  int    dirty_n;    /* on, wrapping at n_samples */
+  char   *tmp_path;
+  size_t size;
+  void   *base;
+  int    *int_val;
+  double *dble_val;
+} rra_s;
+
+/* 
+ * Contents of export.zip, kept in memory and indexed by file name, for 
+ * processing without writing the csv files to EXPORTS_LOCATION first.
+ */
+
+typedef struct export_s {
+  char   *name;
+  char   *data;
+  size_t size;
+  struct export_s *next;
+} export_s;
+
+typedef struct exports_s {
+  export_s *first;
+  int    n_files;
+  size_t n_bytes;
+} exports_s;
+
+/* 
+ * With -z, csv files are staged, and .rra files backed up, gzipped at a low
+ * level: GZ_EXT appended to the name. Readers use zlib's gz functions, which
+ * read plain files as they are.
+ */
+
+#define GZ_EXT           ".gz"
+#define GZ_WRITE_MODE    "wb1"
+
+typedef struct unzip_dest_s {
+  char   *path;     /* directory, with trailing '/' */
+  int    gz;        /* stage .csv entries gzipped */
+} unzip_dest_s;
+
+/* 
+ * State of an export.zip download, one per source toon. The body is kept in
+ * memory and zip entries that have arrived completely are unpacked while the
+ * rest is still coming in. Very large bodies are spooled to disk instead.
+ */
+
+typedef struct download_s {
+  char   *host;       /* source toon, as given with -d */
+  char   *url;
+  CURL   *curl;
+  CURLcode res;
+  char   *data;       /* body received so far */
+  size_t len;
+  size_t size;
+  FILE   *spool;      /* set once the body outgrew DL_SPOOL_LIMIT */
+  char   *spool_path;
+  size_t parsed;      /* offset of the first entry not unpacked yet */
+  int    streaming;   /* 0: entries can't be unpacked on the fly */
+  int    complete;    /* 1: all entries unpacked on the fly */
+  char   *dl_path;    /* staging directory to unpack into, or */
+  int    gz;          /* .csv entries staged gzipped (-z) */
+  exports_s *exports; /* index to unpack into */
+  size_t reported;
+} download_s;
+
+#define DL_SPOOL_LIMIT     ( 32 * 1024 * 1024 )
+#define DL_CONNECT_TIMEOUT 10   /* seconds */
+#define DL_LOW_SPEED_LIMIT 512  /* bytes/second ... */
+#define DL_LOW_SPEED_TIME  30   /* ... for this many seconds aborts */
+#define DL_POLL_TIMEOUT    1000 /* ms */
+#define DL_KEEPALIVE_IDLE  15   /* seconds, TCP keep-alive probes ... */
+#define DL_KEEPALIVE_INTVL 5    /* ... and their interval */
+#define DL_FILE_URL        "http://%s/%s"
+#define DL_PART_EXT        ".part"
+
+/*
+ * One connection to a source toon for fetching single files (-R), one
+ * after the other. The easy handle is kept for all requests, so curl
+ * reuses its connection instead of setting up a new one per file.
+ */
+
+typedef struct dl_session_s {
+  char   *host;
+  CURL   *curl;
+  int    n_files;     /* fetched so far */
+  long   n_bytes;
+  long   n_connects;  /* new connections, 1 when all requests shared one */
+} dl_session_s;
+
+/* 
+ * Latest sample merged per database subset, kept in STATE_FILE next to the
+ * databases for incremental runs (-i).
+ */
+
+#define STATE_FILE       "transfer-logs.state"
+#define T_NONE           ( -0x7fffffff - 1 )  /* before all data */
+
+typedef struct state_s {
+  char   *uuid;
+  char   *interval;
+  int    last_time;
+  struct state_s *next;
+} state_s;
+
+/* 
+ * Journal of a merge that has not been committed yet, next to the 
+ * databases, named after a hash of the source (directory, -m, -L, -i). A 
+ * line per subset merged, written once its copy has been synced: uuid, 
+ * interval, crc32 and size of the merged .rra, the latest sample merged
+ * (-i), and the slots merged. A run that finds the journal of an 
+ * interrupted run with the same source takes over the subsets whose merged
+ * copy, or live file once committed, still has that crc32. The journal 
+ * goes when the run is complete.
+ */
+
+#define JOURNAL_FILE     "%stransfer-logs.%08x.journal"
+#define JOURNAL_MAGIC    "transfer-logs journal 2"
+
+typedef struct jentry_s {
+  char   *uuid;
+  char   *interval;
+  unsigned long crc;
+  long   size;
+  int    last_time;
+  int    dirty[2];
+  struct jentry_s *next;
+} jentry_s;
+
+typedef struct journal_s {
+  int    fd;
+  jentry_s *entries;  /* of the interrupted run */
+} journal_s;
+
+/* uuid -> device name index, built from config_hcb_rrd.xml */
+
+typedef struct dev_entry_s {
+  char   *uuid;
+  char   *name;
+  struct dev_entry_s *next;
+} dev_entry_s;
+
+typedef struct dev_index_s {
+  int    n_buckets;  /* power of 2 */
+  dev_entry_s **buckets;
+} dev_index_s;
+
+/* config_hcb_rrd.xml files parsed by a library context, by path */
+
+typedef struct cfg_cache_s {
+  char   *path;
+  struct timespec mtime;
+  off_t  size;
+  dev_index_s *devices;
+  struct cfg_cache_s *next;
+} cfg_cache_s;
+
+/* 
+ * Regular files of a directory, sorted by name, from one readdir and an
+ * fstatat per entry. For a database directory, the .dat files with the 
+ * size of their database, .dat and .rra files, largest first.
+ */
+
+typedef struct dir_entry_s {
+  char   *name;
+  off_t  size;
+} dir_entry_s;
+
+typedef struct man_dat_s {
+  char   *name;       /* <uuid>.dat */
+  char   *uuid;
+  off_t  size;        /* <uuid>.dat plus <uuid>-*.rra */
+} man_dat_s;
+
+typedef struct manifest_s {
+  int    n_files;
+  dir_entry_s *files;
+  int    n_dats;
+  man_dat_s *dats;
+} manifest_s;
+
+/* 
+ * Library context (transfer-logs.h). Options are filled in with their 
+ * defaults by tl_open, the arena is reset, not freed, after each transfer.
+ */
+
+struct tl_ctx_s {
+  char   *rra_location;
+  char   *hcb_rrd_cfg;
+  char   *pwrusage_cfg;
+  char   *exports_location;
+  char   *backup_dir;
+  char   *max_date;
+  int    t_from;
+  int    t_to;
+  int    n_threads;
+  int    mem;
+  int    binary;
+  int    incremental;
+  int    plan;
+  int    gz;
+  cfg_cache_s *configs;
+  arena_s arena;
+};
+
+/* (year, month, type) -> monthInfo index for config_happ_pwrusage.xml */
+
+typedef struct month_entry_s {
+  char   *year;
+  char   *month;
+  char   *type;
+  ezxml_t node;      /* NULL once merged */
+  int    used;
+  struct month_entry_s *next;
+} month_entry_s;
+
+typedef struct month_index_s {
+  int    n_buckets;  /* power of 2 */
+  month_entry_s **buckets;
+  month_entry_s *entries;
+} month_index_s;
+
+/* 
+ * Run statistics for --stats: time spent per phase (monotonic clock) and
+ * counters, in total and per merged or exported .rra file. Jobs record 
+ * into their own stat_set_s through the stats_sink of the thread running
+ * them, the main thread adds those up once the jobs are done. Phase times
+ * of jobs are summed over all threads.
+ */
+
+#define PH_DOWNLOAD      0
+#define PH_UNZIP         1
+#define PH_BACKUP        2
+#define PH_PWRUSAGE      3
+#define PH_READ_DAT      4
+#define PH_PARSE         5  /* csv, .rrb or export.zip entry */
+#define PH_SORT          6  /* sort_data_for_rra */
+#define PH_WRITE         7  /* staging, fsync */
+#define PH_COMMIT        8  /* renames, directory sync */
+#define PH_EXPORT        9  /* -r */
+#define N_PHASES         10
+
+#define CNT_SAMPLES      0  /* samples read */
+#define CNT_MERGED       1  /* slots overwritten */
+#define CNT_FILLED       2  /* ... that were still empty */
+#define CNT_BYTES_IN     3
+#define CNT_BYTES_OUT    4
+#define N_COUNTERS       5
+
+typedef struct stat_set_s {
+  double t[N_PHASES];
+  long long n[N_COUNTERS];
+} stat_set_s;
+
+typedef struct stat_db_s {
+  char   *name;     /* .rra file merged, or file exported (-r) */
+  stat_set_s set;
+} stat_db_s;
+
+typedef struct stats_s {
+  int    enabled;
+  int    json;
+  double t_start;
+  stat_set_s total;
+  stat_db_s *dbs;
+  int    n_dbs;
+} stats_s;
+
+/* 
+ * Unit of work for the worker pool: one subset of one database, or the 
+ * console output collected while queueing a database (JOB_PRINT). With
+ * --plan, JOB_PLAN estimates a merge from the .dat geometry and the first
+ * and last csv sample, read from PLAN_SCAN_LEN bytes at either end.
+ */
+
+#define JOB_PRINT        0
+#define JOB_MERGE        1
+#define JOB_EXPORT       2
+#define JOB_PLAN         3
+
+#define PLAN_SCAN_LEN    4096
+
+typedef struct job_s {
+  int    type;
+  dat_s  *data;     /* owned by the JOB_PRINT job of each database */
+  int    subset;
+  char   *csv_path;
+  char   *fine_path; /* csv of the finest subset, when csv_path is missing */
+  char   *rra_path;
+  int    max_time;
+  int    t_from;    /* -r: export only samples in [t_from, t_to) */
+  int    t_to;
+  int    *last_time; /* incremental runs only, in the state list */
+  int    t_last;    /* latest sample merged, for *last_time once committed */
+  exports_s *exports;
+  int    staged;    /* merged copy of rra_path waits for commit_rra_files */
+  int    dirty[2];  /* first slot and number of slots merged, see write_back */
+  int    committed; /* rra_path holds the merge, or there was nothing to do */
+  int    resumed;   /* staged by an interrupted run, not merged again */
+  char   *uuid;
+  journal_s *journal;
+  int    planned;   /* --plan: slots the merge would overwrite, at most */
+  stat_set_s stats;
+  char   *out;      /* captured console output */
+  size_t out_len;
+  int    done;
+} job_s;
+
+typedef struct pool_s {
+  job_s  **jobs;
+  int    n_jobs;
+  int    next;
+  pthread_mutex_t lock;
+  pthread_cond_t  done;
+} pool_s;
+
+#define MAX_JOBS         64
+
+/* console output of the job running in this thread, NULL: stdout */
+
+static __thread FILE *job_out = NULL;
+
+static __thread scratch_s scratch;
+
+/* --stats, and where the current thread records (NULL: the totals) */
+
+static stats_s run_stats;
+static __thread stat_set_s *stats_sink = NULL;
+
+/* 
+ * sentinel scanning kernels, picked once at run time for the host cpu, see
+ * init_mark_valid
+ */
+
+static pthread_once_t mark_once = PTHREAD_ONCE_INIT;
+static int (*mark_int_fn)( int*, int, unsigned char*, int );
+static int (*mark_dble_fn)( double*, int, unsigned char*, int );
+
 /* function declarations */
 
 int    read_pwrusage_and_merge( char*, char*, char* );
-int    merge_data( char*, char*, dat_s*, int, int );
-char*  get_device_name( char*, char* );
+month_index_s* read_month_index( ezxml_t );
+month_entry_s* get_month_entry( month_index_s*, char*, char*, char* );
+void   free_month_index( month_index_s* );
+unsigned int hash_month( char*, char*, char* );
+int    merge_data( char*, char*, char*, dat_s*, int, int, int*, exports_s*,
+		   unsigned long*, int* );
+int    plan_merge( char*, char*, char*, dat_s*, int, int, int*, exports_s* );
+int    source_bounds( char*, exports_s*, int*, int* );
+int    gz_bounds( char*, int*, int* );
+int    csv_bounds( char*, size_t, int*, int* );
+int    csv_line_time( char*, char*, int* );
+char*  get_device_name( dev_index_s*, char* );
+dev_index_s* read_device_index( char* );
+dev_index_s* get_device_index( tl_ctx_s*, char* );
+void   free_device_index( dev_index_s* );
+unsigned int hash_str( char* );
 void   print_data( dat_s* );
-dat_s* read_dat_file( char* );
-char*  get_csv_path( char*, dat_s*, int );
-char*  get_rra_path( dat_s*, char*, char*, int );
-
-int    search( int*, int, int, int ); 
-void*  read_rra_file( char*, dat_s*, int );
-void*  read_csv_data( char*, dat_s*, int, int );
-int*   create_rra_time( dat_s*, int );
-int*   read_csv_time( char*, dat_s*, int, int );
-void*  sort_data_for_rra( dat_s*, int, void*, void*, int*, int* );
-
-size_t write_data(void*, size_t, size_t, FILE* );
-CURLcode download_export_zip( char*, char* );
-
-int   unzip( char*, char* );
-int   process_file( JZFile*, char* );
+dat_s* read_dat_file( char*, arena_s* );
+int    cursor_int( cursor_s*, int* );
+int    cursor_double( cursor_s*, double* );
+int    cursor_string( cursor_s*, int*, char** );
+int    read_dat_subset( cursor_s*, dat_sub_s*, int );
+char*  get_csv_path( char*, dat_s*, int, int, arena_s* );
+int    is_rrb_path( char* );
+char*  get_rra_path( dat_s*, char*, char*, int, arena_s* );
+
+void*  arena_alloc( arena_s*, size_t );
+char*  arena_strdup( arena_s*, char* );
+void   arena_free( arena_s* );
+void   arena_reset( arena_s* );
+void*  scratch_get( int, size_t );
+void   scratch_release( void );
+
+int    ring_init( ring_s*, dat_sub_s* );
+int    ring_slot_time( ring_s*, int );
+int    ring_time_slot( ring_s*, int );
+int    ring_slot_at( ring_s*, int );
+int    ring_time_at( ring_s*, int );
+int    ring_window( ring_s*, int, int, int* );
+int    ring_mark_valid( ring_s*, rra_s*, unsigned char* );
+int    ring_mark_range( ring_s*, rra_s*, unsigned char*, int, int );
+rra_s* rra_open( char*, dat_s*, int, int );
+int    rra_close( rra_s* );
+char*  rra_tmp_path( char*, char*, size_t );
+int    commit_rra_files( job_s**, int, char*, int* );
+int    write_back( char*, char*, size_t, int, int* );
+void   print_plan( job_s**, int );
+int    clone_fd( int, int );
+double stats_clock( void );
+double stats_start( void );
+void   stats_phase( int, double );
+void   stats_count( int, long long );
+void   stats_count_file( int, char* );
+void   stats_collect( job_s**, int );
+void   print_stats( void );
+int    copy_file( char*, char* );
+int    fsync_dir( char* );
+int    rra_mark_valid( rra_s*, int, int, unsigned char*, int );
+void   init_mark_valid( void );
+int    mark_int( int*, int, unsigned char*, int );
+int    mark_dble( double*, int, unsigned char*, int );
+int    sort_data_for_rra( dat_s*, int, csv_s*, rra_s* );
+int    ring_bin_slot( ring_s*, int );
+int    consolidator_type( char* );
+void   bin_add( bin_s*, int, int, double );
+int    bin_store( bin_s*, int, csv_s*, rra_s* );
+void   span_add( ring_s*, int, int*, int* );
+int    finest_subset( dat_s* );
+csv_s* read_merge_source( char*, dat_s*, int, int, exports_s* );
+
+csv_s* read_csv_file( char*, dat_s*, int, int );
+csv_s* read_csv_export( export_s*, dat_s*, int, int );
+csv_s* read_rrb_file( char*, dat_s*, int );
+void   csv_init( csv_s*, int, int, int );
+void   csv_feed( csv_s*, char*, size_t );
+void   csv_finish( csv_s* );
+int    csv_parse_line( csv_s*, char*, char* );
+
+void   csv_out_init( csv_out_s*, FILE* );
+void   csv_out_str( csv_out_s*, char* );
+void   csv_out_int( csv_out_s*, int );
+void   csv_out_fixed( csv_out_s*, double, int );
+int    csv_out_flush( csv_out_s* );
+
+size_t write_data( void*, size_t, size_t, void* );
+int    progress( void*, curl_off_t, curl_off_t, curl_off_t, curl_off_t );
+void   download_opts( CURL* );
+CURL*  download_handle( download_s* );
+int    download_export_zips( download_s*, int );
+int    open_session( dl_session_s*, char* );
+int    fetch_file( dl_session_s*, char*, char* );
+void   close_session( dl_session_s* );
+int    pull_rra_files( tl_ctx_s*, char*, char* );
+int    plain_name( char* );
+void   stream_zip_entries( download_s* );
+int    unpack_download( download_s*, int );
+void   free_downloads( download_s*, int );
+
+int   unzip( char*, char*, int );
+int   unzip_jzfile( JZFile*, char*, int );
+void  use_sizes( JZFileHeader*, JZFileHeader* );
+int   process_file( JZFile*, JZFileHeader*, char*, int );
 int   record_callback( JZFile*, int, JZFileHeader*, char*, void* );
-void  write_file( char*, char*, void*, long );
+int   write_chunk( void*, size_t, void* );
+int   write_gz_chunk( void*, size_t, void* );
+int   is_csv_name( char* );
 int   make_directory( char* );
 
-int   rra_to_csv( char* );
-int   download_exports_and_unzip( char* );
-int   inject_data( char*, char*, char* );
+int   rra_to_csv( tl_ctx_s*, char*, int );
+int   write_data_to_csv( char*, char*, dat_s*, int, int, int );
+int   write_data_to_rrb( char*, char*, dat_s*, int, int, int );
+int   download_exports_and_unzip( char*, char*, download_s**, int*, int, 
+				  int );
+int   inject_data( tl_ctx_s*, char*, exports_s*, int, char* );
+state_s* read_state( char* );
+int*  state_entry( state_s**, char*, char* );
+int   write_state( char*, state_s* );
+void  free_state( state_s* );
+journal_s* open_journal( char*, char* );
+jentry_s* journal_find( journal_s*, char*, char* );
+int   journal_add( journal_s*, job_s*, unsigned long );
+void  close_journal( journal_s*, char*, int );
+int   resume_subset( jentry_s*, char* );
+int   file_crc32( char*, long, unsigned long* );
+manifest_s* read_manifest( char*, arena_s* );
+dir_entry_s* manifest_find( manifest_s*, char* );
+int   manifest_lower( manifest_s*, char* );
+int   cmp_dir_entry( const void*, const void* );
+int   cmp_man_dat( const void*, const void* );
+char* find_merge_source( manifest_s*, exports_s*, char*, arena_s* );
+
+FILE*  out_stream( void );
+job_s* queue_job( job_s***, int*, int, arena_s* );
+void   start_output( job_s* );
+void   end_output( void );
+void   run_job( job_s* );
+void*  job_worker( void* );
+void   run_jobs( job_s**, int, int );
+void   free_jobs( job_s**, int );
 void  usage( char* );
-void  free_dat_s( dat_s* );
 int   dir_exist( char* );
 char* find_rra_databases( void );
-int   unzip_exports( char* );
-int   test_host( char* );
+int   unzip_exports( char*, int );
+
+exports_s* load_exports( char*, char* );
+int   load_zip_entries( JZFile*, exports_s* );
+int   load_callback( JZFile*, int, JZFileHeader*, char*, void* );
+int   load_entry( JZFile*, JZFileHeader*, exports_s* );
+export_s* find_export( exports_s*, char* );
+void  free_exports( exports_s* );
 int   test_date( char* );
-char* create_backups( char * );
+int   create_backups( char*, char*, char**, int );
+int   backup_file( char*, struct stat*, char*, char*, int );
+int   gzip_file( char*, char*, struct stat* );
+long  gz_size( char* );
+int   find_last_backup( char*, char*, char*, size_t );
 
-char* sprint_xml( ezxml_t, int, char* );
+int   write_xml_file( char*, ezxml_t );
 void  print_xml( ezxml_t, int );
-char* prettyprint( ezxml_t );
+void  write_xml_node( xml_out_s*, ezxml_t, int );
+void  xml_out_init( xml_out_s*, int );
+void  xml_out_write( xml_out_s*, char*, size_t );
+void  xml_out_str( xml_out_s*, char* );
+void  xml_out_text( xml_out_s*, char* );
+void  xml_out_indent( xml_out_s*, int );
+void  xml_out_flush( xml_out_s* );
+int   write_all( int, char*, size_t );
+char* opt_strdup( char*, char* );
 
 
 
+/* 
+ * TL_NO_MAIN leaves out main, for building libtransferlogs.a (make lib) and
+ * the benchmark driver in bench/ on top of this file.
+ */
+
+#ifndef TL_NO_MAIN
+
 int main ( int argc, char *argv[] ) 
 {
   int i;
   int err;
-  int dat_cnt;
   char* dl_dir = NULL;
-  char* dl_url = NULL;
+  char* dl_hosts = NULL;
+  char* pull_host = NULL;
   char* max_date = NULL;
+  char* from_date = NULL;
+  char* to_date = NULL;
   int exp_flag = 0;
   int rra_flag = 0;
   int dl_flag  = 0;
   int dir_flag = 0;
   int dat_flag = 0;
   int backup_flag = 0;
+  int mem_flag = 0;
+  int rrb_flag = 0;
+  int inc_flag = 0;
+  int plan_flag = 0;
+  int gz_flag = 0;
+  int n_threads = 1;
+  tl_opts_s opts;
+  tl_ctx_s* ctx;
 
   DIR* dir;
-  char* rra_location;
-  int j, k, l;
 
   /* post help msg when called without args */
 
@@ -202,6 +867,13 @@ int main ( int argc, char *argv[] )
   }
   printf( "\n" );
 
+  run_stats.t_start = stats_clock();
+
+  /* set default dl_dir */
+
+  dl_dir = calloc( MAX_LEN, sizeof ( char ) );
+  sprintf( dl_dir,  EXPORTS_LOCATION ); 
+
   /* parse command line args */
 
   for ( i = 1; i < argc; i++ ) {
@@ -211,22 +883,19 @@ int main ( int argc, char *argv[] )
 	  return 0;
     }
 
+    /* 
+     * comma separated list of source toons, reachability is only known 
+     * once the downloads have been tried 
+     */
+
     if( !strcmp( "-d", argv[i] ) ) {
-      dl_url = calloc( MAX_LEN, sizeof ( char ) );
       if ( argv[i+1] != NULL ) {
-	sprintf( dl_url, "http://%s", argv[i+1] );
-	if ( test_host( dl_url ) != 0 ) {
-	  fprintf( stderr, "Invalid IP-address supplied with option -d: %s\n",
-		   argv[i+1] );
-	  usage( argv[0] );
-	  return E_BAD_DL_URL;
-	} else  {
-	  sprintf( dl_url, "http://%s/export.zip", argv[i+1] );
-	  exp_flag = 1;
-	  dl_flag  = 1;
-	  rra_flag = 0;
-	  i++;
-	} 
+	dl_hosts = argv[i+1];
+	pull_host = NULL;
+	exp_flag = 1;
+	dl_flag  = 1;
+	rra_flag = 0;
+	i++;
       } else {
 	printf("Error: option -d requires an IP-address as extra argument\n");
 	usage( argv[0] );
@@ -234,11 +903,22 @@ int main ( int argc, char *argv[] )
       }
     }
     
-    /* set default dl_dir */
+    /* fetch the old toon's databases themselves, then as with -r */
+
+    if( !strcmp( "-R", argv[i] ) ) {
+      if ( argv[i+1] != NULL ) {
+	pull_host = argv[i+1];
+	exp_flag = 0;
+	dl_flag  = 1;
+	rra_flag = 1;
+	i++;
+      } else {
+	printf("Error: option -R requires an IP-address as extra argument\n");
+	usage( argv[0] );
+	return E_INSUFFICIENT_CL_ARGS;
+      }
+    }
 
-    dl_dir = calloc( MAX_LEN, sizeof ( char ) );
-    sprintf( dl_dir,  EXPORTS_LOCATION ); 
- 
     /* set dl_dir directory for data to be imported */
 
     if( !strcmp( "-u", argv[i] ) ) {
@@ -276,6 +956,25 @@ int main ( int argc, char *argv[] )
       }	
     }
 
+    /* with -r, convert only the data of these days */
+
+    if ( !strcmp( "--from", argv[i] ) || !strcmp( "--to", argv[i] ) ) {
+      if ( ( argv[i+1] != NULL ) && 
+	   ( test_date( argv[i+1] ) != 0x7fffffff ) ) {
+	if ( !strcmp( "--from", argv[i] ) ) {
+	  from_date = argv[i+1];
+	} else {
+	  to_date = argv[i+1];
+	}
+	i++;
+      } else {
+	printf("Error: option %s requires a valid date (YYYY-mm-dd) as extra argument\n",
+	       argv[i] );
+	usage( argv[0] );
+	return E_INVALID_END_DATE;
+      }
+    }
+
     /* read already downloaded exports */
       
     if( !strcmp( "-e", argv[i] ) ) {
@@ -293,13 +992,69 @@ int main ( int argc, char *argv[] )
       exp_flag = 0;
       rra_flag = 1;
     }
+
+    /* keep export.zip contents in memory */
+
+    if( !strcmp( "-m", argv[i] ) ) {
+      mem_flag = 1;
+    }
+
+    /* incremental: skip data merged by earlier runs with -i */
+
+    if( !strcmp( "-i", argv[i] ) ) {
+      inc_flag = 1;
+    }
+
+    /* binary intermediate files instead of csv */
+
+    if( !strcmp( "-B", argv[i] ) ) {
+      rrb_flag = 1;
+    }
+
+    /* gzip staged csv files and .rra backups */
+
+    if( !strcmp( "-z", argv[i] ) ) {
+      gz_flag = 1;
+    }
+
+    /* report what a merge would change, change nothing */
+
+    if( !strcmp( "--plan", argv[i] ) ) {
+      plan_flag = 1;
+    }
+
+    /* timing and counters, printed at the end of the run */
+
+    if( !strcmp( "--stats", argv[i] ) ) {
+      run_stats.enabled = 1;
+    }
+    if( !strcmp( "--stats=json", argv[i] ) ) {
+      run_stats.enabled = 1;
+      run_stats.json    = 1;
+    }
+
+    /* number of databases processed in parallel */
+
+    if( !strcmp( "-j", argv[i] ) ) {
+      if ( ( argv[i+1] != NULL ) && ( atoi( argv[i+1] ) > 0 ) ) {
+	n_threads = atoi( argv[i+1] );
+	if ( n_threads > MAX_JOBS ) 
+	  n_threads = MAX_JOBS;
+	i++;
+      } else {
+	printf("Error: option -j requires a number of jobs as extra argument\n");
+	usage( argv[0] );
+	return E_INSUFFICIENT_CL_ARGS;
+      }
+    }
   }
   
   /* take action according to cl flags */
 
   if ( ( !( exp_flag | rra_flag ) ) | 
        ( !(  dl_flag | dir_flag ) ) | 
-       ( !( exp_flag | dir_flag ) ) ) {
+       ( !( exp_flag | dir_flag | ( pull_host != NULL ) ) ) |
+       ( dl_flag & exp_flag & ( dl_hosts == NULL ) ) ) {
     fprintf( stderr, "Error: Insufficient or invalid command line arguments\n" );
     usage( argv[0] );
     return E_INSUFFICIENT_CL_ARGS;
@@ -307,1720 +1062,5622 @@ int main ( int argc, char *argv[] )
 
   /* check for existence of local database dir */
 
-  if( ( rra_location = find_rra_databases() ) == NULL ) {
+  memset( &opts, 0, sizeof( opts ) );
+  opts.max_date    = max_date;
+  opts.from_date   = from_date;
+  opts.to_date     = to_date;
+  opts.n_threads   = n_threads;
+  opts.mem         = mem_flag;
+  opts.binary      = rrb_flag;
+  opts.incremental = inc_flag;
+  opts.plan        = plan_flag;
+  opts.gz          = gz_flag;
+
+  if ( from_date && to_date && 
+       ( test_date( from_date ) > test_date( to_date ) ) ) {
+    fprintf( stderr, "Error: --from %s is after --to %s\n", from_date, 
+	     to_date );
+    return E_INVALID_END_DATE;
+  }
+
+  if( ( ctx = tl_open( &opts ) ) == NULL ) {
     fprintf( stderr, 
 	     "find_rra_databases: Cannot find database directory\n" ); 
     return E_DATABASE_DIR_NOT_FOUND;
   } else {    
     printf( "find_rra_databases: rra database location: %s\n", 
-	    rra_location );
+	    tl_rra_location( ctx ) );
   }
 
   /* thou shalt make back-ups! */
 
   if ( backup_flag ) {
     fprintf( stderr, "Handling back-ups ...\n" );
-    create_backups( rra_location );
+    if ( ( err = tl_backup( ctx ) ) ) {
+      fprintf( stderr, "Error: Back-up incomplete, nothing changed\n" );
+      tl_close( ctx );
+      return err;
+    }
     fprintf( stderr, "Back-up completed.\n" );
   }
 
-  if ( ( dir_flag & rra_flag ) == 1 ) {
-
-    /* process config_happ_pwrusage.xml if available */
+  if ( dat_flag ) {
+    printf( "Processing data generated until %s, midnight\n", max_date );
+  }
 
-    read_pwrusage_and_merge( dl_dir, PWRUSAGE_CFG, max_date );
+  if ( ( dir_flag & rra_flag ) == 1 ) {
 
     printf( "Converting old .rra files in %s to .csv format\n", dl_dir );
+    err = tl_convert( ctx, dl_dir );
 
   } else if ( dir_flag & exp_flag ) {
     
     printf( "Processing export.zip file in %s\n", dl_dir );
-    err = unzip_exports( dl_dir );
+    err = tl_inject( ctx, dl_dir );
     
+  } else if ( dl_flag & rra_flag ) {
+
+    printf( "Converting old .rra files from: %s\n", pull_host );
+    err = tl_pull( ctx, pull_host );
+
   } else if ( dl_flag & exp_flag ) {
     
-    printf( "Processing export file: %s\n", dl_url );
-    err = download_exports_and_unzip( dl_url );
-    free( dl_url );
+    printf( "Processing export files from: %s\n", dl_hosts );
+    err = tl_fetch( ctx, dl_hosts );
 
   } else {
   
     fprintf( stderr, "\nImpossible error. You have reached unreachable code :-)\n\n" );
     fprintf( stderr, "Please report this, along with the program call and all its output\n");
     fprintf( stderr, "to marcelr at the domotica forum (domoticaforum.eu)\n");
+    err = EXIT_FAILURE;
 
   }
-    
-  if ( dl_flag ) {
-    rra_flag = 0;
-  }
-  
-
-  /* process uploaded .rra databases */
-  
-  if ( rra_flag & dir_flag ) {
 
-    /* preprocess all old rra databases */
+  tl_close( ctx );
 
-    dat_cnt = rra_to_csv( dl_dir );
-    printf("%d old .dat files found \n", dat_cnt );
-  }
-  
-  /* inject old data into .rra databases */
-  
-  if ( dat_flag ) {
-    printf( "Processing data generated until %s, midnight\n", max_date );
+  if ( run_stats.enabled ) {
+    print_stats();
   }
-  
-  dat_cnt = inject_data( rra_location, dl_dir, max_date );
-  
 
-  return 0;
+  return err;
 }
 
+#endif /* TL_NO_MAIN */
 
 
-int read_pwrusage_and_merge( char *pwrusage_path_o, char *pwrusage_path_n, 
-			     char *max_date ) {
 
-  FILE* fp_o;
-  FILE* fp_n;
-  ezxml_t doc_n;
-  ezxml_t doc_o;
-  ezxml_t doc_w;
+tl_ctx_s* tl_open( tl_opts_s* opts ) {
 
-  ezxml_t monthInfo_o;
-  ezxml_t monthInfo_n;
-  ezxml_t monthInfo_i;
-  ezxml_t monthInfo_w;
-  ezxml_t year_o;
-  ezxml_t month_o;
-  ezxml_t type_o;
-  ezxml_t year_n;
-  ezxml_t month_n;
-  ezxml_t type_n;
+  tl_ctx_s* ctx;
 
-  ezxml_t tag;
-  ezxml_t tag_w;
+  /* 
+   * Options are copied, with defaults for those not given. The database 
+   * location is looked up here, once for all transfers with this context.
+   */
 
-  char path_o[1024];
-  char *txt_o;
-  char *txt_n;
+  if ( opts->max_date && ( ( test_date( opts->max_date ) == 0 ) || 
+			   ( test_date( opts->max_date ) == 0x7fffffff ) ) ) {
+    fprintf( stderr, "tl_open: Invalid date %s\n", opts->max_date );
+    return NULL;
+  }
+  if ( ( opts->from_date && ( test_date( opts->from_date ) == 0x7fffffff ) ) ||
+       ( opts->to_date && ( test_date( opts->to_date ) == 0x7fffffff ) ) || 
+       ( opts->from_date && opts->to_date && 
+	 ( test_date( opts->from_date ) > test_date( opts->to_date ) ) ) ) {
+    fprintf( stderr, "tl_open: Invalid date range\n" );
+    return NULL;
+  }
 
-  char *year_o_s;
-  char *year_n_s;
-  char *month_o_s;
-  char *month_n_s;
-  char *month_w_s;
-  char *type_o_s;
-  char *type_n_s;
-  static char *doc_out = 0;
+  ctx = calloc( 1, sizeof( tl_ctx_s ) );
 
-  int write_flag;
-  int idx_cnt;
-  int cnt;
-  int index_w;
-  int index_n;
-  int index;
-  time_t max_time;
-  time_t act_time;
+  /* test_date returns midnight at the end of the day, --to includes it */
 
-  struct tm loc_time = {0};
+  ctx->t_from = opts->from_date ? test_date( opts->from_date ) - 86400 : 0;
+  ctx->t_to   = test_date( opts->to_date );
 
-  strcat( path_o, pwrusage_path_o );
-  strcat( path_o, "/config_happ_pwrusage.xml" );
+  if ( opts->rra_location ) {
+    ctx->rra_location = opt_strdup( opts->rra_location, NULL );
+  } else if ( ( ctx->rra_location = find_rra_databases() ) == NULL ) {
+    free( ctx );
+    return NULL;
+  }
 
-  printf("\nCopying monthly data as stored in config_happ_pwrusage.xml\n\n");
+  ctx->hcb_rrd_cfg      = opt_strdup( opts->hcb_rrd_cfg, HCB_RRD_CFG );
+  ctx->pwrusage_cfg     = opt_strdup( opts->pwrusage_cfg, PWRUSAGE_CFG );
+  ctx->exports_location = opt_strdup( opts->exports_location, 
+				      EXPORTS_LOCATION );
+  ctx->backup_dir       = opt_strdup( opts->backup_dir, "/HCBv2/rra_backups" );
+  ctx->max_date         = opt_strdup( opts->max_date, NULL );
+  ctx->n_threads        = ( opts->n_threads > 0 ) ? opts->n_threads : 1;
+  if ( ctx->n_threads > MAX_JOBS ) 
+    ctx->n_threads = MAX_JOBS;
+  ctx->mem              = opts->mem;
+  ctx->binary           = opts->binary;
+  ctx->incremental      = opts->incremental;
+  ctx->plan             = opts->plan;
+  ctx->gz               = opts->gz;
+
+  return ctx;
+}
 
-  if ( ( fp_o = fopen( path_o , "r" ) ) > 0 ) {
 
-    if ( ( fp_n = fopen( pwrusage_path_n , "rw" ) ) > 0 ) {
 
-      /* read new data */ 
+void tl_close( tl_ctx_s* ctx ) {
 
-      if ( ( doc_n = ezxml_parse_file( pwrusage_path_n ) ) == NULL ) {
-	fclose( fp_n );
-	fprintf( stderr, "ezxml_parse_file returned NULL\n");
-	return -4;
-      }
-      fclose( fp_n );
+  cfg_cache_s* cfg;
+  cfg_cache_s* next;
 
-    } else {
-      fprintf( stderr, 
-	       "Cannot open new config_happ_pwrusage.xml for reading/writing\n" );
-      return -2;
-    }
+  if ( ctx == NULL ) 
+    return;
 
-    /* read old data */
+  for ( cfg = ctx->configs; cfg; cfg = next ) {
+    next = cfg->next;
+    free_device_index( cfg->devices );
+    free( cfg->path );
+    free( cfg );
+  }
+  arena_free( &ctx->arena );
+  scratch_release();
+
+  free( ctx->rra_location );
+  free( ctx->hcb_rrd_cfg );
+  free( ctx->pwrusage_cfg );
+  free( ctx->exports_location );
+  free( ctx->backup_dir );
+  free( ctx->max_date );
+  free( ctx );
+}
 
-      if ( ( doc_o = ezxml_parse_file( path_o ) ) == NULL ) {
-	fclose( fp_o );
-	fprintf( stderr, "ezxml_parse_file returned NULL\n");
-	return -3;
-      }
-      fclose( fp_o );
 
- } else {
-    fprintf( stderr, 
-	     "Cannot open old config_happ_pwrusage.xml for reading\n" );
-    return -1;
-  }
 
-  /* parse file contents and merge */
- 
-  /* create new struct for writing data */
+char* tl_rra_location( tl_ctx_s* ctx ) {
+  return ctx->rra_location;
+}
 
-  doc_w = ezxml_new( "toFile" );
-  index = 0;
-   
-  for ( monthInfo_o = ezxml_child( doc_o, "monthInfo" ); monthInfo_o; 
-	monthInfo_o = monthInfo_o->next ) {
 
-    write_flag = 0;
 
-    month_o = ezxml_child( monthInfo_o, "month" );
-    year_o  = ezxml_child( monthInfo_o, "year" );
-    type_o  = ezxml_child( monthInfo_o, "type" );
+int tl_backup( tl_ctx_s* ctx ) {
 
-    year_o_s  = ezxml_txt( year_o );
-    month_o_s = ezxml_txt( month_o );
-    type_o_s  = ezxml_txt( type_o );
+  char* configs[3];
+  double t0;
 
-    printf("Copying      config_happ_pwrusage.xml (old): year: %d, month: %2d, type: %s\n",  
-	   atoi(year_o_s) + 1900, atoi(month_o_s) + 1, type_o_s );
+  configs[0] = ctx->hcb_rrd_cfg;
+  configs[1] = ctx->pwrusage_cfg;
+  configs[2] = NULL;
 
-    /* replace existing entries in new data file */
+  t0 = stats_start();
+  if ( create_backups( ctx->rra_location, ctx->backup_dir, configs, 
+		       ctx->gz ) ) {
+    return E_BACKUP_FAILED;
+  }
+  stats_phase( PH_BACKUP, t0 );
+  return 0;
+}
 
-    idx_cnt = 0;
 
-    for ( monthInfo_n = ezxml_child( doc_n, "monthInfo" ); monthInfo_n; 
-	  monthInfo_n = monthInfo_n->next ) {
 
-     if ( idx_cnt == 0 ) {
-	index_w = (int)monthInfo_n->off;
-      }
+int tl_convert( tl_ctx_s* ctx, char* dir ) {
 
-      idx_cnt++;
+  char state_path[2 * MAX_LEN];
+  int dat_cnt;
+  double t0;
 
-      month_n = ezxml_child( monthInfo_n, "month" );
-      year_n  = ezxml_child( monthInfo_n, "year" );
-      type_n  = ezxml_child( monthInfo_n, "type" );
- 
-      year_n_s  = ezxml_txt( year_n );
-      month_n_s = ezxml_txt( month_n );
-      type_n_s  = ezxml_txt( type_n );
-            
-      if ( !( strcmp( year_o_s,  year_n_s  ) | 
-	      strcmp( month_o_s, month_n_s ) |
-	      strcmp( type_o_s,  type_n_s  ) ) ) {
+  /* process config_happ_pwrusage.xml if available, not for a plan */
 
-	/* check time limit */
+  if ( !ctx->plan ) {
+    t0 = stats_start();
+    read_pwrusage_and_merge( dir, ctx->pwrusage_cfg, ctx->max_date );
+    stats_phase( PH_PWRUSAGE, t0 );
+  }
 
-	max_time = test_date( max_date );
-	loc_time.tm_year = atoi( year_o_s );
-	loc_time.tm_mon  = atoi( month_o_s );
-	loc_time.tm_mday = 1;
+  /* preprocess all old rra databases */
 
-	act_time = mktime( &loc_time );
+  if ( ( dat_cnt = rra_to_csv( ctx, dir, ctx->binary ) ) < 0 ) 
+    return -dat_cnt;
+  printf("%d old .dat files found \n", dat_cnt );
 
-	if ( ( max_time  > act_time ) ) {
-	  printf("Overwriting  config_happ_pwrusage.xml (new): year: %d, month: %2d, type: %s\n\n",  
-		 atoi(year_n_s) + 1900, atoi(month_n_s) + 1, type_n_s );
+  /* inject old data into .rra databases */
 
-	/* copy data into new xml struct: */
+  snprintf( state_path, sizeof( state_path ), "%s%s", ctx->rra_location, 
+	    STATE_FILE );
+  dat_cnt = inject_data( ctx, dir, NULL, ctx->binary, 
+			 ctx->incremental ? state_path : NULL );
 
-	  month_w_s = ezxml_toxml( monthInfo_o );
-	} else {
+  return ( dat_cnt < 0 ) ? -dat_cnt : 0;
+}
 
-	  /* keep new entries that weren't available from the old data */
 
-	  printf("Keeping      config_happ_pwrusage.xml (new): year: %d, month: %2d, type: %s\n\n",  
-		 atoi(year_n_s) + 1900, atoi(month_n_s) + 1, type_n_s );
-	  month_w_s = ezxml_toxml( monthInfo_n );
-	}
 
-	monthInfo_w = ezxml_parse_str( month_w_s, strlen( month_w_s ) );
-	ezxml_move( monthInfo_w, doc_w, index );
-	index++;
-	
-	write_flag = 1;
-      }
+int tl_inject( tl_ctx_s* ctx, char* dir ) {
+
+  char state_path[2 * MAX_LEN];
+  exports_s* exports = NULL;
+  int dat_cnt;
+  double t0;
+
+  t0 = stats_start();
+  if ( ctx->mem ) {
+    if ( ( exports = load_exports( dir, "export.zip" ) ) == NULL ) {
+      return E_UNZIP_FAILED;
     }
-    
-    if ( write_flag == 0 ) {
- 
-      /* 
-       * Entry wasn't available in new file, so add it, irrespective of a 
-       * user-set time limit.
-       */
+  } else if ( unzip_exports( dir, ctx->gz ) ) {
+    return E_UNZIP_FAILED;
+  }
+  stats_phase( PH_UNZIP, t0 );
 
-      cnt = 0;
+  snprintf( state_path, sizeof( state_path ), "%s%s", ctx->rra_location, 
+	    STATE_FILE );
+  dat_cnt = inject_data( ctx, dir, exports, 0, 
+			 ctx->incremental ? state_path : NULL );
+  free_exports( exports );
 
-      /* get all children in this tag */
+  return ( dat_cnt < 0 ) ? -dat_cnt : 0;
+}
 
-      tag = monthInfo_o->child;
-      if ( tag != NULL ) {
 
-	monthInfo_w = ezxml_new("monthInfo");
-	printf( "  tag: %32s: ",  tag->name );
-	printf( "%s\n", tag->txt );
-	tag_w = ezxml_new( tag->name );
-	tag_w = ezxml_set_txt( tag_w, tag->txt);
-       	ezxml_move( tag_w, monthInfo_w, cnt );
-
-	while ( tag = tag->sibling ) {
-	  cnt++;
-	  printf( "  tag: %32s: ",  tag->name );
-	  printf( "%s\n", tag->txt );
-	  tag_w = ezxml_new( tag->name );
-	  tag_w = ezxml_set_txt( tag_w, tag->txt);
-	  ezxml_move( tag_w, monthInfo_w, cnt );
-	} 
-      }
 
-      /* insert after the already available data */
+int tl_fetch( tl_ctx_s* ctx, char* hosts ) {
 
-	printf("Writing into config_happ_pwrusage.xml (new): year: %d, month: %2d, type: %s\n\n",  atoi(year_o_s) + 1900, atoi(month_o_s) + 1, type_o_s );
-
-      ezxml_move( monthInfo_w, doc_w, index );
-      index++;
-    }
-  } /*  end for ( monthInfo_o = ezxml_child ...  */ 
-
-  /* all data gathered, now replace in the output xml struct */
+  char state_path[2 * MAX_LEN];
+  download_s* dls = NULL;
+  int n_dls = 0;
+  int dat_cnt;
+  int err = 0;
+  int i;
 
-  while ( ezxml_child( doc_n, "monthInfo" ) ) {
-    ezxml_remove( ezxml_child( doc_n, "monthInfo" ) );
-  }
-  while ( ezxml_child( doc_w, "monthInfo" ) ) {
-    ezxml_move( ezxml_child( doc_w, "monthInfo" ), doc_n, index_w );
-    index_w++;
+  if ( download_exports_and_unzip( hosts, ctx->exports_location, &dls, 
+				   &n_dls, ctx->mem, ctx->gz ) == 0 ) {
+    fprintf( stderr, "Error: No export.zip could be downloaded\n" );
+    free_downloads( dls, n_dls );
+    return E_BAD_DL_URL;
   }
 
-  /* write modified data to file */
+  /* one source after the other, in the order given with -d */
 
-  doc_out = prettyprint( doc_n );
+  for ( i = 0; i < n_dls; i++ ) {
+    if ( dls[i].res != CURLE_OK ) 
+      continue;
+    printf( "Injecting data from %s\n", dls[i].host );
 
-  //fp_n = fopen( "test1212.xml", "w" );
-  fp_n = fopen( pwrusage_path_n, "w" );
-  fprintf( fp_n, "%s\n", doc_out );
-  fclose( fp_n );
+    /* separate state per source toon, each has its own history */
 
-  /* clean up */
+    if ( n_dls > 1 ) {
+      snprintf( state_path, sizeof( state_path ), "%stransfer-logs.%s.state",
+		ctx->rra_location, dls[i].host );
+    } else {
+      snprintf( state_path, sizeof( state_path ), "%s%s", ctx->rra_location, 
+		STATE_FILE );
+    }
+    dat_cnt = inject_data( ctx, dls[i].dl_path, dls[i].exports, 0, 
+			   ctx->incremental ? state_path : NULL );
+    if ( dat_cnt < 0 ) {
+      err = -dat_cnt;
+      break;
+    }
+  }
+  free_downloads( dls, n_dls );
 
-  ezxml_free( doc_n );
-  ezxml_free( doc_o );
-	  
-  return 0;
+  return err;
 }
 
 
-char* prettyprint( ezxml_t root ) {
-  char* doc;
-  doc = calloc( 1, 1 );
-  doc = sprint_xml( root, 2, doc );
-  return doc;
-}
 
+int tl_pull( tl_ctx_s* ctx, char* host ) {
 
-char* sprint_xml( ezxml_t node, int indent_len, char* out ) {
-  int cnt;
-  int len;
-  int len_t;
-  char* tmp;
+  char dir[2 * MAX_LEN];
+  int dat_cnt;
+  double t0;
 
-  while( node ) {
- 
-    tmp = calloc( 256, sizeof( char ) );
+  /* staged per source toon, like downloads from several toons with -d */
 
-    /* print 1st part of opening tag with or without attributes */
+  snprintf( dir, sizeof( dir ), "%s%s/", ctx->exports_location, host );
 
-    printf( "%*c<%s",  indent_len*2, ' ', node->name );
-    sprintf( tmp, "%*c<%s",  indent_len*2, ' ', node->name );
-    out = realloc( out, strlen( out ) + strlen( tmp ) + 1 );
-    strcat( out, tmp );
-    free( tmp );
+  t0 = stats_start();
+  dat_cnt = pull_rra_files( ctx, host, dir );
+  stats_phase( PH_DOWNLOAD, t0 );
+  if ( dat_cnt < 0 )
+    return -dat_cnt;
 
-    /* add attributes if present */
+  return tl_convert( ctx, dir );
+}
 
-    cnt = 0;
-    while ( *(node->attr+cnt) != NULL ) {
-     
-      printf( " %s=\"%s\"", *(node->attr+cnt), *(node->attr+cnt+1) );
-      tmp = calloc( 256, sizeof( char ) );
-      sprintf( tmp, " %s=\"%s\"", *(node->attr+cnt), *(node->attr+cnt+1) );
-      out = realloc( out, strlen( out ) + strlen( tmp ) + 1 );
-      strcat( out, tmp );
-      free( tmp );
-      
-      cnt += 2;
-    }
-    
-    if ( node->child ) {
 
-      /* close opening tag and move on to children */
-      printf( ">\n" );
-      tmp = calloc( 256, sizeof( char ) );
-      sprintf( tmp,  ">\n" );
-      out = realloc( out, strlen( out ) + strlen( tmp ) + 1 );
-      strcat( out, tmp );
-      free( tmp );
-      out = sprint_xml( node->child, indent_len + 1, out );
-      
-      /* print closing tag for parent */
 
-      tmp = calloc( 256, sizeof( char ) );
-      printf( "%*c</%s>\n", (indent_len) * 2, ' ', node->name );
-      sprintf( tmp, "%*c</%s>\n", (indent_len) * 2, ' ', node->name );
-      out = realloc( out, strlen( out ) + strlen( tmp ) + 1 );
-      strcat( out, tmp );
-      free( tmp );
+char* opt_strdup( char* str, char* def ) {
 
-    } else {
+  /* copy of an option string, or of its default when not given */
 
-      /* print value and closing tag */
-      printf( ">%s</%s>\n", node->txt, node->name );
-      tmp = calloc( 256, sizeof( char ) );
-      sprintf( tmp,  ">%s</%s>\n", node->txt, node->name );
-      out = realloc( out, strlen( out ) + strlen( tmp ) + 1 );
-      strcat( out, tmp );
-      free( tmp );
-      out = sprint_xml( node->child, indent_len + 1, out );
-    }
-    
-    if ( node->sibling ) {
-      out = sprint_xml( node->sibling, indent_len, out );
-    } 
+  if ( str == NULL ) 
+    str = def;
+  return str ? strdup( str ) : NULL;
+}
 
-    node = node->next;
 
-  }
-  return out;
-}
 
-void print_xml( ezxml_t node, int indent_len ) {
-  int cnt;
-  int len;
-  int len_t;
-  char* out;
-  char* tmp;
+int read_pwrusage_and_merge( char *pwrusage_path_o, char *pwrusage_path_n, 
+			     char *max_date ) {
 
-  while( node ) {
+  ezxml_t doc_n;
+  ezxml_t doc_o;
+  ezxml_t doc_w;
 
-    /* print 1st part of opening tag with or without attributes */
+  ezxml_t monthInfo_o;
+  ezxml_t monthInfo_n;
+  ezxml_t monthInfo_w;
+  ezxml_t next_o;
+  ezxml_t tag;
 
-    printf( "%*c<%s",  indent_len*2, ' ', node->name );
+  month_index_s *index_n;
+  month_entry_s *entry;
 
-    /* add attributes if present */
+  char path_o[1024];
 
-    cnt = 0;
-    while ( *(node->attr+cnt) != NULL ) {
+  char *year_o_s;
+  char *month_o_s;
+  char *type_o_s;
 
-      printf( " %s=\"%s\"", *(node->attr+cnt), *(node->attr+cnt+1) );
-      cnt += 2;
-    }
-    
-    if ( node->child ) {
+  int index_w;
+  int index;
+  time_t max_time;
+  time_t act_time;
 
-      /* close opening tag and move on to children */
-      printf( ">\n" );
-      print_xml( node->child, indent_len + 1 );
-      
-      /* print closing tag for parent */
+  struct tm loc_time;
 
-      printf( "%*c</%s>\n", (indent_len) * 2, ' ', node->name );
+  snprintf( path_o, sizeof( path_o ), "%s/config_happ_pwrusage.xml", 
+	    pwrusage_path_o );
 
-    } else {
+  printf("\nCopying monthly data as stored in config_happ_pwrusage.xml\n\n");
 
-      /* print value and closing tag */
-      printf( ">%s</%s>\n", node->txt, node->name );
-    }
-    
-    if ( node->sibling ) {
-      print_xml( node->sibling, indent_len );
-    } 
+  if ( access( path_o, R_OK ) ) {
+    fprintf( stderr, 
+	     "Cannot open old config_happ_pwrusage.xml for reading\n" );
+    return -1;
+  }
+  if ( access( pwrusage_path_n, R_OK | W_OK ) ) {
+    fprintf( stderr, 
+	     "Cannot open new config_happ_pwrusage.xml for reading/writing\n" );
+    return -2;
+  }
 
-    node = node->next;
+  /* read new data, then old data */ 
 
+  if ( ( doc_n = ezxml_parse_file( pwrusage_path_n ) ) == NULL ) {
+    fprintf( stderr, "ezxml_parse_file returned NULL\n");
+    return -4;
+  }
+  if ( ( doc_o = ezxml_parse_file( path_o ) ) == NULL ) {
+    fprintf( stderr, "ezxml_parse_file returned NULL\n");
+    ezxml_free( doc_n );
+    return -3;
   }
-}
 
+  /* 
+   * Index the new entries once by (year, month, type), so each old entry 
+   * is matched by a single lookup. Entries are relinked between the 
+   * documents instead of being serialised and parsed again; relinked 
+   * nodes keep pointing into the buffer of the document they were parsed 
+   * from, so doc_o must outlive doc_n (see clean up below).
+   */
 
-int merge_data( char *csv_path, char *rra_path, dat_s *data, int subset, 
-		int max_time ) {
+  monthInfo_n = ezxml_child( doc_n, "monthInfo" );
+  index_w = monthInfo_n ? (int)monthInfo_n->off : 0;
 
-  FILE *fp_csv;
-  FILE *fp_csv_out;
-  FILE *fp_rra;
+  index_n = read_month_index( doc_n );
+  max_time = test_date( max_date );
 
-  int j;
+  /* create new struct for writing data */
 
-  int *time_csv;
-  int *int_csv;
-  double *dble_csv;
+  doc_w = ezxml_new( "toFile" );
+  index = 0;
+   
+  for ( monthInfo_o = ezxml_child( doc_o, "monthInfo" ); monthInfo_o; 
+	monthInfo_o = next_o ) {
 
-  int *time_rra;
-  int *int_rra;
-  double *dble_rra;
+    next_o = monthInfo_o->next;
 
-  int data_type;
+    year_o_s  = ezxml_txt( ezxml_child( monthInfo_o, "year" ) );
+    month_o_s = ezxml_txt( ezxml_child( monthInfo_o, "month" ) );
+    type_o_s  = ezxml_txt( ezxml_child( monthInfo_o, "type" ) );
 
-  char *csv_out_path;
-  char *rra_out_path;
-  char *ext_ptr;
+    printf("Copying      config_happ_pwrusage.xml (old): year: %d, month: %2d, type: %s\n",  
+	   atoi(year_o_s) + 1900, atoi(month_o_s) + 1, type_o_s );
 
-  int *int_temp;
-  double *dble_temp;
+    entry = get_month_entry( index_n, year_o_s, month_o_s, type_o_s );
 
+    if ( entry ) {
 
-  if ( fp_csv = fopen( csv_path, "r" ) ) {
+      /* an old entry with the same key was merged already */
 
-    /*
-     * get data type for this file
-     */
+      if ( entry->used ) 
+	continue;
+      entry->used = 1;
 
-    if ( !strcmp( data->sampleType, "integer" ) ) {
-      data_type = INTEGER;
-    } else {
-      data_type = DOUBLE;
-    }
+      /* replace existing entries in new data file, check time limit */
 
-    /* read data from rra and csv files, store in vectors and sort */
+      memset( &loc_time, 0, sizeof( loc_time ) );
+      loc_time.tm_year = atoi( year_o_s );
+      loc_time.tm_mon  = atoi( month_o_s );
+      loc_time.tm_mday = 1;
 
-    time_rra = create_rra_time( data, subset );
-    time_csv = read_csv_time( csv_path, data, subset, max_time );
+      act_time = mktime( &loc_time );
 
-    if ( data_type ) {
-      int_rra = read_rra_file( rra_path, data, subset );
-      int_csv = read_csv_data( csv_path, data, subset, max_time );
-      int_temp = sort_data_for_rra( data, subset, int_csv, int_rra, 
-				    time_csv, time_rra );
-    } else {
-      dble_rra = read_rra_file( rra_path, data, subset );
-      dble_csv = read_csv_data( csv_path, data, subset, max_time );
-      dble_temp = sort_data_for_rra( data, subset, dble_csv, dble_rra, 
-				     time_csv, time_rra );
-   }
+      if ( ( max_time  > act_time ) ) {
+	printf("Overwriting  config_happ_pwrusage.xml (new): year: %d, month: %2d, type: %s\n\n",  
+	       atoi(entry->year) + 1900, atoi(entry->month) + 1, entry->type );
 
-    /* debugging  printout */
+	/* 
+	 * move old data into new xml struct, drop the new entry. The key
+	 * strings may belong to the dropped node, later lookups compare 
+	 * against the equal ones of the old entry instead.
+	 */
 
-#ifdef DEBUG
+	entry->year  = year_o_s;
+	entry->month = month_o_s;
+	entry->type  = type_o_s;
+	ezxml_remove( entry->node );
+	monthInfo_w = monthInfo_o;
+      } else {
 
-    if ( data->subset[subset]->n_samples != 0 ) {
-      
-      csv_out_path = calloc( MAX_LEN, sizeof( char ) );
-      strcpy( csv_out_path, csv_path );
-      ext_ptr = strstr( csv_out_path, ".csv" );
-      sprintf( ext_ptr, "%s", ".CSV" );
-      
-      printf("csv_out_path    : %s\n", csv_out_path );
-      fp_csv_out = fopen( csv_out_path, "w" );
-      
-      for ( j = 0; j< data->subset[subset]->n_samples; j++ ) {
-	if ( data_type ) {
-	  fprintf(fp_csv_out, "%d, %d, %d, %d, %d\n", 
-		  time_csv[j], int_csv[j], time_rra[j], int_rra[j], 
-		  int_temp[j] );
-	} else {
-	  fprintf(fp_csv_out, "%d, %lf, %d, %lf, %lf\n", 
-		  time_csv[j], dble_csv[j], time_rra[j], dble_rra[j], 
-		  dble_temp[j] );
-	}
+	/* keep new entries that weren't available from the old data */
+
+	printf("Keeping      config_happ_pwrusage.xml (new): year: %d, month: %2d, type: %s\n\n",  
+	       atoi(entry->year) + 1900, atoi(entry->month) + 1, entry->type );
+	monthInfo_w = entry->node;
       }
-      fclose( fp_csv_out );
-      free( csv_out_path ) ;
-    }
+      entry->node = NULL;
 
-#endif
+    } else {
+ 
+      /* 
+       * Entry wasn't available in new file, so add it, irrespective of a 
+       * user-set time limit.
+       */
 
-    /* write to .rra file */
+      for ( tag = monthInfo_o->child; tag; tag = tag->ordered ) {
+	printf( "  tag: %32s: ",  tag->name );
+	printf( "%s\n", tag->txt );
+      }
 
-    rra_out_path = malloc( MAX_LEN );
-    strcpy( rra_out_path, rra_path );
-    ext_ptr = strstr( rra_out_path, ".rra" );
-    //sprintf( ext_ptr, "%s", ".RRA" );
-      
-    printf("rra_out_path    : %s\n", rra_out_path );
+      /* insert after the already available data */
 
-    if ( fp_rra = fopen( rra_out_path, "wb" ) ) {
-	if ( data_type ) {
-	  fwrite( int_temp, sizeof( int ), data->subset[subset]->n_samples,
-		  fp_rra );
-	} else {
-	  fwrite( dble_temp, sizeof( double ), data->subset[subset]->n_samples,
-		  fp_rra );
-	}
-      fclose (fp_rra );
-      free( rra_out_path );
-   } else {
-      printf("merge_data: Cannot open %s for writing\n", rra_out_path );
+	printf("Writing into config_happ_pwrusage.xml (new): year: %d, month: %2d, type: %s\n\n",  atoi(year_o_s) + 1900, atoi(month_o_s) + 1, type_o_s );
+
+      monthInfo_w = monthInfo_o;
     }
 
-   /* clean up */
-    
-    if ( data_type ) {
-      free( int_csv );
-      free( int_rra );
-      free( int_temp );
+    ezxml_move( monthInfo_w, doc_w, index );
+    index++;
+  } /*  end for ( monthInfo_o = ezxml_child ...  */ 
+
+  /* 
+   * All data gathered, now replace in the output xml struct. Entries only 
+   * present in the new file (e.g. the current month) are kept after the 
+   * merged ones; duplicates of an already merged key are dropped.
+   */
+
+  while ( ( monthInfo_n = ezxml_child( doc_n, "monthInfo" ) ) ) {
+    entry = get_month_entry( index_n, 
+			     ezxml_txt( ezxml_child( monthInfo_n, "year" ) ),
+			     ezxml_txt( ezxml_child( monthInfo_n, "month" ) ),
+			     ezxml_txt( ezxml_child( monthInfo_n, "type" ) ) );
+    if ( entry && entry->node == monthInfo_n ) {
+      entry->node = NULL;
+      ezxml_move( monthInfo_n, doc_w, index );
+      index++;
     } else {
-      free( dble_csv );
-      free( dble_rra );
-      free( dble_temp );
+      ezxml_remove( monthInfo_n );
     }
-    
-    free( time_csv );
-    free( time_rra );
-
-    fclose ( fp_csv );
-    
-  } else {
-    printf("merge_data: Cannot open file %s for reading\n", csv_path );
   }
+  while ( ezxml_child( doc_w, "monthInfo" ) ) {
+    ezxml_move( ezxml_child( doc_w, "monthInfo" ), doc_n, index_w );
+    index_w++;
+  }
+
+  free_month_index( index_n );
+
+  /* write modified data to file, and show it */
+
+  print_xml( doc_n, 2 );
+  write_xml_file( pwrusage_path_n, doc_n );
+
+  /* clean up, relinked old entries are freed with doc_n */
+
+  ezxml_free( doc_w );
+  ezxml_free( doc_n );
+  ezxml_free( doc_o );
+	  
   return 0;
 }
 
 
 
-char *get_device_name( char *xml_file, char *uuid ) {
-
-  ezxml_t doc_;
-  ezxml_t uuid_;
-  ezxml_t rrdlogger_;
-  ezxml_t name_;
-  
-  char *device_name;
+month_index_s *read_month_index( ezxml_t doc ) {
 
-  device_name = calloc( LINE_LEN,  sizeof( char ) );
+  ezxml_t monthInfo_;
 
-  if ( ( doc_ = ezxml_parse_file( xml_file ) ) != NULL ) {
+  month_index_s *index;
+  month_entry_s *entry;
+  unsigned int h;
+  int cnt;
 
-    for ( rrdlogger_ = ezxml_child( doc_, "rrdLogger" ); rrdlogger_; 
-	  rrdlogger_ = rrdlogger_->next ) {
-      
-      uuid_ = ezxml_child( rrdlogger_, "uuid" );
-      name_ = ezxml_child( rrdlogger_, "name" );
+  /* index all monthInfo entries of doc by (year, month, type) */
 
-      if ( !strcmp( uuid,  ezxml_txt( uuid_ ) ) ) {
-	strcpy( device_name, ezxml_txt( name_ ) );
-	ezxml_free( doc_ );
+  cnt = 0;
+  for ( monthInfo_ = ezxml_child( doc, "monthInfo" ); monthInfo_; 
+	monthInfo_ = monthInfo_->next ) {
+    cnt++;
+  }
 
-	return device_name;
-      }   
+  index = calloc( 1, sizeof( month_index_s ) );
+  index->n_buckets = 16;
+  while ( index->n_buckets < 2 * cnt ) {
+    index->n_buckets *= 2;
+  }
+  index->buckets = calloc( index->n_buckets, sizeof( month_entry_s* ) );
+  index->entries = calloc( cnt > 0 ? cnt : 1, sizeof( month_entry_s ) );
+
+  cnt = 0;
+  for ( monthInfo_ = ezxml_child( doc, "monthInfo" ); monthInfo_; 
+	monthInfo_ = monthInfo_->next ) {
+
+    entry = &index->entries[cnt];
+    entry->year  = ezxml_txt( ezxml_child( monthInfo_, "year" ) );
+    entry->month = ezxml_txt( ezxml_child( monthInfo_, "month" ) );
+    entry->type  = ezxml_txt( ezxml_child( monthInfo_, "type" ) );
+
+    /* first entry wins, later duplicates are dropped by the merge */
+
+    if ( get_month_entry( index, entry->year, entry->month, 
+			  entry->type ) == NULL ) {
+      entry->node = monthInfo_;
+      h = hash_month( entry->year, entry->month, entry->type ) 
+	& ( index->n_buckets - 1 );
+      entry->next = index->buckets[h];
+      index->buckets[h] = entry;
+      cnt++;
     }
-  } else {
-    fprintf( stderr, "unable tot open xml file: %s\n", xml_file ); 
   }
-  ezxml_free( doc_ );
-  free( device_name );
-
-  return NULL;
 
+  return index;
 }
 
 
 
-void print_data( dat_s* data ) {
+month_entry_s *get_month_entry( month_index_s *index, char *year, 
+				char *month, char *type ) {
 
-  int j;
+  month_entry_s *entry;
 
-  printf( "magic number    : %s\n", data->magic );
-  printf( "deviceUuid size : %d\n", data->devUuid_len );
-  printf( "deviceUuid      : %s\n", data->deviceUuid );
-  printf( "deviceVar size  : %d\n", data->devVar_len );
-  printf( "deviceVar       : %s\n", data->deviceVar );
-  printf( "device_name     : %s\n", data->rrd_device_name );
-  printf( "deviceSvc size  : %d\n", data->devSvc_len );
-  printf( "deviceSvc       : %s\n", data->deviceSvc );
-  printf( "sampleType size : %d\n", data->sampleT_len );
-  printf( "sampleType      : %s\n", data->sampleType );
-  printf( "nr of subsets   : %d\n", data->n_sets );
-  
-  for ( j = 0; j < N_SUBSETS; j++ ) {
-    printf( "unk_0           : %d\n", data->subset[j]->unk_0 );
-    printf( "unk_1           : %d\n", data->subset[j]->unk_1 );
-    printf( "unk_2           : %d\n", data->subset[j]->unk_2 );
-    printf( "value           : %.3f\n", data->subset[j]->value );
-    printf( "divider         : %.3f\n", data->subset[j]->divider );
-    printf( "timestamp_0     : %d\n", data->subset[j]->timestamp_0 );
-    printf( "timestamp_1     : %d\n", data->subset[j]->timestamp_1 );
-    printf( "minSamplesPerBin: %d\n", data->subset[j]->minSamplesPerBin );
-    printf( "binLength size  : %d\n", data->subset[j]->binL_len );
-    printf( "binLength       : %s\n", data->subset[j]->binLength );
-    printf( "file offset     : %d\n", data->subset[j]->file_offset );
-    printf( "n_samples       : %d\n", data->subset[j]->n_samples );
-    printf( "unk_3           : %d\n", data->subset[j]->unk_3 );
-    printf( "int_len         : %d\n", data->subset[j]->int_len );
-    printf( "interval        : %s\n", data->subset[j]->interval );
-    printf( "cons_len        : %d\n", data->subset[j]->cons_len );
-    printf( "consolidator    : %s\n", data->subset[j]->consolidator );
-    printf( "next_subset ptr : 0x%08x\n", data->subset[j]->next );
+  /* look up an entry by key, returns NULL if not indexed */
 
-    if ( data->subset[j]->next == NULL ) {
-      break;
-      break;
+  for ( entry = index->buckets[hash_month( year, month, type ) 
+			       & ( index->n_buckets - 1 )];
+	entry; entry = entry->next ) {
+    if ( !strcmp( year, entry->year ) && !strcmp( month, entry->month ) &&
+	 !strcmp( type, entry->type ) ) {
+      return entry;
     }
   }
-} 
 
+  return NULL;
+}
 
-dat_s *read_dat_file( char * dir ) { 
 
-  dat_s *data;
-  FILE *fp;
 
-  int done;
-  int cnt;
-  int j;
-  int cnt2;
-  char dummy;
-  
-  data = calloc( 1, sizeof( dat_s ) );
-  
-  fp = fopen( dir , "r" );
-  fread( data->magic, 1, 17, fp ); 
-  
-  if ( ! strcmp( data->magic, MAGIC ) ) {
-    
-    /* If the file magic number fits, read on */
-    
-    fread( &data->devUuid_len, sizeof( int ), 1, fp );
-    data->deviceUuid = calloc( data->devUuid_len, sizeof( char ) );
-    fread( data->deviceUuid, 1, data->devUuid_len, fp );
-    
-    /* 
-     * read device uuid and other device identifiers.
-     */
-    
-    fread( &data->devVar_len, sizeof( int ), 1, fp );
-    data->deviceVar = calloc( data->devVar_len, sizeof( char ) );
-    fread( data->deviceVar, 1, data->devVar_len, fp );
-    
-    fread( &data->devSvc_len, sizeof( int ), 1, fp );
-    data->deviceSvc = calloc( data->devSvc_len, sizeof( char ) );
-    fread( data->deviceSvc, 1, data->devSvc_len, fp );
-    
-    fread( &data->sampleT_len, sizeof( int ), 1, fp );
-    data->sampleType = calloc( data->sampleT_len, sizeof( char ) );
-    fread( data->sampleType, 1, data->sampleT_len, fp );
-    
-    done = 0;
-    j = 0;
-    do {
-      /* 
-       * Workaround for not yet initialized databases. 
-       * Uuid is only assigned when there has been contact with the 
-       * meter adapter first. Until then, the word "placeholder"
-       * is used as uuid. 
-       */
+void free_month_index( month_index_s *index ) {
 
-      if ( strcmp( data->deviceUuid, "placeholder" ) != 0 ) {      
-	
-	data->subset[j] = calloc( 1, sizeof( dat_sub_s ) );
-	data->n_sets = j + 1; 
-	if ( j > 0 ) {
-	  data->subset[j-1]->next = data->subset[j];
-	}
-	
-	cnt = 0;
-	
-	if ( ! strcmp( data->sampleType, "integer" ) ) {
-	  fread( &data->subset[j]->unk_0, sizeof( int ), 1, fp );
-	  fread( &data->subset[j]->unk_1, sizeof( int ), 1, fp );
-	  fread( &data->subset[j]->unk_2, sizeof( int ), 1, fp );
-	  data->subset[j]->value   = 0.0;
-	  data->subset[j]->divider = 0.0;
-	} else {
-	  
-	  /* double data type */
-	  
-	  fread( &data->subset[j]->value, sizeof( double ), 1, fp );
-	  fread( &data->subset[j]->divider, sizeof( double ), 1, fp );
-	  data->subset[j]->unk_0 = 0;
-	  data->subset[j]->unk_1 = 0;
-	  data->subset[j]->unk_2 = 0;
-	}
-	
-	cnt += fread( &data->subset[j]->timestamp_0, sizeof( int ), 1, fp );
-	cnt += fread( &data->subset[j]->timestamp_1, sizeof( int ), 1, fp );
-	cnt += fread( &data->subset[j]->minSamplesPerBin, sizeof( int ), 1,
-		      fp );
-	
-	cnt2 = fread( &data->subset[j]->binL_len, sizeof( int ), 1, fp );
-	if ( cnt2 )
-	  data->subset[j]->binLength = 
-	    calloc( data->subset[j]->binL_len, sizeof( char ) );
-	cnt += cnt2;
-	cnt += fread( data->subset[j]->binLength, 1, data->subset[j]->binL_len,
-		      fp );
-	
-	cnt += fread( &data->subset[j]->file_offset, sizeof( int ), 1, fp );
-	cnt += fread( &data->subset[j]->n_samples, sizeof( int ), 1, fp );
-	cnt += fread( &data->subset[j]->unk_3, sizeof( int ), 1, fp );
-	
-	cnt2 = fread( &data->subset[j]->int_len, sizeof( int ), 1, fp );
-	
-	if ( cnt2 ) 
-	  data->subset[j]->interval = 
-	    calloc( data->subset[j]->int_len, sizeof( char ) );
-	cnt += cnt2;
-	cnt += fread( data->subset[j]->interval, 1, data->subset[j]->int_len, 
-		      fp );
-	
-	cnt2 = fread( &data->subset[j]->cons_len, sizeof( int ), 1, fp );
-	if ( cnt2 ) 
-	  data->subset[j]->consolidator = 
-	    calloc( data->subset[j]->cons_len, sizeof( char ) );
-	cnt += cnt2;
-	cnt += fread( data->subset[j]->consolidator, 1, 
-		      data->subset[j]->cons_len, fp );
-	
-	/* 
-	 * Jump out of the loop when .dat file has trailing bytes. 
-	 * Workaround for poor .dat file rewriting code.
-	 */
-	if ( cnt <  (data->subset[j]->cons_len + data->subset[j]->int_len + 
-		     data->subset[j]->binL_len + 9 ) ) {
-	  printf( "dat file is partly corrupted, continuing ...\n" );
+  /* index entries point into the document, only free the index */
 
-	  data->subset[j-1]->next = NULL;
-	  data->n_sets --;
-	  done = 1;		  
-	  continue;
-	}
-	
-	/* check if we reached EOF */
-	
-	if ( fread( &dummy, 1, 1, fp ) ) {
-	  fseek( fp, -1, SEEK_CUR );
-	} else {
-	  done = 1;
-	}
-	
-	j++;
-	
-      } else {
-	done = 1;
-      } /* end if placeholder */
-      
-    } while ( done == 0 );
-  } else {
-    printf( "Bad magic number\n" );
+  if ( index ) {
+    free( index->entries );
+    free( index->buckets );
+    free( index );
   }
-  return data;
+}
+
 
+
+unsigned int hash_month( char *year, char *month, char *type ) {
+
+  return ( hash_str( year ) * 31u + hash_str( month ) ) * 31u + 
+    hash_str( type );
 }
 
 
 
-char *get_csv_path( char* csv_dir, dat_s* data, int subset ) {
+int write_xml_file( char *path, ezxml_t root ) {
 
-  char* csv_path;
-  char *csv_name;
-  char *csv_name_1;
-  char *csv_name_2;
+  xml_out_s out;
+  char tmp_path[MAX_LEN];
+  int fd;
 
-  if ( ( subset >=0 ) & ( subset < data->n_sets ) ) {
-    if ( data->rrd_device_name != "" ) {
-      
-      csv_path = malloc( MAX_LEN );
-      csv_name = malloc( MAX_LEN );
-      
-      csv_name_1 = data->deviceVar;
-      csv_name_2 = data->subset[subset]->interval;
-      
-      if ( strncmp( data->rrd_device_name, "thermstat", 9 ) == 0 ) {
-	sprintf( csv_name, "%s_%s.csv", 
-		 data->rrd_device_name, csv_name_2 );
-      } else {
-	sprintf( csv_name, "%s_%s_%s.csv", 
-		 data->rrd_device_name, csv_name_1, csv_name_2 );
-      }
-      
-      csv_path = strcpy( csv_path, csv_dir ); 
-      csv_path = strcat( csv_path, csv_name ); 
-      printf("csv_path        : %s\n", csv_path );
-      free( csv_name );
-      return csv_path; 
-    } else {
-      return NULL;
-    }
-  } else {
-    printf("transfer-logs: get_csv_path: subset out of range\n");
-    return NULL;
+  /* 
+   * Write root and everything below it to path, 0 on success. ezxml may 
+   * have mapped the file that is being replaced and its nodes point into 
+   * that mapping, so write a new file and rename it over the old one 
+   * instead of truncating it.
+   */
+
+  snprintf( tmp_path, sizeof( tmp_path ), "%s.tmp", path );
+  if ( ( fd = open( tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666 ) ) < 0 ) {
+    fprintf( stderr, "Cannot open %s for writing: %s\n", tmp_path, 
+	     strerror( errno ) );
+    return -1;
+  }
+
+  xml_out_init( &out, fd );
+  write_xml_node( &out, root, 2 );
+  xml_out_str( &out, "\n" );
+  xml_out_flush( &out );
+
+  if ( close( fd ) || out.err || rename( tmp_path, path ) ) {
+    fprintf( stderr, "Error writing %s: %s\n", path, strerror( errno ) );
+    unlink( tmp_path );
+    return -1;
   }
+  return 0;
 }
 
 
 
-char *get_rra_path( dat_s* data, char *uuid, char* loc, int subset ) {
+void print_xml( ezxml_t node, int indent_len ) {
 
-  char *rra_path;
-  char *rra_name_2;
+  xml_out_s out;
 
-  if ( ( subset >=0 ) & ( subset < data->n_sets ) ) {
-    if ( data->rrd_device_name != "" ) {
-      
-      rra_path = malloc( MAX_LEN );
-      rra_name_2 = data->subset[subset]->interval;
+  /* same output as write_xml_file, on stdout */
+
+  fflush( stdout );
+  xml_out_init( &out, STDOUT_FILENO );
+  write_xml_node( &out, node, indent_len );
+  xml_out_flush( &out );
+}
+
+
+
+void write_xml_node( xml_out_s *out, ezxml_t node, int indent_len ) {
+
+  int cnt;
+
+  /* 
+   * Emit node, its siblings and its same-name successors in the order 
+   * ezxml links them: each tag name is written as a group, in order of 
+   * first appearance. Elements with children get their children indented 
+   * by one level, others are written on one line with their text.
+   */
+
+  while( node ) {
+
+    /* print 1st part of opening tag with or without attributes */
+
+    xml_out_indent( out, indent_len );
+    xml_out_str( out, "<" );
+    xml_out_str( out, node->name );
+
+    /* add attributes if present */
+
+    for ( cnt = 0; node->attr[cnt] != NULL; cnt += 2 ) {
+      xml_out_str( out, " " );
+      xml_out_str( out, node->attr[cnt] );
+      xml_out_str( out, "=\"" );
+      xml_out_text( out, node->attr[cnt+1] );
+      xml_out_str( out, "\"" );
+    }
+    
+    if ( node->child ) {
+
+      /* close opening tag and move on to children */
+
+      xml_out_str( out, ">\n" );
+      write_xml_node( out, node->child, indent_len + 1 );
       
-      sprintf( rra_path , "%s%s-%s.rra", loc,
-       	       uuid, rra_name_2 );
-       printf("rra_path        : %s\n", rra_path );
-     return rra_path; 
+      /* print closing tag for parent */
+
+      xml_out_indent( out, indent_len );
+      xml_out_str( out, "</" );
+      xml_out_str( out, node->name );
+      xml_out_str( out, ">\n" );
+
     } else {
-      return NULL;
+
+      /* print value and closing tag */
+
+      xml_out_str( out, ">" );
+      xml_out_text( out, node->txt );
+      xml_out_str( out, "</" );
+      xml_out_str( out, node->name );
+      xml_out_str( out, ">\n" );
     }
-  } else {
-    printf( "get_rra_path: subset out of range\n");
-    return NULL;
+    
+    if ( node->sibling ) {
+      write_xml_node( out, node->sibling, indent_len );
+    } 
+
+    node = node->next;
   }
 }
 
 
-int find_max( int * vec, int n ) {
-  int i;
-  int max;
-  int j;
 
-  max = vec[0];
-  j = 0;
+void xml_out_init( xml_out_s *out, int fd ) {
+  out->fd  = fd;
+  out->len = 0;
+  out->err = 0;
+}
+
+
+
+void xml_out_write( xml_out_s *out, char *str, size_t len ) {
 
-  for ( i = 1; i < n; i++ ) {
-    if ( vec[i] > max ) {
-      max = vec[i]; 
-      j = i;
+  /* strings longer than the buffer bypass it */
+
+  if ( out->len + len > XML_OUT_LEN ) {
+    xml_out_flush( out );
+    if ( len > XML_OUT_LEN ) {
+      if ( write_all( out->fd, str, len ) ) 
+	out->err = 1;
+      return;
     }
   }
-  return j;
+  memcpy( out->buf + out->len, str, len );
+  out->len += len;
 }
 
-/*
- * Returns index of key in arr[l..h] if key is present, otherwise returns -1 
- * retrieved from: 
- * https://www.geeksforgeeks.org/search-an-element-in-a-sorted-and-pivoted-array
- * 20190302
- *
- * code suggested by Gaurav Ahirwar
- */
 
-int search( int arr[], int l, int h, int key ) { 
-  if ( l > h ) 
-    return -1; 
-  
-  int mid = ( l + h ) / 2; 
-  if ( arr[mid] == key ) 
-    return mid; 
-  
-  /* If arr[l...mid] is sorted */
-  if ( arr[l] <= arr[mid] ) { 
-    /* 
-     * As this subarray is sorted, we can quickly check if key lies in half 
-     * or other half 
-     */
-    if ( key >= arr[l] && key <= arr[mid] ) 
-      return search( arr, l, mid-1, key ); 
-    
-    return search( arr, mid+1, h, key ); 
-  } 
-  
+
+void xml_out_str( xml_out_s *out, char *str ) {
+  xml_out_write( out, str, strlen( str ) );
+}
+
+
+
+void xml_out_text( xml_out_s *out, char *str ) {
+
+  char *p;
+
   /* 
-   * If arr[l..mid] is not sorted, then arr[mid... r] must be sorted
+   * ezxml hands out decoded text, so escape the markup characters again 
+   * to keep the output parseable. Plain runs are copied in one go.
    */
-  if ( key >= arr[mid] && key <= arr[h] ) 
-    return search( arr, mid+1, h, key ); 
-  
-  return search( arr, l, mid-1, key ); 
-} 
 
+  for ( p = str; *p; p++ ) {
+    if ( *p == '&' || *p == '<' || *p == '>' || *p == '"' ) {
+      xml_out_write( out, str, p - str );
+      xml_out_str( out, *p == '&' ? "&amp;" : *p == '<' ? "&lt;" : 
+		   *p == '>' ? "&gt;" : "&quot;" );
+      str = p + 1;
+    }
+  }
+  xml_out_write( out, str, p - str );
+}
 
 
-void* read_rra_file( char* rra_path, dat_s* data, int subset) {
-  FILE* fp;
-  int data_type;
-  int* int_rra;
-  double* dble_rra;
-  int j;
 
-  if ( fp = fopen( rra_path, "r" ) ) {
+void xml_out_indent( xml_out_s *out, int indent_len ) {
 
-    if ( !strcmp( data->sampleType, "integer" ) ) {
-      data_type = INTEGER;
-      int_rra =  calloc( data->subset[subset]->n_samples, sizeof( int ) );
-    } else {
-      data_type = DOUBLE;
-      dble_rra = calloc( data->subset[subset]->n_samples, sizeof( double ) );
-    }
-    
-    for ( j = 0; j< data->subset[subset]->n_samples; j++ ) {
-      if ( data_type ) {
-	fread( &int_rra[j],  sizeof( int ), 1, fp );
-      } else {
-	fread( &dble_rra[j],  sizeof( double ), 1, fp );
-      }
-    }
-    
-    if ( data_type ) {
-      return int_rra; 
-    } else {
-      return dble_rra;
-    }
-    
-    fclose( fp );
-    
-  } else {
-  
-    printf("read_rra_file: Cannot open file %s for reading\n", rra_path );
-    return NULL;
+  static const char spaces[XML_INDENT_LEN + 1] = 
+    "                                                                ";
+  int n;
+
+  /* indent_len levels of 2 spaces, at least one space (as "%*c" did) */
 
+  n = indent_len * 2;
+  if ( n < 1 ) 
+    n = 1;
+  while ( n > XML_INDENT_LEN ) {
+    xml_out_write( out, (char*)spaces, XML_INDENT_LEN );
+    n -= XML_INDENT_LEN;
   }
+  xml_out_write( out, (char*)spaces, n );
+}
+
 
+
+void xml_out_flush( xml_out_s *out ) {
+  if ( out->len ) {
+    if ( write_all( out->fd, out->buf, out->len ) ) 
+      out->err = 1;
+    out->len = 0;
+  }
 }
 
 
-void* read_csv_data( char* csv_path, dat_s* data, int subset, int t_max ) {  
 
-  FILE* fp;
+int write_all( int fd, char *buf, size_t len ) {
+
+  ssize_t n;
+
+  /* write() until done, 0 on success */
+
+  while ( len > 0 ) {
+    if ( ( n = write( fd, buf, len ) ) < 0 ) {
+      if ( errno == EINTR ) 
+	continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+
+int merge_data( char *csv_path, char *fine_path, char *rra_path, dat_s *data, 
+		int subset, int max_time, int *last_time, exports_s *exports,
+		unsigned long *crc, int *dirty ) {
+
+  int cnt;
+
+  csv_s *csv = NULL;
+  rra_s *rra;
+
+  int staged = 0;
+  double t0;
+
+#ifdef DEBUG
+  FILE *fp_csv_out;
   int j;
-  int data_type;
-  int dum;
-  int* int_csv;
-  double* dble_csv;
-  char* line;
-  int t;
-  int int_tmp;
-  double dble_tmp;
+  ring_s ring;
+  csv_out_s out;
+  int *int_old;
+  double *dble_old;
+  char *csv_out_path;
+  char *ext_ptr;
+#endif
 
-   /* read data from csv file and store in vector */
 
-  if ( fp = fopen( csv_path, "r" ) ) {
-    if ( !strcmp( data->sampleType, "integer" ) ) {
-      data_type = INTEGER;
-      int_csv =  calloc( data->subset[subset]->n_samples, sizeof( int ) );
+  /* 
+   * Read csv data from file, or from the unpacked export.zip in memory, or
+   * binary data written with -B. Without data of its own, a subset is 
+   * consolidated from the data of the finest subset of the database, 
+   * fine_path. For the journal, crc gets the crc32 of the merged .rra.
+   * dirty gets the first slot written and the number of slots from there,
+   * which is what commit_rra_files copies back.
+   */
+
+  t0 = stats_start();
+
+  if ( csv_path ) {
+    csv = read_merge_source( csv_path, data, subset, max_time, exports );
+  }
+  if ( ( csv == NULL ) && fine_path && 
+       ( ( csv_path == NULL ) || strcmp( fine_path, csv_path ) ) ) {
+    fprintf( out_stream(), "consolidating   : %s\n", fine_path );
+    csv = read_merge_source( fine_path, data, subset, max_time, exports );
+  }
+
+  stats_phase( PH_PARSE, t0 );
+
+  if ( csv ) {
+
+    stats_count( CNT_SAMPLES, csv->n );
+
+    /* 
+     * incremental run: samples up to last_time went in before, only the
+     * slots of newer samples are written, and only their pages get dirty.
+     */
+
+    if ( last_time ) {
+      csv->t_min = *last_time;
+    }
+
+    /* 
+     * map rra file and sort csv data into it. Only the slots that receive 
+     * csv data are touched, there is no separate write-back step.
+     */
+
+    fprintf( out_stream(), "rra_out_path    : %s\n", rra_path );
+
+    t0 = stats_start();
+    if ( ( rra = rra_open( rra_path, data, subset, 1 ) ) == NULL ) {
+      fprintf( out_stream(), "merge_data: Cannot open %s for writing\n", rra_path );
+      return -1;
+    }
+    stats_phase( PH_WRITE, t0 );
+
+#ifdef DEBUG
+    if ( csv->data_type ) {
+      int_old = malloc( rra->n_samples * sizeof( int ) );
+      memcpy( int_old, rra->int_val, rra->n_samples * sizeof( int ) );
     } else {
-      data_type = DOUBLE;
-      dble_csv = calloc( data->subset[subset]->n_samples, sizeof( double ) );
+      dble_old = malloc( rra->n_samples * sizeof( double ) );
+      memcpy( dble_old, rra->dble_val, rra->n_samples * sizeof( double ) );
+    }
+#endif
+
+    t0 = stats_start();
+    cnt = sort_data_for_rra( data, subset, csv, rra );
+    rra->dirty = ( cnt > 0 );
+    dirty[0] = rra->dirty_slot;
+    dirty[1] = rra->dirty_n;
+    stats_phase( PH_SORT, t0 );
+    stats_count( CNT_MERGED, cnt );
+    stats_count( CNT_FILLED, csv->n_filled );
+
+    if ( last_time ) {
+      fprintf( out_stream(), "new samples     : %d\n", cnt );
+      if ( csv->t_last > *last_time ) 
+	*last_time = csv->t_last;
     }
 
-    j = 0;
+    /* debugging  printout */
 
-    line = calloc( LINE_LEN, sizeof( char ) );
-    
-    while ( fgets( line, LINE_LEN, fp ) != NULL ) {
-      if ( data_type ) {
-	sscanf( line, "%d,%d\n", &t, &int_tmp );
-	if ( t <= t_max )
-	  int_csv[j] = int_tmp;
-      } else  {
-	sscanf( line, "%d,%lf\n", &t, &dble_tmp );
-	if ( t <= t_max )
-	  dble_csv[j] = dble_tmp;
+#ifdef DEBUG
+
+    if ( data->subset[subset]->n_samples != 0 ) {
+      
+      ring_init( &ring, data->subset[subset] );
+
+      csv_out_path = calloc( MAX_LEN, sizeof( char ) );
+      strcpy( csv_out_path, csv_path ? csv_path : fine_path );
+      ext_ptr = strrchr( csv_out_path, '.' );
+      sprintf( ext_ptr, "%s", ".CSV" );
+      
+      fprintf( out_stream(), "csv_out_path    : %s\n", csv_out_path );
+      fp_csv_out = fopen( csv_out_path, "w" );
+      csv_out_init( &out, fp_csv_out );
+      
+      for ( j = 0; j< data->subset[subset]->n_samples; j++ ) {
+	csv_out_int( &out, j < csv->n ? csv->time[j] : 0 );
+	csv_out_str( &out, ", " );
+	if ( csv->data_type ) {
+	  csv_out_int( &out, j < csv->n ? csv->int_val[j] : 0 );
+	} else {
+	  csv_out_fixed( &out, j < csv->n ? csv->dble_val[j] : 0.0, 6 );
+	}
+	csv_out_str( &out, ", " );
+	csv_out_int( &out, ring_slot_time( &ring, j ) );
+	csv_out_str( &out, ", " );
+	if ( csv->data_type ) {
+	  csv_out_int( &out, int_old[j] );
+	  csv_out_str( &out, ", " );
+	  csv_out_int( &out, rra->int_val[j] );
+	} else {
+	  csv_out_fixed( &out, dble_old[j], 6 );
+	  csv_out_str( &out, ", " );
+	  csv_out_fixed( &out, rra->dble_val[j], 6 );
+	}
+	csv_out_str( &out, "\n" );
       }
-      if ( t <= t_max )
-	j++;
+      csv_out_flush( &out );
+      fclose( fp_csv_out );
+      free( csv_out_path ) ;
     }
 
-    free( line );
-
-    if ( data_type ) {
-      return int_csv; 
+    if ( csv->data_type ) {
+      free( int_old );
     } else {
-      return dble_csv;
+      free( dble_old );
     }
-    
-    fclose( fp );
 
+#endif
+
+   /* clean up, csv lives in this thread's scratch vectors */
+    
+    t0 = stats_start();
+    if ( rra->dirty ) {
+      stats_count( CNT_BYTES_OUT, rra->size );
+    }
+    if ( crc ) {
+      *crc = crc32( crc32( 0L, Z_NULL, 0 ), rra->base, rra->size );
+    }
+    if ( ( staged = rra_close( rra ) ) < 0 ) {
+      fprintf( out_stream(), "merge_data: Cannot write %s, left unchanged\n", rra_path );
+    }
+    stats_phase( PH_WRITE, t0 );
+    
   } else {
+    fprintf( out_stream(), "merge_data: Cannot open file %s for reading\n", 
+	     csv_path ? csv_path : fine_path );
+    staged = -1;
+  }
+  return staged;
+}
 
-    printf("read_csv_data: Cannot open file %s for reading\n", csv_path );
-    return NULL;
 
+
+csv_s* read_merge_source( char* path, dat_s* data, int subset, int max_time,
+			  exports_s* exports ) {
+
+  csv_s *csv = NULL;
+  export_s *export;
+  char *csv_name;
+
+  if ( exports ) {
+    csv_name = strrchr( path, '/' );
+    csv_name = csv_name ? csv_name + 1 : path;
+    if ( ( export = find_export( exports, csv_name ) ) ) {
+      csv = read_csv_export( export, data, subset, max_time );
+      stats_count( CNT_BYTES_IN, export->size );
+    }
+  } else if ( is_rrb_path( path ) ) {
+    csv = read_rrb_file( path, data, max_time );
+    stats_count_file( CNT_BYTES_IN, path );
+  } else {
+    csv = read_csv_file( path, data, subset, max_time );
+    stats_count_file( CNT_BYTES_IN, path );
   }
+  return csv;
 }
 
 
 
-int* create_rra_time( dat_s* data, int subset ) {
- 
-  int j;
-  int* time_rra;
-  int interval;
+int plan_merge( char *csv_path, char *fine_path, char *rra_path, dat_s *data, 
+		int subset, int max_time, int *last_time, exports_s *exports ) {
 
-  /* create time vector for rra data */
-  
-  interval = data->subset[subset]->timestamp_1 - 
-    data->subset[subset]->timestamp_0;
+  ring_s ring;
+  char *path;
+  char *rra_name;
+  int t_first;
+  int t_last;
+  int t_lo;
+  int t_hi;
+  int n;
 
-  time_rra = calloc( data->subset[subset]->n_samples, sizeof( int ) );
-  
-  time_rra[data->subset[subset]->file_offset] = 
-    data->subset[subset]->timestamp_1;
-  
-  j = data->subset[subset]->file_offset;
-  
-  do {
-    time_rra[j-1] = time_rra[j] - interval;
-    j--;
-  } while ( j > 0 );
-  
-  time_rra[data->subset[subset]->n_samples - 1] = time_rra[0] - interval;
-  
-  j = data->subset[subset]->n_samples - 1;
-  
-  do {
-    j--;
-    time_rra[j] = time_rra[j+1] - interval;
-  } while ( j > data->subset[subset]->file_offset+1 );
-  
-  return time_rra;
+  /* 
+   * What merge_data would do, without reading the csv data or the ring
+   * buffer: the slots of the bins between the first and the last csv 
+   * sample, within the ring buffer window, max_time and, for incremental
+   * runs, after last_time. Gaps in the data and bins short of 
+   * minSamplesPerBin are not seen, the count is an upper bound. Returns 
+   * the number of slots.
+   */
+
+  path = csv_path ? csv_path : fine_path;
+  rra_name = strrchr( rra_path, '/' );
+  rra_name = rra_name ? rra_name + 1 : rra_path;
+
+  if ( ring_init( &ring, data->subset[subset] ) ) {
+    fprintf( out_stream(), "plan            : %s has no samples\n", rra_name );
+    return 0;
+  }
+
+  if ( source_bounds( path, exports, &t_first, &t_last ) ) {
+    fprintf( out_stream(), "plan            : no samples in %s\n", path );
+    return 0;
+  }
+  fprintf( out_stream(), "csv range       : %d - %d\n", t_first, t_last );
+
+  t_lo = ring.t_oldest - ring.interval + 1;
+  t_hi = ring.t_newest;
+  if ( last_time && ( *last_time != T_NONE ) && ( *last_time >= t_lo ) ) 
+    t_lo = *last_time + 1;
+  if ( max_time < t_hi ) 
+    t_hi = max_time;
+
+  /* samples not in ascending order (old -r files) may go anywhere */
+
+  if ( t_first <= t_last ) {
+    if ( t_first > t_lo ) 
+      t_lo = t_first;
+    if ( t_last < t_hi ) 
+      t_hi = t_last;
+  }
+
+  n = 0;
+  if ( t_lo <= t_hi ) {
+    n = ( ring.t_newest - t_lo ) / ring.interval - 
+      ( ring.t_newest - t_hi ) / ring.interval + 1;
+  }
+  fprintf( out_stream(), "plan            : %d of %d slots of %s\n", n, 
+	   ring.n_samples, rra_name );
 
+  return n;
 }
 
 
 
-int* read_csv_time( char* csv_path, dat_s* data, int subset, int max_time ) {  
+int source_bounds( char* path, exports_s* exports, int* t_first, 
+		   int* t_last ) {
 
-  FILE* fp;
-  int j;
-  char* dum;
-  int* time_csv;
-  char* line;
-  int time_tmp;
-   /* read data from csv file and store in vector */
+  FILE *fp;
+  export_s *export;
+  rrb_head_s head;
+  char *name;
+  char buf[PLAN_SCAN_LEN];
+  size_t len;
+  size_t map_len;
+  long size;
+  int first;
+  int last;
+  int i;
+  int k;
+  int t;
+
+  /* 
+   * first and last sample time of a merge source, from the ends of the
+   * file only. -1 when there are no samples, or no such source.
+   */
 
-  if ( fp = fopen( csv_path, "r" ) ) {
+  if ( exports ) {
+    name = strrchr( path, '/' );
+    if ( ( export = find_export( exports, name ? name + 1 : path ) ) == NULL ) 
+      return -1;
+    return csv_bounds( export->data, export->size, t_first, t_last );
+  }
 
-    time_csv = calloc( data->subset[subset]->n_samples, sizeof( int ) );
+  if ( ( fp = fopen( path, "r" ) ) == NULL ) 
+    return -1;
 
-    line = calloc( LINE_LEN, sizeof( char ) );
-    dum  = calloc( LINE_LEN, sizeof( char ) );
+  /* .rrb: the first and last bit set in the bitmap, values are not read */
 
-    j = 0;
-    
-    while ( fgets( line, LINE_LEN, fp ) != NULL ) {
-      sscanf( line, "%d,%s", &time_tmp, dum );
-      if( time_tmp <= max_time ) {
-	time_csv[j] = time_tmp;
-	//fprintf( stderr,"j = %d\n", j );
-	j++;
+  if ( is_rrb_path( path ) ) {
+    if ( ( fread( &head, sizeof( head ), 1, fp ) != 1 ) || 
+	 memcmp( head.magic, RRB_MAGIC, sizeof( head.magic ) ) || 
+	 ( head.n_valid <= 0 ) ) {
+      fclose( fp );
+      return -1;
+    }
+    first = -1;
+    last  = -1;
+    map_len = ( head.n_samples + 7 ) / 8;
+    for ( i = 0; i < (int)map_len; i += len ) {
+      len = map_len - i;
+      if ( len > sizeof( buf ) ) 
+	len = sizeof( buf );
+      if ( ( len = fread( buf, 1, len, fp ) ) == 0 ) 
+	break;
+      for ( k = 0; k < (int)len * 8; k++ ) {
+	if ( buf[k >> 3] & ( 1 << ( k & 7 ) ) ) {
+	  if ( first < 0 ) 
+	    first = i * 8 + k;
+	  last = i * 8 + k;
+	}
       }
     }
-    
-    free( line );
-    free( dum );
-
-    return time_csv; 
-    
     fclose( fp );
+    if ( first < 0 ) 
+      return -1;
+    *t_first = head.t_start + first * head.interval;
+    *t_last  = head.t_start + last * head.interval;
+    return 0;
+  }
 
-  } else {
+  /* 
+   * gzipped (-z): no way to seek to the end, inflated in passing, with
+   * the last two blocks kept
+   */
+
+  len = strlen( path );
+  if ( ( len > strlen( GZ_EXT ) ) && 
+       !strcmp( path + len - strlen( GZ_EXT ), GZ_EXT ) ) {
+    fclose( fp );
+    return gz_bounds( path, t_first, t_last );
+  }
+
+  len = fread( buf, 1, sizeof( buf ), fp );
+  if ( csv_bounds( buf, len, t_first, t_last ) ) {
+    fclose( fp );
+    return -1;
+  }
+
+  /* a larger file has its last sample in its last block */
+
+  if ( ( len == sizeof( buf ) ) && ( fseek( fp, 0, SEEK_END ) == 0 ) && 
+       ( ( size = ftell( fp ) ) > (long)sizeof( buf ) ) && 
+       ( fseek( fp, size - (long)sizeof( buf ), SEEK_SET ) == 0 ) ) {
+    len = fread( buf, 1, sizeof( buf ), fp );
+    if ( csv_bounds( buf, len, &t, t_last ) ) {
+      *t_last = *t_first;
+    }
+  }
+  fclose( fp );
+
+  return 0;
+}
+
+
+
+int gz_bounds( char* path, int* t_first, int* t_last ) {
+
+  gzFile fp;
+  char buf[2 * PLAN_SCAN_LEN];
+  int len;
+  int n;
+  int t;
+
+  if ( ( fp = gzopen( path, "r" ) ) == NULL ) 
+    return -1;
+
+  if ( ( ( len = gzread( fp, buf, PLAN_SCAN_LEN ) ) <= 0 ) || 
+       csv_bounds( buf, len, t_first, t_last ) ) {
+    gzclose( fp );
+    return -1;
+  }
+
+  while ( ( n = gzread( fp, buf + len, sizeof( buf ) - len ) ) > 0 ) {
+    len += n;
+    if ( len == sizeof( buf ) ) {
+      memmove( buf, buf + PLAN_SCAN_LEN, PLAN_SCAN_LEN );
+      len = PLAN_SCAN_LEN;
+    }
+  }
+  gzclose( fp );
+
+  if ( csv_bounds( buf, len, &t, t_last ) ) 
+    *t_last = *t_first;
+  return 0;
+}
+
+
+
+int csv_bounds( char* buf, size_t len, int* t_first, int* t_last ) {
+
+  char *end = buf + len;
+  char *bol;
+  char *eol;
+
+  /* 
+   * time of the first and of the last csv line with one, scanning from 
+   * either end of buf. Both stay T_NONE and -1 is returned when there
+   * is none.
+   */
+
+  *t_first = T_NONE;
+  *t_last  = T_NONE;
+
+  for ( bol = buf; bol < end; bol = eol + 1 ) {
+    if ( ( eol = memchr( bol, '\n', end - bol ) ) == NULL ) 
+      eol = end;
+    if ( csv_line_time( bol, eol, t_first ) == 0 ) 
+      break;
+  }
+  if ( *t_first == T_NONE ) 
+    return -1;
+
+  for ( eol = end; ; eol = bol - 1 ) {
+    for ( bol = eol; ( bol > buf ) && ( bol[-1] != '\n' ); bol-- ) 
+      ;
+    if ( ( csv_line_time( bol, eol, t_last ) == 0 ) || ( bol == buf ) ) 
+      break;
+  }
+  return 0;
+}
+
+
+
+int csv_line_time( char* p, char* end, int* t ) {
+
+  int neg = 0;
+  int val = 0;
+  char *start;
+
+  /* the time of a "<time>,<value>" line, as csv_parse_line reads it */
+
+  while ( ( p < end ) && ( ( *p == ' ' ) | ( *p == '\t' ) ) ) 
+    p++;
+  if ( ( p < end ) && ( *p == '-' ) ) {
+    neg = 1;
+    p++;
+  }
+  start = p;
+  while ( ( p < end ) && ( *p >= '0' ) && ( *p <= '9' ) ) {
+    if ( val > ( 0x7fffffff - 9 ) / 10 ) 
+      return -1;
+    val = val * 10 + ( *p - '0' );
+    p++;
+  }
+  if ( p == start ) 
+    return -1;
+  while ( ( p < end ) && ( ( *p == ' ' ) | ( *p == '\t' ) ) ) 
+    p++;
+  if ( ( p == end ) || ( *p != ',' ) ) 
+    return -1;
+
+  *t = neg ? -val : val;
+  return 0;
+}
+
+
+
+dev_index_s *read_device_index( char *xml_file ) {
+
+  ezxml_t doc_;
+  ezxml_t uuid_;
+  ezxml_t rrdlogger_;
+  ezxml_t name_;
+
+  dev_index_s *index;
+  dev_entry_s *entry;
+  unsigned int h;
+  int cnt;
+
+  /* 
+   * Parse config_hcb_rrd.xml once and index all rrdLoggers by uuid, so 
+   * that looking up a device name doesn't need a parse and a linear walk 
+   * over all loggers for each .dat file.
+   */
+
+  if ( ( doc_ = ezxml_parse_file( xml_file ) ) == NULL ) {
+    fprintf( stderr, "unable tot open xml file: %s\n", xml_file ); 
+    return NULL;
+  }
+
+  cnt = 0;
+  for ( rrdlogger_ = ezxml_child( doc_, "rrdLogger" ); rrdlogger_; 
+	rrdlogger_ = rrdlogger_->next ) {
+    cnt++;
+  }
+
+  index = calloc( 1, sizeof( dev_index_s ) );
+  index->n_buckets = 16;
+  while ( index->n_buckets < 2 * cnt ) {
+    index->n_buckets *= 2;
+  }
+  index->buckets = calloc( index->n_buckets, sizeof( dev_entry_s* ) );
+
+  for ( rrdlogger_ = ezxml_child( doc_, "rrdLogger" ); rrdlogger_; 
+	rrdlogger_ = rrdlogger_->next ) {
+      
+    uuid_ = ezxml_child( rrdlogger_, "uuid" );
+    name_ = ezxml_child( rrdlogger_, "name" );
+
+    /* first entry wins, like the linear search did */
+
+    if ( get_device_name( index, ezxml_txt( uuid_ ) ) == NULL ) {
+      entry = malloc( sizeof( dev_entry_s ) );
+      entry->uuid = strdup( ezxml_txt( uuid_ ) );
+      entry->name = strdup( ezxml_txt( name_ ) );
+      h = hash_str( entry->uuid ) & ( index->n_buckets - 1 );
+      entry->next = index->buckets[h];
+      index->buckets[h] = entry;
+    }
+  }
+
+  ezxml_free( doc_ );
+
+  return index;
+}
+
+
+
+dev_index_s *get_device_index( tl_ctx_s *ctx, char *xml_file ) {
+
+  cfg_cache_s *cfg;
+  struct stat st;
+
+  /* 
+   * device index of xml_file, from the context's cache unless the file 
+   * changed since it was parsed. The index belongs to the context.
+   */
+
+  for ( cfg = ctx->configs; cfg; cfg = cfg->next ) {
+    if ( !strcmp( cfg->path, xml_file ) ) 
+      break;
+  }
+
+  if ( stat( xml_file, &st ) ) {
+    fprintf( stderr, "unable tot open xml file: %s\n", xml_file ); 
+    return NULL;
+  }
+
+  if ( cfg && cfg->devices && ( cfg->size == st.st_size ) &&
+       ( cfg->mtime.tv_sec == st.st_mtim.tv_sec ) && 
+       ( cfg->mtime.tv_nsec == st.st_mtim.tv_nsec ) ) {
+    return cfg->devices;
+  }
+
+  if ( cfg == NULL ) {
+    cfg = calloc( 1, sizeof( cfg_cache_s ) );
+    cfg->path = strdup( xml_file );
+    cfg->next = ctx->configs;
+    ctx->configs = cfg;
+  }
+
+  free_device_index( cfg->devices );
+  cfg->devices = read_device_index( xml_file );
+  cfg->size    = st.st_size;
+  cfg->mtime   = st.st_mtim;
+
+  return cfg->devices;
+}
+
+
+
+char *get_device_name( dev_index_s *index, char *uuid ) {
+
+  dev_entry_s *entry;
+
+  /* look up device name, returns a pointer into the index or NULL */
+
+  if ( index == NULL ) 
+    return NULL;
+
+  for ( entry = index->buckets[hash_str( uuid ) & ( index->n_buckets - 1 )]; 
+	entry; entry = entry->next ) {
+    if ( !strcmp( uuid, entry->uuid ) ) {
+      return entry->name;
+    }
+  }
+
+  return NULL;
+}
+
+
+
+void free_device_index( dev_index_s *index ) {
+
+  dev_entry_s *entry;
+  dev_entry_s *next;
+  int i;
+
+  if ( index ) {
+    for ( i = 0; i < index->n_buckets; i++ ) {
+      for ( entry = index->buckets[i]; entry; entry = next ) {
+	next = entry->next;
+	free( entry->uuid );
+	free( entry->name );
+	free( entry );
+      }
+    }
+    free( index->buckets );
+    free( index );
+  }
+}
+
+
+
+unsigned int hash_str( char *str ) {
+
+  unsigned int h = 2166136261u;
+
+  /* FNV-1a */
+
+  while ( *str ) {
+    h ^= (unsigned char)*str++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+
+
+void print_data( dat_s* data ) {
+
+  int j;
+
+  fprintf( out_stream(), "magic number    : %.17s\n", data->magic );
+  fprintf( out_stream(), "deviceUuid size : %d\n", data->devUuid_len );
+  fprintf( out_stream(), "deviceUuid      : %s\n", data->deviceUuid );
+  fprintf( out_stream(), "deviceVar size  : %d\n", data->devVar_len );
+  fprintf( out_stream(), "deviceVar       : %s\n", data->deviceVar );
+  fprintf( out_stream(), "device_name     : %s\n", data->rrd_device_name );
+  fprintf( out_stream(), "deviceSvc size  : %d\n", data->devSvc_len );
+  fprintf( out_stream(), "deviceSvc       : %s\n", data->deviceSvc );
+  fprintf( out_stream(), "sampleType size : %d\n", data->sampleT_len );
+  fprintf( out_stream(), "sampleType      : %s\n", data->sampleType );
+  fprintf( out_stream(), "nr of subsets   : %d\n", data->n_sets );
+  
+  for ( j = 0; j < data->n_sets; j++ ) {
+    fprintf( out_stream(), "unk_0           : %d\n", data->subset[j]->unk_0 );
+    fprintf( out_stream(), "unk_1           : %d\n", data->subset[j]->unk_1 );
+    fprintf( out_stream(), "unk_2           : %d\n", data->subset[j]->unk_2 );
+    fprintf( out_stream(), "value           : %.3f\n", data->subset[j]->value );
+    fprintf( out_stream(), "divider         : %.3f\n", data->subset[j]->divider );
+    fprintf( out_stream(), "timestamp_0     : %d\n", data->subset[j]->timestamp_0 );
+    fprintf( out_stream(), "timestamp_1     : %d\n", data->subset[j]->timestamp_1 );
+    fprintf( out_stream(), "minSamplesPerBin: %d\n", data->subset[j]->minSamplesPerBin );
+    fprintf( out_stream(), "binLength size  : %d\n", data->subset[j]->binL_len );
+    fprintf( out_stream(), "binLength       : %s\n", data->subset[j]->binLength );
+    fprintf( out_stream(), "file offset     : %d\n", data->subset[j]->file_offset );
+    fprintf( out_stream(), "n_samples       : %d\n", data->subset[j]->n_samples );
+    fprintf( out_stream(), "unk_3           : %d\n", data->subset[j]->unk_3 );
+    fprintf( out_stream(), "int_len         : %d\n", data->subset[j]->int_len );
+    fprintf( out_stream(), "interval        : %s\n", data->subset[j]->interval );
+    fprintf( out_stream(), "cons_len        : %d\n", data->subset[j]->cons_len );
+    fprintf( out_stream(), "consolidator    : %s\n", data->subset[j]->consolidator );
+    fprintf( out_stream(), "next_subset ptr : 0x%08x\n", data->subset[j]->next );
+
+    if ( data->subset[j]->next == NULL ) {
+      break;
+      break;
+    }
+  }
+} 
+
+
+dat_s *read_dat_file( char * dir, arena_s *arena ) { 
+
+  dat_s *data;
+  dat_sub_s *sub;
+  cursor_s cur;
+  struct stat st;
+  char *buf;
+  int fd;
+  int type;
+  int j;
+  ssize_t len;
+
+  /* 
+   * Read the whole .dat file in one go and decode it in place. The string
+   * fields point into the buffer, which lives in the run's arena as well.
+   */
+
+  data = arena_alloc( arena, sizeof( dat_s ) );
+  data->deviceUuid = data->deviceVar = data->deviceSvc = data->sampleType = "";
+
+  if ( ( fd = open( dir, O_RDONLY ) ) < 0 ) {
+    fprintf( out_stream(), "read_dat_file: Cannot open %s for reading\n", dir );
+    return data;
+  }
+  if ( fstat( fd, &st ) != 0 ) {
+    st.st_size = 0;
+  }
+  buf = arena_alloc( arena, st.st_size + 1 );
+  len = read( fd, buf, st.st_size );
+  close( fd );
+
+  cur.p   = buf;
+  cur.end = buf + ( len > 0 ? len : 0 );
+
+  if ( ( cur.end - cur.p < 17 ) || memcmp( cur.p, MAGIC, 17 ) ) {
+    fprintf( out_stream(), "Bad magic number\n" );
+    return data;
+  }
+  memcpy( data->magic, cur.p, 17 );
+  cur.p += 17;
+
+  /* 
+   * read device uuid and other device identifiers.
+   */
+
+  if ( cursor_string( &cur, &data->devUuid_len, &data->deviceUuid ) |
+       cursor_string( &cur, &data->devVar_len,  &data->deviceVar ) |
+       cursor_string( &cur, &data->devSvc_len,  &data->deviceSvc ) |
+       cursor_string( &cur, &data->sampleT_len, &data->sampleType ) ) {
+    fprintf( out_stream(), "dat file is truncated\n" );
+    return data;
+  }
+
+  /* 
+   * Workaround for not yet initialized databases. 
+   * Uuid is only assigned when there has been contact with the 
+   * meter adapter first. Until then, the word "placeholder"
+   * is used as uuid. 
+   */
+
+  if ( strcmp( data->deviceUuid, "placeholder" ) == 0 ) 
+    return data;
+
+  type = strcmp( data->sampleType, "integer" ) ? DOUBLE : INTEGER;
+
+  for ( j = 0; ( j < N_SUBSETS ) && ( cur.p < cur.end ); j++ ) {
+
+    sub = arena_alloc( arena, sizeof( dat_sub_s ) );
+
+    /* 
+     * A subset that doesn't fit in the remaining bytes is dropped.
+     * Workaround for poor .dat file rewriting code, which leaves trailing
+     * bytes.
+     */
+
+    if ( read_dat_subset( &cur, sub, type ) ) {
+      fprintf( out_stream(), "dat file is partly corrupted, continuing ...\n" );
+      break;
+    }
+
+    data->subset[j] = sub;
+    data->n_sets = j + 1; 
+    if ( j > 0 ) {
+      data->subset[j-1]->next = sub;
+    }
+  }
+
+  return data;
+}
+
+
+
+int read_dat_subset( cursor_s* cur, dat_sub_s* sub, int type ) {
+
+  int err = 0;
+
+  /* decode one subset, non-zero when the file ends before it does */
+
+  if ( type == INTEGER ) {
+    err |= cursor_int( cur, &sub->unk_0 );
+    err |= cursor_int( cur, &sub->unk_1 );
+    err |= cursor_int( cur, &sub->unk_2 );
+  } else {
+    err |= cursor_double( cur, &sub->value );
+    err |= cursor_double( cur, &sub->divider );
+  }
+
+  err |= cursor_int( cur, &sub->timestamp_0 );
+  err |= cursor_int( cur, &sub->timestamp_1 );
+  err |= cursor_int( cur, &sub->minSamplesPerBin );
+  err |= cursor_string( cur, &sub->binL_len, &sub->binLength );
+  err |= cursor_int( cur, &sub->file_offset );
+  err |= cursor_int( cur, &sub->n_samples );
+  err |= cursor_int( cur, &sub->unk_3 );
+  err |= cursor_string( cur, &sub->int_len, &sub->interval );
+  err |= cursor_string( cur, &sub->cons_len, &sub->consolidator );
+
+  return err;
+}
+
+
+
+int cursor_int( cursor_s* cur, int* val ) {
+
+  if ( cur->end - cur->p < (long)sizeof( int ) ) {
+    cur->p = cur->end;
+    return -1;
+  }
+  memcpy( val, cur->p, sizeof( int ) );
+  cur->p += sizeof( int );
+  return 0;
+}
+
+
+
+int cursor_double( cursor_s* cur, double* val ) {
+
+  if ( cur->end - cur->p < (long)sizeof( double ) ) {
+    cur->p = cur->end;
+    return -1;
+  }
+  memcpy( val, cur->p, sizeof( double ) );
+  cur->p += sizeof( double );
+  return 0;
+}
+
+
+
+int cursor_string( cursor_s* cur, int* len, char** str ) {
+
+  /* 
+   * Length prefixed string, the length includes the terminating 0. The
+   * string is not copied, *str points into the buffer.
+   */
+
+  *str = "";
+  if ( cursor_int( cur, len ) ) 
+    return -1;
+
+  if ( ( *len < 0 ) || ( cur->end - cur->p < *len ) ) {
+    cur->p = cur->end;
+    return -1;
+  }
+
+  if ( *len > 0 ) {
+
+    /* make sure it is terminated, the last byte is the 0 or expendable */
+
+    cur->p[*len - 1] = '\0';
+    *str = cur->p;
+    cur->p += *len;
+  }
+  return 0;
+}
+
+
+
+char *get_csv_path( char* csv_dir, dat_s* data, int subset, int binary, 
+		    arena_s *arena ) {
+
+  char* csv_path;
+  char csv_name[MAX_LEN];
+  char *csv_name_1;
+  char *csv_name_2;
+  char *ext;
+
+  if ( ( subset >=0 ) & ( subset < data->n_sets ) ) {
+    if ( data->rrd_device_name != "" ) {
+      
+      csv_path = arena_alloc( arena, MAX_LEN );
+      
+      csv_name_1 = data->deviceVar;
+      csv_name_2 = data->subset[subset]->interval;
+      ext = binary ? RRB_EXT : ".csv";
+      
+      if ( strncmp( data->rrd_device_name, "thermstat", 9 ) == 0 ) {
+	sprintf( csv_name, "%s_%s%s", 
+		 data->rrd_device_name, csv_name_2, ext );
+      } else {
+	sprintf( csv_name, "%s_%s_%s%s", 
+		 data->rrd_device_name, csv_name_1, csv_name_2, ext );
+      }
+      
+      csv_path = strcpy( csv_path, csv_dir ); 
+      csv_path = strcat( csv_path, csv_name ); 
+      fprintf( out_stream(), "csv_path        : %s\n", csv_path );
+      return csv_path; 
+    } else {
+      return NULL;
+    }
+  } else {
+    fprintf( out_stream(), "transfer-logs: get_csv_path: subset out of range\n");
+    return NULL;
+  }
+}
+
+
+
+int is_rrb_path( char* path ) {
+  char* ext;
+
+  ext = strrchr( path, '.' );
+  return ( ext != NULL ) && ( strcmp( ext, RRB_EXT ) == 0 );
+}
+
+
+
+char *get_rra_path( dat_s* data, char *uuid, char* loc, int subset,
+		    arena_s *arena ) {
+
+  char *rra_path;
+  char *rra_name_2;
+
+  if ( ( subset >=0 ) & ( subset < data->n_sets ) ) {
+    if ( data->rrd_device_name != "" ) {
+      
+      rra_path = arena_alloc( arena, MAX_LEN );
+      rra_name_2 = data->subset[subset]->interval;
+      
+      sprintf( rra_path , "%s%s-%s.rra", loc,
+       	       uuid, rra_name_2 );
+       fprintf( out_stream(), "rra_path        : %s\n", rra_path );
+     return rra_path; 
+    } else {
+      return NULL;
+    }
+  } else {
+    fprintf( out_stream(), "get_rra_path: subset out of range\n");
+    return NULL;
+  }
+}
+
+
+rra_s* rra_open( char* rra_path, dat_s* data, int subset, int writable ) {
+
+  rra_s* rra;
+  struct stat st;
+  size_t width;
+  ssize_t got;
+  int fd = -1;
+
+  /* 
+   * Map an .rra file as a vector of n_samples ints or doubles. Files that 
+   * are shorter than the geometry in the .dat file says are extended when 
+   * opened for writing. Read-only, they are read with a single pread into a
+   * zero-filled heap buffer, as mapping beyond EOF is not allowed.
+   * For writing, the live file is cloned (or copied) to a temporary file 
+   * first and that is mapped instead, the live file is only written by 
+   * commit_rra_files.
+   */
+
+  /* 
+   * n_samples comes straight from the .dat file. Check it before sizing 
+   * anything by it, a corrupt header must not extend or map a huge file.
+   */
+
+  if ( ( data->subset[subset]->n_samples <= 0 ) || 
+       ( data->subset[subset]->n_samples > RRA_MAX_SAMPLES ) ) {
+    fprintf( out_stream(), "rra_open: Invalid number of samples %d for %s\n",
+	     data->subset[subset]->n_samples, rra_path );
+    return NULL;
+  }
+
+  rra = calloc( 1, sizeof( rra_s ) );
+
+  if ( !strcmp( data->sampleType, "integer" ) ) {
+    rra->data_type = INTEGER;
+    width = sizeof( int );
+  } else {
+    rra->data_type = DOUBLE;
+    width = sizeof( double );
+  }
+
+  rra->n_samples = data->subset[subset]->n_samples;
+  rra->size      = (size_t)rra->n_samples * width;
+  rra->writable  = writable;
+
+  if ( ( rra->fd = open( rra_path, O_RDONLY ) ) < 0 ) {
+    fprintf( out_stream(), "rra_open: Cannot open file %s: %s\n", rra_path, strerror( errno ) );
+    free( rra );
+    return NULL;
+  }
+
+  if ( fstat( rra->fd, &st ) ) {
+    st.st_size = 0;
+    st.st_mode = 0644;
+  }
+
+  if ( writable ) {
+    rra->tmp_path = malloc( 2 * MAX_LEN );
+    rra_tmp_path( rra_path, rra->tmp_path, 2 * MAX_LEN );
+    fd = open( rra->tmp_path, O_RDWR | O_CREAT | O_TRUNC, st.st_mode & 07777 );
+    if ( ( fd < 0 ) || clone_fd( rra->fd, fd ) ) {
+      fprintf( out_stream(), "rra_open: Cannot copy %s to %s: %s\n", rra_path, 
+	       rra->tmp_path, strerror( errno ) );
+      goto fail;
+    }
+    close( rra->fd );
+    rra->fd = fd;
+    fd = -1;
+  }
+
+  if ( writable & ( st.st_size < (off_t)rra->size ) ) {
+    if ( ftruncate( rra->fd, rra->size ) ) {
+      fprintf( out_stream(), "rra_open: Cannot extend %s: %s\n", rra_path, strerror( errno ) );
+      goto fail;
+    }
+    st.st_size = rra->size;
+  }
+
+  if ( rra->size == 0 ) {
+    rra->base = NULL;
+  } else if ( st.st_size >= (off_t)rra->size ) {
+    rra->base = mmap( NULL, rra->size, 
+		      writable ? PROT_READ | PROT_WRITE : PROT_READ, 
+		      MAP_SHARED, rra->fd, 0 );
+    if ( rra->base == MAP_FAILED ) {
+      fprintf( out_stream(), "rra_open: Cannot map %s: %s\n", rra_path, strerror( errno ) );
+      goto fail;
+    }
+    rra->mapped = 1;
+  } else {
+    rra->base = calloc( 1, rra->size );
+    got = pread( rra->fd, rra->base, st.st_size, 0 );
+    if ( got < st.st_size ) {
+      fprintf( out_stream(), "rra_open: Short read on %s\n", rra_path );
+    }
+  }
+
+  rra->int_val  = rra->base;
+  rra->dble_val = rra->base;
+
+  return rra;
+
+ fail:
+  if ( fd >= 0 ) 
+    close( fd );
+  close( rra->fd );
+  if ( rra->tmp_path ) {
+    unlink( rra->tmp_path );
+    free( rra->tmp_path );
+  }
+  free( rra );
+  return NULL;
+}
+
+
+
+int rra_close( rra_s* rra ) {
+
+  int ret = 0;
+
+  /* 
+   * Unmapping hands the dirty slots over to the page cache. A modified 
+   * copy is synced once and kept for commit_rra_files (returns 1), an 
+   * unmodified or unsyncable one is removed again (returns 0 or -1).
+   */
+
+  if ( rra ) {
+    if ( rra->mapped ) {
+      munmap( rra->base, rra->size );
+    } else {
+      free( rra->base );
+    }
+    if ( rra->writable ) {
+      if ( rra->dirty ) {
+	ret = fsync( rra->fd ) ? -1 : 1;
+      }
+      if ( ret <= 0 ) {
+	unlink( rra->tmp_path );
+      }
+      free( rra->tmp_path );
+    }
+    close( rra->fd );
+    free( rra );
+  }
+  return ret;
+}
+
+
+
+char* rra_tmp_path( char* rra_path, char* buf, size_t len ) {
+  snprintf( buf, len, "%s%s", rra_path, RRA_TMP_EXT );
+  return buf;
+}
+
+
+
+void print_plan( job_s** jobs, int n_jobs ) {
+
+  int n_files = 0;
+  long long n_slots = 0;
+  int i;
+
+  /* totals of a --plan run */
+
+  for ( i = 0; i < n_jobs; i++ ) {
+    if ( ( jobs[i]->type == JOB_PLAN ) && ( jobs[i]->planned > 0 ) ) {
+      n_files++;
+      n_slots += jobs[i]->planned;
+    }
+  }
+  printf( "\n%d .rra files would be updated, %lld slots at most, nothing changed\n",
+	  n_files, n_slots );
+}
+
+
+
+int commit_rra_files( job_s** jobs, int n_jobs, char* rra_location, 
+		      int* n_failed ) {
+
+  char tmp_path[2 * MAX_LEN];
+  dat_s *data;
+  size_t width;
+  int cnt = 0;
+  int i;
+
+  /* 
+   * Copy the slots of all merged copies back into their live files. 
+   * hcb_rrd keeps the live files open and writes them in place, so they 
+   * are written in place too: a new inode would leave the daemon writing 
+   * into the old one, and copying whole files would undo whatever it wrote
+   * during the merge. A copy is only removed once its live file has been 
+   * synced. One that could not be copied back is kept, with the journal, 
+   * for the next run. Returns the number of files updated, n_failed gets 
+   * the others.
+   */
+
+  *n_failed = 0;
+  for ( i = 0; i < n_jobs; i++ ) {
+    if ( ( jobs[i]->type != JOB_MERGE ) || !jobs[i]->staged ) 
+      continue;
+    data  = jobs[i]->data;
+    width = strcmp( data->sampleType, "integer" ) ? sizeof( double ) : 
+      sizeof( int );
+    rra_tmp_path( jobs[i]->rra_path, tmp_path, sizeof( tmp_path ) );
+    if ( write_back( tmp_path, jobs[i]->rra_path, width, 
+		     data->subset[jobs[i]->subset]->n_samples, 
+		     jobs[i]->dirty ) ) {
+      fprintf( stderr, "commit_rra_files: Cannot update %s: %s\n", 
+	       jobs[i]->rra_path, strerror( errno ) );
+      ( *n_failed )++;
+    } else {
+      unlink( tmp_path );
+      jobs[i]->committed = 1;
+      cnt++;
+    }
+  }
+
+  if ( cnt && fsync_dir( rra_location ) ) {
+    fprintf( stderr, "commit_rra_files: Cannot sync %s: %s\n", rra_location, 
+	     strerror( errno ) );
+  }
+  return cnt;
+}
+
+
+
+int write_back( char* src, char* dst, size_t width, int n_samples, 
+		int* dirty ) {
+
+  char buf[COPY_BUF_LEN];
+  off_t off[2];
+  size_t len[2];
+  size_t done;
+  ssize_t n;
+  int k;
+  int in;
+  int out;
+  int err = 0;
+
+  /* 
+   * Copy the slots a merge wrote, dirty[1] of them from slot dirty[0] on, 
+   * wrapping at the end of the ring buffer, from src into the same place 
+   * in dst and sync it. The other slots of dst are left as hcb_rrd may 
+   * have written them since src was copied. dst keeps its inode, and no
+   * reflinks here: they would swap the extents under hcb_rrd's mapping.
+   * Copying the same slots again gives the same file, so a copy cut short
+   * is finished by the run that resumes the journal. 0 on success.
+   */
+
+  if ( ( dirty[0] < 0 ) || ( dirty[0] >= n_samples ) || ( dirty[1] <= 0 ) || 
+       ( dirty[1] > n_samples ) ) {
+    errno = EINVAL;
+    return -1;
+  }
+  off[0] = (off_t)dirty[0] * width;
+  len[0] = (size_t)( ( dirty[0] + dirty[1] > n_samples ) ? 
+		     n_samples - dirty[0] : dirty[1] ) * width;
+  off[1] = 0;
+  len[1] = (size_t)dirty[1] * width - len[0];
+
+  if ( ( in = open( src, O_RDONLY ) ) < 0 ) 
+    return -1;
+  if ( ( out = open( dst, O_WRONLY ) ) < 0 ) {
+    close( in );
+    return -1;
+  }
+
+  for ( k = 0; ( k < 2 ) && !err; k++ ) {
+    if ( lseek( out, off[k], SEEK_SET ) < 0 ) {
+      err = -1;
+      break;
+    }
+    for ( done = 0; done < len[k]; done += n ) {
+      n = pread( in, buf, ( len[k] - done < sizeof( buf ) ) ? 
+		 len[k] - done : sizeof( buf ), off[k] + done );
+      if ( n <= 0 ) {
+	if ( ( n < 0 ) && ( errno == EINTR ) ) {
+	  n = 0;
+	  continue;
+	}
+	if ( n == 0 ) 
+	  errno = EIO;
+	err = -1;
+	break;
+      }
+      if ( write_all( out, buf, n ) ) {
+	err = -1;
+	break;
+      }
+    }
+  }
+  if ( !err && fdatasync( out ) ) 
+    err = -1;
+  close( in );
+  if ( close( out ) ) 
+    err = -1;
+  return err;
+}
+
+
+
+int clone_fd( int in, int out ) {
+
+  char buf[COPY_BUF_LEN];
+  ssize_t n;
+
+  /* 
+   * Copy the contents of in to out, from their current offsets. On file 
+   * systems with reflinks that shares the extents instead of copying 
+   * data, otherwise the kernel copies (copy_file_range, sendfile), and 
+   * only if it can't, the data goes through buf. Each fallback carries on 
+   * where the previous one stopped.
+   */
+
+#ifdef FICLONE
+  if ( ioctl( out, FICLONE, in ) == 0 ) 
+    return 0;
+#endif
+
+#ifdef __NR_copy_file_range
+  while ( ( ( n = syscall( __NR_copy_file_range, in, NULL, out, NULL, 
+			   COPY_CHUNK_LEN, 0 ) ) > 0 ) || 
+	  ( ( n < 0 ) && ( errno == EINTR ) ) ) 
+    ;
+  if ( n == 0 ) 
+    return 0;
+  if ( ( errno != ENOSYS ) && ( errno != EXDEV ) && ( errno != EINVAL ) && 
+       ( errno != EOPNOTSUPP ) ) 
+    return -1;
+#endif
+
+#ifdef __linux__
+  while ( ( ( n = sendfile( out, in, NULL, COPY_CHUNK_LEN ) ) > 0 ) || 
+	  ( ( n < 0 ) && ( errno == EINTR ) ) ) 
+    ;
+  if ( n == 0 ) 
+    return 0;
+  if ( ( errno != ENOSYS ) && ( errno != EINVAL ) ) 
+    return -1;
+#endif
+
+  while ( ( n = read( in, buf, sizeof( buf ) ) ) != 0 ) {
+    if ( n < 0 ) {
+      if ( errno == EINTR ) 
+	continue;
+      return -1;
+    }
+    if ( write_all( out, buf, n ) ) 
+      return -1;
+  }
+  return 0;
+}
+
+
+
+int copy_file( char* src, char* dst ) {
+
+  struct stat st;
+  struct timespec times[2];
+  int in;
+  int out;
+  int err;
+
+  /* 
+   * copy (or reflink) src to dst with the same permissions and times, 0 on
+   * success
+   */
+
+  if ( ( in = open( src, O_RDONLY ) ) < 0 ) 
+    return -1;
+  if ( fstat( in, &st ) || 
+       ( out = open( dst, O_WRONLY | O_CREAT | O_TRUNC, 
+		     st.st_mode & 07777 ) ) < 0 ) {
+    close( in );
+    return -1;
+  }
+  times[0] = st.st_atim;
+  times[1] = st.st_mtim;
+  err = clone_fd( in, out ) || futimens( out, times );
+  close( in );
+  if ( close( out ) ) 
+    err = -1;
+  return err;
+}
+
+
+
+int fsync_dir( char* dir ) {
+
+  int fd;
+  int err;
+
+  if ( ( fd = open( dir, O_RDONLY | O_DIRECTORY ) ) < 0 ) 
+    return -1;
+  err = fsync( fd );
+  close( fd );
+  return err;
+}
+
+
+
+int rra_mark_valid( rra_s* rra, int first, int n, unsigned char* bitmap, 
+		    int bit ) {
+
+  /* 
+   * Set a bit in bitmap, from bit on, for every filled slot in
+   * [first, first + n), and return how many there are. Not yet filled 
+   * slots hold 0x7FFFFFFF or NaN. bitmap must be zeroed and have a spare
+   * byte at the end. When bitmap is NULL, the slots are only counted.
+   */
+
+  pthread_once( &mark_once, init_mark_valid );
+
+  if ( rra->data_type ) {
+    return mark_int_fn( rra->int_val + first, n, bitmap, bit );
+  } else {
+    return mark_dble_fn( rra->dble_val + first, n, bitmap, bit );
+  }
+}
+
+
+
+/* store 8 result bits at an arbitrary bit position */
+
+#define PUT_BITS( bitmap, bit, bits )				\
+  do {								\
+    if ( bitmap ) {						\
+      (bitmap)[(bit) >> 3]     |= (bits) << ( (bit) & 7 );	\
+      (bitmap)[( (bit) >> 3 ) + 1] |= (bits) >> ( 8 - ( (bit) & 7 ) ); \
+    }								\
+  } while ( 0 )
+
+
+
+int mark_int( int* val, int n, unsigned char* bitmap, int bit ) {
+
+  int i;
+  int cnt = 0;
+
+  for ( i = 0; i < n; i++ ) {
+    if ( val[i] != 0x7fffffff ) {
+      if ( bitmap ) 
+	bitmap[( bit + i ) >> 3] |= 1 << ( ( bit + i ) & 7 );
+      cnt++;
+    }
+  }
+  return cnt;
+}
+
+
+
+int mark_dble( double* val, int n, unsigned char* bitmap, int bit ) {
+
+  int i;
+  int cnt = 0;
+
+  for ( i = 0; i < n; i++ ) {
+    if ( !isnan( val[i] ) ) {
+      if ( bitmap ) 
+	bitmap[( bit + i ) >> 3] |= 1 << ( ( bit + i ) & 7 );
+      cnt++;
+    }
+  }
+  return cnt;
+}
+
+
+
+#ifdef HAVE_X86_SIMD
+
+/* 
+ * SSE2 is always there on x86_64, AVX2 is checked for at run time. Each
+ * step compares 8 samples with the sentinel at once and turns the lanes 
+ * into 8 bitmap bits.
+ */
+
+__attribute__(( target( "sse2" ) ))
+int mark_int_sse2( int* val, int n, unsigned char* bitmap, int bit ) {
+
+  int i;
+  int cnt = 0;
+  unsigned int bits;
+  __m128i empty = _mm_set1_epi32( 0x7fffffff );
+  __m128i lo;
+  __m128i hi;
+
+  for ( i = 0; i + 8 <= n; i += 8 ) {
+    lo = _mm_cmpeq_epi32( _mm_loadu_si128( (__m128i*)( val + i ) ), empty );
+    hi = _mm_cmpeq_epi32( _mm_loadu_si128( (__m128i*)( val + i + 4 ) ), empty );
+    bits = ~( _mm_movemask_ps( _mm_castsi128_ps( lo ) ) |
+	      ( _mm_movemask_ps( _mm_castsi128_ps( hi ) ) << 4 ) ) & 0xff;
+    PUT_BITS( bitmap, bit + i, bits );
+    cnt += __builtin_popcount( bits );
+  }
+  return cnt + mark_int( val + i, n - i, bitmap, bit + i );
+}
+
+
+
+__attribute__(( target( "sse2" ) ))
+int mark_dble_sse2( double* val, int n, unsigned char* bitmap, int bit ) {
+
+  int i;
+  int j;
+  int cnt = 0;
+  unsigned int bits;
+  __m128d v;
+
+  for ( i = 0; i + 8 <= n; i += 8 ) {
+    bits = 0;
+    for ( j = 0; j < 8; j += 2 ) {
+      v = _mm_loadu_pd( val + i + j );
+      bits |= _mm_movemask_pd( _mm_cmpord_pd( v, v ) ) << j;
+    }
+    PUT_BITS( bitmap, bit + i, bits );
+    cnt += __builtin_popcount( bits );
+  }
+  return cnt + mark_dble( val + i, n - i, bitmap, bit + i );
+}
+
+
+
+__attribute__(( target( "avx2" ) ))
+int mark_int_avx2( int* val, int n, unsigned char* bitmap, int bit ) {
+
+  int i;
+  int cnt = 0;
+  unsigned int bits;
+  __m256i empty = _mm256_set1_epi32( 0x7fffffff );
+  __m256i v;
+
+  for ( i = 0; i + 8 <= n; i += 8 ) {
+    v = _mm256_cmpeq_epi32( _mm256_loadu_si256( (__m256i*)( val + i ) ), empty );
+    bits = ~_mm256_movemask_ps( _mm256_castsi256_ps( v ) ) & 0xff;
+    PUT_BITS( bitmap, bit + i, bits );
+    cnt += __builtin_popcount( bits );
+  }
+  return cnt + mark_int( val + i, n - i, bitmap, bit + i );
+}
+
+
+
+__attribute__(( target( "avx2" ) ))
+int mark_dble_avx2( double* val, int n, unsigned char* bitmap, int bit ) {
+
+  int i;
+  int cnt = 0;
+  unsigned int bits;
+  __m256d lo;
+  __m256d hi;
+
+  for ( i = 0; i + 8 <= n; i += 8 ) {
+    lo = _mm256_loadu_pd( val + i );
+    hi = _mm256_loadu_pd( val + i + 4 );
+    bits = _mm256_movemask_pd( _mm256_cmp_pd( lo, lo, _CMP_ORD_Q ) ) |
+      ( _mm256_movemask_pd( _mm256_cmp_pd( hi, hi, _CMP_ORD_Q ) ) << 4 );
+    PUT_BITS( bitmap, bit + i, bits );
+    cnt += __builtin_popcount( bits );
+  }
+  return cnt + mark_dble( val + i, n - i, bitmap, bit + i );
+}
+
+#endif /* HAVE_X86_SIMD */
+
+
+
+#ifdef __ARM_NEON
+
+/* 
+ * ARMv7 NEON has no double lanes, so only the integer kernel. The compare
+ * results are weighted per lane and summed pairwise into 8 bits.
+ */
+
+int mark_int_neon( int* val, int n, unsigned char* bitmap, int bit ) {
+
+  static const uint32_t lo_w[4] = { 1, 2, 4, 8 };
+  static const uint32_t hi_w[4] = { 16, 32, 64, 128 };
+  int i;
+  int cnt = 0;
+  unsigned int bits;
+  int32x4_t empty = vdupq_n_s32( 0x7fffffff );
+  uint32x4_t lo;
+  uint32x4_t hi;
+  uint32x2_t sum;
+
+  for ( i = 0; i + 8 <= n; i += 8 ) {
+    lo = vandq_u32( vmvnq_u32( vceqq_s32( vld1q_s32( val + i ), empty ) ), 
+		    vld1q_u32( lo_w ) );
+    hi = vandq_u32( vmvnq_u32( vceqq_s32( vld1q_s32( val + i + 4 ), empty ) ),
+		    vld1q_u32( hi_w ) );
+    lo  = vorrq_u32( lo, hi );
+    sum = vpadd_u32( vget_low_u32( lo ), vget_high_u32( lo ) );
+    sum = vpadd_u32( sum, sum );
+    bits = vget_lane_u32( sum, 0 );
+    PUT_BITS( bitmap, bit + i, bits );
+    cnt += __builtin_popcount( bits );
+  }
+  return cnt + mark_int( val + i, n - i, bitmap, bit + i );
+}
+
+#endif /* __ARM_NEON */
+
+
+
+void init_mark_valid( void ) {
+
+  /* pick the widest kernels this cpu runs, the scalar ones otherwise */
+
+  mark_int_fn  = mark_int;
+  mark_dble_fn = mark_dble;
+
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports( "avx2" ) ) {
+    mark_int_fn  = mark_int_avx2;
+    mark_dble_fn = mark_dble_avx2;
+  } else if ( __builtin_cpu_supports( "sse2" ) ) {
+    mark_int_fn  = mark_int_sse2;
+    mark_dble_fn = mark_dble_sse2;
+  }
+#elif defined( __ARM_NEON )
+  mark_int_fn = mark_int_neon;
+#endif
+}
+
+
+
+csv_s* read_csv_file( char* csv_path, dat_s* data, int subset, int t_max ) {
+
+  gzFile fp;
+  csv_s* csv;
+  char* chunk;
+  int len;
+  int data_type;
+
+  /* 
+   * read time and value columns from csv file in one pass, store in vectors.
+   * Files staged with -z are inflated on the fly.
+   */
+
+  if ( ( fp = gzopen( csv_path, "r" ) ) ) {
+
+    if ( !strcmp( data->sampleType, "integer" ) ) {
+      data_type = INTEGER;
+    } else {
+      data_type = DOUBLE;
+    }
+
+    csv = scratch_get( SCRATCH_CSV, sizeof( csv_s ) );
+    csv_init( csv, data_type, t_max, data->subset[subset]->n_samples );
+
+    chunk = scratch_get( SCRATCH_CHUNK, CSV_CHUNK_LEN );
+
+    while ( ( len = gzread( fp, chunk, CSV_CHUNK_LEN ) ) > 0 ) {
+      csv_feed( csv, chunk, len );
+    }
+    csv_finish( csv );
+
+    gzclose( fp );
+
+    return csv;
+
+  } else {
+
+    fprintf( out_stream(), "read_csv_file: Cannot open file %s for reading\n", csv_path );
+    return NULL;
+
+  }
+}
+
+
+
+csv_s* read_csv_export( export_s* export, dat_s* data, int subset, 
+			int t_max ) {
+
+  csv_s* csv;
+
+  /* parse a csv file from the unpacked export.zip in memory */
+
+  csv = scratch_get( SCRATCH_CSV, sizeof( csv_s ) );
+  csv_init( csv, strcmp( data->sampleType, "integer" ) ? DOUBLE : INTEGER, 
+	    t_max, data->subset[subset]->n_samples );
+  csv_feed( csv, export->data, export->size );
+  csv_finish( csv );
+
+  return csv;
+}
+
+
+
+csv_s* read_rrb_file( char* rrb_path, dat_s* data, int t_max ) {
+
+  FILE* fp;
+  csv_s* csv;
+  rrb_head_s head;
+  unsigned char* bitmap;
+  char* values;
+  size_t val_len;
+  size_t map_len;
+  int data_type;
+  int i;
+  int k;
+  int t;
+
+  /* 
+   * read a binary series written by write_data_to_rrb into the same 
+   * vectors a csv file ends up in, no text to parse
+   */
+
+  if ( ( fp = fopen( rrb_path, "r" ) ) == NULL ) {
+    fprintf( out_stream(), "read_rrb_file: Cannot open file %s for reading\n", rrb_path );
+    return NULL;
+  }
+
+  data_type = strcmp( data->sampleType, "integer" ) ? DOUBLE : INTEGER;
+  val_len   = data_type ? sizeof( int ) : sizeof( double );
+
+  if ( ( fread( &head, sizeof( head ), 1, fp ) != 1 ) || 
+       ( memcmp( head.magic, RRB_MAGIC, sizeof( head.magic ) ) != 0 ) ||
+       ( head.data_type != data_type ) || 
+       ( head.n_samples < 0 ) || ( head.n_valid < 0 ) || 
+       ( head.n_valid > head.n_samples ) ) {
+    fprintf( out_stream(), "read_rrb_file: %s is not a valid .rrb file\n", rrb_path );
+    fclose( fp );
+    return NULL;
+  }
+
+  map_len = ( head.n_samples + 7 ) / 8;
+  bitmap  = scratch_get( SCRATCH_CHUNK, map_len + 1 );
+  values  = scratch_get( SCRATCH_RAW, head.n_valid * val_len + 1 );
+
+  if ( ( fread( bitmap, 1, map_len, fp ) != map_len ) || 
+       ( fread( values, val_len, head.n_valid, fp ) != head.n_valid ) ) {
+    fprintf( out_stream(), "read_rrb_file: %s is truncated\n", rrb_path );
+    fclose( fp );
+    return NULL;
+  }
+  fclose( fp );
+
+  csv = scratch_get( SCRATCH_CSV, sizeof( csv_s ) );
+  csv_init( csv, data_type, t_max, head.n_valid );
+
+  for ( i = 0, k = 0; ( i < head.n_samples ) && ( k < head.n_valid ); i++ ) {
+    if ( bitmap[i >> 3] & ( 1 << ( i & 7 ) ) ) {
+      t = head.t_start + i * head.interval;
+
+      /* apply time limit, the series is chronological */
+
+      if ( t > t_max ) 
+	break;
+
+      csv->time[csv->n] = t;
+      if ( data_type ) {
+	memcpy( &csv->int_val[csv->n], values + k * val_len, val_len );
+      } else {
+	memcpy( &csv->dble_val[csv->n], values + k * val_len, val_len );
+      }
+      csv->n++;
+      k++;
+    }
+  }
+
+  return csv;
+}
+
+
+
+void csv_init( csv_s* csv, int data_type, int t_max, int size ) {
+
+  csv->data_type = data_type;
+  csv->t_max     = t_max;
+  csv->t_min     = T_NONE;
+  csv->t_last    = T_NONE;
+  csv->n         = 0;
+  csv->size      = ( size > 0 ) ? size : 1024;
+  csv->time      = scratch_get( SCRATCH_TIME, csv->size * sizeof( int ) );
+  csv->line_len  = 0;
+
+  if ( data_type ) {
+    csv->int_val  = scratch_get( SCRATCH_VAL, csv->size * sizeof( int ) );
+    csv->dble_val = NULL;
+  } else {
+    csv->int_val  = NULL;
+    csv->dble_val = scratch_get( SCRATCH_VAL, csv->size * sizeof( double ) );
+  }
+}
+
+
+
+void csv_feed( csv_s* csv, char* buf, size_t len ) {
+
+  char* p;
+  char* end;
+  char* eol;
+  size_t n;
+
+  /* 
+   * Parse a chunk of csv text. Lines may straddle chunk boundaries, the 
+   * unfinished tail of a chunk is kept in csv->line until the rest arrives.
+   */
+
+  p   = buf;
+  end = buf + len;
+
+  while ( p < end ) {
+
+    eol = memchr( p, '\n', end - p );
+
+    if ( eol == NULL ) {
+      n = end - p;
+      if ( csv->line_len + n >= LINE_LEN ) 
+	n = LINE_LEN - 1 - csv->line_len;
+      memcpy( csv->line + csv->line_len, p, n );
+      csv->line_len += n;
+      return;
+    }
+
+    if ( csv->line_len ) {
+      n = eol - p;
+      if ( csv->line_len + n >= LINE_LEN ) 
+	n = LINE_LEN - 1 - csv->line_len;
+      memcpy( csv->line + csv->line_len, p, n );
+      csv->line_len += n;
+      csv_parse_line( csv, csv->line, csv->line + csv->line_len );
+      csv->line_len = 0;
+    } else {
+      csv_parse_line( csv, p, eol );
+    }
+
+    p = eol + 1;
+  }
+}
+
+
+
+void csv_finish( csv_s* csv ) {
+
+  /* last line without trailing newline */
+
+  if ( csv->line_len ) {
+    csv_parse_line( csv, csv->line, csv->line + csv->line_len );
+    csv->line_len = 0;
+  }
+}
+
+
+
+int csv_parse_line( csv_s* csv, char* p, char* end ) {
+
+  static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 
+				  1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 
+				  1e15, 1e16, 1e17, 1e18 };
+  char* start;
+  char tmp[64];
+  int neg;
+  int t;
+  long long mant;
+  int digits;
+  int frac;
+  double val;
+
+  /* 
+   * Parse "<time>,<value>". Plain integers and decimals are converted 
+   * here, anything fancier (exponents, nan, very long mantissas) is handed 
+   * over to strtod. Lines that do not start with a number are skipped.
+   */
+
+  while ( ( p < end ) && ( ( *p == ' ' ) | ( *p == '\t' ) ) ) 
+    p++;
+
+  neg = 0;
+  if ( ( p < end ) && ( *p == '-' ) ) {
+    neg = 1;
+    p++;
+  }
+
+  start = p;
+  t = 0;
+  while ( ( p < end ) && ( *p >= '0' ) && ( *p <= '9' ) ) {
+    if ( t > ( 0x7fffffff - 9 ) / 10 ) 
+      return -1;      /* no time of ours has this many digits */
+    t = t * 10 + ( *p - '0' );
+    p++;
+  }
+  if ( p == start ) 
+    return -1;
+  if ( neg ) 
+    t = -t;
+
+  /* apply time limit */
+
+  if ( t > csv->t_max ) 
+    return 0;
+
+  while ( ( p < end ) && ( ( *p == ' ' ) | ( *p == '\t' ) ) ) 
+    p++;
+  if ( ( p == end ) || ( *p != ',' ) ) 
+    return -1;
+  p++;
+  while ( ( p < end ) && ( ( *p == ' ' ) | ( *p == '\t' ) ) ) 
+    p++;
+
+  neg = 0;
+  if ( ( p < end ) && ( ( *p == '-' ) | ( *p == '+' ) ) ) {
+    neg = ( *p == '-' );
+    p++;
+  }
+
+  start  = p;
+  mant   = 0;
+  digits = 0;
+  frac   = 0;
+  while ( ( p < end ) && ( *p >= '0' ) && ( *p <= '9' ) ) {
+    if ( digits < 18 ) 
+      mant = mant * 10 + ( *p - '0' );
+    digits++;
+    p++;
+  }
+
+  if ( csv->data_type ) {
+
+    /* 
+     * integer data: anything after the digits is ignored, like %d does.
+     * Values beyond the range of an int saturate, as strtol does for long.
+     */
+
+    if ( digits == 0 ) 
+      return -1;
+    if ( ( digits > 18 ) || ( mant > 0x7fffffffLL + neg ) ) 
+      mant = 0x7fffffffLL + neg;
+    val = 0.0;
+
+  } else {
+
+    if ( ( p < end ) && ( *p == '.' ) ) {
+      p++;
+      while ( ( p < end ) && ( *p >= '0' ) && ( *p <= '9' ) ) {
+	if ( digits < 18 ) 
+	  mant = mant * 10 + ( *p - '0' );
+	digits++;
+	frac++;
+	p++;
+      }
+    }
+
+    if ( ( digits == 0 ) | ( digits > 18 ) | 
+	 ( ( p < end ) && ( *p != '\r' ) && ( *p != ' ' ) && ( *p != '\t' ) ) ) {
+      
+      /* not a plain decimal (exponent, nan, long mantissa): use libc */
+
+      if ( end - start >= sizeof( tmp ) ) 
+	return -1;
+      memcpy( tmp, start, end - start );
+      tmp[end - start] = '\0';
+      val = strtod( tmp, &p );
+      if ( p == tmp ) 
+	return -1;
+    } else {
+      /* exact for mantissas below 2^53, as 10^frac is exact up to 10^22 */
+      val = (double)mant / pow10[frac];
+    }
+    
+    if ( neg ) 
+      val = -val;
+  }
+
+  /* store, growing the vectors when the file has more rows than slots */
+
+  if ( csv->n == csv->size ) {
+    csv->size *= 2;
+    csv->time = scratch_get( SCRATCH_TIME, csv->size * sizeof( int ) );
+    if ( csv->data_type ) {
+      csv->int_val = scratch_get( SCRATCH_VAL, csv->size * sizeof( int ) );
+    } else {
+      csv->dble_val = scratch_get( SCRATCH_VAL, csv->size * sizeof( double ) );
+    }
+  }
+
+  csv->time[csv->n] = t;
+  if ( csv->data_type ) {
+    csv->int_val[csv->n] = (int)( neg ? -mant : mant );
+  } else {
+    csv->dble_val[csv->n] = val;
+  }
+  csv->n++;
+
+  return 1;
+}
+
+
+
+void* scratch_get( int slot, size_t size ) {
+
+  /* 
+   * scratch vector of at least size bytes, contents preserved when it has 
+   * to grow. Valid until the next call for the same slot in this thread.
+   */
+
+  if ( size > scratch.size[slot] ) {
+    if ( size < 2 * scratch.size[slot] ) 
+      size = 2 * scratch.size[slot];
+    scratch.buf[slot]  = realloc( scratch.buf[slot], size );
+    scratch.size[slot] = size;
+  }
+  return scratch.buf[slot];
+}
+
+
+
+void scratch_release( void ) {
+  int i;
+
+  for ( i = 0; i < N_SCRATCH; i++ ) {
+    free( scratch.buf[i] );
+    scratch.buf[i]  = NULL;
+    scratch.size[i] = 0;
+  }
+}
+
+
+
+int ring_init( ring_s* ring, dat_sub_s* sub ) {
+
+  /* -1 for a ring buffer without a usable geometry */
+
+  memset( ring, 0, sizeof( ring_s ) );
+
+  ring->n_samples = sub->n_samples;
+  ring->interval  = sub->timestamp_1 - sub->timestamp_0;
+  ring->newest    = sub->file_offset;
+  ring->t_newest  = sub->timestamp_1;
+
+  if ( ( ring->interval <= 0 ) | ( ring->n_samples <= 0 ) |
+       ( ring->newest < 0 ) | ( ring->newest >= ring->n_samples ) ) {
+    ring->n_samples = 0;
+    return -1;
+  }
+
+  ring->oldest   = ( ring->newest + 1 ) % ring->n_samples;
+  ring->t_oldest = ring->t_newest - ( ring->n_samples - 1 ) * ring->interval;
+
+  return 0;
+}
+
+
+
+int ring_slot_time( ring_s* ring, int slot ) {
+
+  /* time of the sample in a slot */
+
+  return ring->t_newest - 
+    ( ( ring->newest - slot + ring->n_samples ) % ring->n_samples ) * 
+    ring->interval;
+}
+
+
+
+int ring_time_slot( ring_s* ring, int t ) {
+
+  int delta;
+  int slot;
+
+  /* 
+   * Map a timestamp onto its ring buffer slot. Returns -1 when t is 
+   * outside the window covered by the ring buffer or not aligned to the
+   * interval.
+   */
+
+  if ( ring->n_samples <= 0 ) 
+    return -1;
+
+  delta = ring->t_newest - t;
+
+  if ( ( delta < 0 ) | ( delta % ring->interval != 0 ) )
+    return -1;
+
+  delta /= ring->interval;
+
+  if ( delta >= ring->n_samples )
+    return -1;
+
+  slot = ring->newest - delta;
+  if ( slot < 0 )
+    slot += ring->n_samples;
+
+  return slot;
+}
+
+
+
+/* 
+ * Chronological walk over the ring buffer: position i = 0 is the oldest 
+ * sample, i = n_samples - 1 the newest.
+ */
+
+int ring_slot_at( ring_s* ring, int i ) {
+
+  int slot;
+
+  slot = ring->oldest + i;
+  if ( slot >= ring->n_samples ) 
+    slot -= ring->n_samples;
+
+  return slot;
+}
+
+
+
+int ring_time_at( ring_s* ring, int i ) {
+  return ring->t_oldest + i * ring->interval;
+}
+
+
+
+int ring_window( ring_s* ring, int t_from, int t_to, int* first ) {
+
+  long long lo = 0;
+  long long hi = 0;
+
+  /* 
+   * Positions of the samples in [t_from, t_to): [*first, *first + n), 
+   * straight from the geometry. Returns n, 0 when the ring buffer has no 
+   * samples in that window.
+   */
+
+  *first = 0;
+  if ( ring->n_samples <= 0 ) 
+    return 0;
+
+  if ( t_from > ring->t_oldest ) 
+    lo = ( (long long)t_from - ring->t_oldest + ring->interval - 1 ) / 
+      ring->interval;
+  if ( t_to > ring->t_oldest ) 
+    hi = ( (long long)t_to - ring->t_oldest + ring->interval - 1 ) / 
+      ring->interval;
+  if ( hi > ring->n_samples ) 
+    hi = ring->n_samples;
+
+  if ( lo >= hi ) 
+    return 0;
+
+  *first = (int)lo;
+  return (int)( hi - lo );
+}
+
+
+
+int ring_mark_valid( ring_s* ring, rra_s* rra, unsigned char* bitmap ) {
+
+  /* 
+   * Filled slot bitmap in chronological order, bit i for position i. 
+   * Returns the number of filled slots.
+   */
+
+  return ring_mark_range( ring, rra, bitmap, 0, ring->n_samples );
+}
+
+
+
+int ring_mark_range( ring_s* ring, rra_s* rra, unsigned char* bitmap, 
+		     int first, int n ) {
+
+  int slot;
+  int n_first;
+
+  /* 
+   * Same, for positions [first, first + n) only, bit i for position 
+   * first + i. The slots up to the end of the file come first, then the 
+   * ones from the start of the file, when the range wraps.
+   */
+
+  if ( ( ring->n_samples <= 0 ) || ( n <= 0 ) ) 
+    return 0;
+
+  slot    = ring_slot_at( ring, first );
+  n_first = ring->n_samples - slot;
+  if ( n_first >= n ) 
+    return rra_mark_valid( rra, slot, n, bitmap, 0 );
+
+  return rra_mark_valid( rra, slot, n_first, bitmap, 0 ) +
+    rra_mark_valid( rra, 0, n - n_first, bitmap, n_first );
+}
+
+
+
+int sort_data_for_rra( dat_s* data, int subset, csv_s* csv, rra_s* rra ) {
+
+  int index;
+  int i;
+  int t_min, t_max;
+  int cnt;
+  int cons;
+  int min_samples;
+  int lo;
+  int hi;
+  ring_s ring;
+  bin_s bin;
+
+  /* 
+   * Sort csv data according to time vector, in one pass over the csv 
+   * times: the destination slot of each sample follows directly from the 
+   * ring buffer geometry, no searching. Samples finer than the rra 
+   * interval, or not aligned to it, are consolidated into the slot that
+   * covers them. A bin is complete when the next sample is for another
+   * slot, so the samples of a slot have to be consecutive. That holds for
+   * ascending csv files, and for those written in ring buffer order by 
+   * older versions with option -r, which have one sample per slot.
+   * Slots without csv data keep their rra contents, and so do slots of
+   * samples not newer than csv->t_min. Returns the number of slots 
+   * overwritten, the latest sample that went in is left in csv->t_last and 
+   * the number of slots that were still empty in csv->n_filled. The
+   * positions from the first to the last slot written go to 
+   * rra->dirty_slot and rra->dirty_n.
+   */
+
+  if ( ring_init( &ring, data->subset[subset] ) ) 
+    return 0;
+
+  cons        = consolidator_type( data->subset[subset]->consolidator );
+  min_samples = data->subset[subset]->minSamplesPerBin;
+
+  t_max = ring.t_newest;
+  t_min = ring.t_oldest - ring.interval + 1;
+  csv->n_filled = 0;
+  if ( ( csv->t_min != T_NONE ) && ( csv->t_min >= t_min ) ) 
+    t_min = csv->t_min + 1;
+  cnt = 0;
+  bin.slot = -1;
+  lo = ring.n_samples;
+  hi = -1;
+  
+  for ( i = 0; i < csv->n; i++ ) {
+
+    if ( ( csv->time[i] > t_max ) | ( csv->time[i] < t_min ) ) 
+      continue;
+
+    if ( ( index = ring_bin_slot( &ring, csv->time[i] ) ) < 0 ) 
+      continue;
+
+    if ( index != bin.slot ) {
+      if ( bin_store( &bin, min_samples, csv, rra ) ) {
+	span_add( &ring, bin.slot, &lo, &hi );
+	cnt++;
+      }
+      bin.slot    = index;
+      bin.n       = 0;
+      bin.aligned = 0;
+    }
+    bin.aligned |= ( ( ring.t_newest - csv->time[i] ) % ring.interval == 0 );
+    bin_add( &bin, cons, csv->time[i], 
+	     rra->data_type ? csv->int_val[i] : csv->dble_val[i] );
+  }
+  if ( bin_store( &bin, min_samples, csv, rra ) ) {
+    span_add( &ring, bin.slot, &lo, &hi );
+    cnt++;
+  }
+
+  if ( cnt ) {
+    rra->dirty_slot = ring_slot_at( &ring, lo );
+    rra->dirty_n    = hi - lo + 1;
+  }
+  return cnt;
+}
+
+
+
+int ring_bin_slot( ring_s* ring, int t ) {
+
+  int delta;
+  int slot;
+
+  /* 
+   * slot of the bin ( T - interval, T ] that t falls in, -1 when that is 
+   * outside the ring buffer window. Same as ring_time_slot for aligned t.
+   */
+
+  if ( ring->n_samples <= 0 ) 
+    return -1;
+
+  if ( ( delta = ring->t_newest - t ) < 0 ) 
+    return -1;
+
+  delta /= ring->interval;
+  if ( delta >= ring->n_samples ) 
+    return -1;
+
+  slot = ring->newest - delta;
+  if ( slot < 0 ) 
+    slot += ring->n_samples;
+
+  return slot;
+}
+
+
+
+int consolidator_type( char* consolidator ) {
+
+  /* 
+   * unknown consolidators keep the latest sample, which is what merging 
+   * did before consolidation, for data at the rra interval
+   */
+
+  if ( consolidator == NULL ) 
+    return CONS_LAST;
+  if ( !strcmp( consolidator, "average" ) ) 
+    return CONS_AVERAGE;
+  if ( !strcmp( consolidator, "min" ) ) 
+    return CONS_MIN;
+  if ( !strcmp( consolidator, "max" ) ) 
+    return CONS_MAX;
+  if ( !strcmp( consolidator, "sum" ) ) 
+    return CONS_SUM;
+  if ( !strcmp( consolidator, "first" ) ) 
+    return CONS_FIRST;
+  return CONS_LAST;
+}
+
+
+
+void bin_add( bin_s* bin, int cons, int t, double value ) {
+
+  /* add a sample to the bin, averages are divided out by bin_store */
+
+  if ( bin->n++ == 0 ) {
+    bin->cons   = cons;
+    bin->value  = value;
+    bin->t_last = t;
+    return;
+  }
+
+  switch ( cons ) {
+  case CONS_AVERAGE: 
+  case CONS_SUM:   bin->value += value; break;
+  case CONS_MIN:   if ( value < bin->value ) bin->value = value; break;
+  case CONS_MAX:   if ( value > bin->value ) bin->value = value; break;
+  case CONS_FIRST: break;
+  default:         bin->value = value; break;
+  }
+  if ( t > bin->t_last ) 
+    bin->t_last = t;
+}
+
+
+
+int bin_store( bin_s* bin, int min_samples, csv_s* csv, rra_s* rra ) {
+
+  double value;
+
+  /* 
+   * Write a complete bin into its slot, returns 1 when it did. A single 
+   * sample at the slot time is taken as it is, it has been consolidated 
+   * already. Otherwise the bin needs minSamplesPerBin samples.
+   */
+
+  if ( ( bin->slot < 0 ) || ( bin->n == 0 ) ) 
+    return 0;
+  if ( ( bin->n < min_samples ) && !( ( bin->n == 1 ) && bin->aligned ) ) 
+    return 0;
+
+  value = bin->value;
+  if ( bin->cons == CONS_AVERAGE ) 
+    value /= bin->n;
+
+  if ( rra->data_type ) {
+    csv->n_filled += ( rra->int_val[bin->slot] == 0x7fffffff );
+    rra->int_val[bin->slot] = (int)lround( value );
+  } else {
+    csv->n_filled += isnan( rra->dble_val[bin->slot] ) != 0;
+    rra->dble_val[bin->slot] = value;
+  }
+  if ( bin->t_last > csv->t_last ) 
+    csv->t_last = bin->t_last;
+
+  return 1;
+}
+
+
+
+void span_add( ring_s* ring, int slot, int* lo, int* hi ) {
+
+  int i;
+
+  /* widen [*lo, *hi] to the chronological position of slot */
+
+  i = slot - ring->oldest;
+  if ( i < 0 ) 
+    i += ring->n_samples;
+  if ( i < *lo ) 
+    *lo = i;
+  if ( i > *hi ) 
+    *hi = i;
+}
+
+
+
+int finest_subset( dat_s* data ) {
+
+  int i;
+  int best = 0;
+  ring_s ring;
+  int interval = 0;
+
+  /* subset with the shortest interval, its csv can stand in for the others */
+
+  for ( i = 0; i < data->n_sets; i++ ) {
+    if ( ring_init( &ring, data->subset[i] ) == 0 ) {
+      if ( ( interval == 0 ) || ( ring.interval < interval ) ) {
+	interval = ring.interval;
+	best     = i;
+      }
+    }
+  }
+  return best;
+}
+
+
+
+void download_opts( CURL* curl ) {
+
+  curl_easy_setopt( curl, CURLOPT_FAILONERROR, 1 );
+
+  /* 
+   * No limit on the total transfer time, large exports over Wi-Fi take
+   * a while. Give up on a stalled transfer instead.
+   */
+
+  curl_easy_setopt( curl, CURLOPT_CONNECTTIMEOUT, DL_CONNECT_TIMEOUT );
+  curl_easy_setopt( curl, CURLOPT_LOW_SPEED_LIMIT, DL_LOW_SPEED_LIMIT );
+  curl_easy_setopt( curl, CURLOPT_LOW_SPEED_TIME, DL_LOW_SPEED_TIME );
+
+  /*
+   * Keep-alive probes notice a connection that Wi-Fi dropped during a
+   * pause between requests. "" offers every encoding this libcurl can
+   * inflate, which it does before write_data sees the body.
+   */
+
+  curl_easy_setopt( curl, CURLOPT_TCP_KEEPALIVE, 1L );
+  curl_easy_setopt( curl, CURLOPT_TCP_KEEPIDLE, (long)DL_KEEPALIVE_IDLE );
+  curl_easy_setopt( curl, CURLOPT_TCP_KEEPINTVL, (long)DL_KEEPALIVE_INTVL );
+  curl_easy_setopt( curl, CURLOPT_ACCEPT_ENCODING, "" );
+}
+
+
+
+CURL* download_handle( download_s* dl ) {
+  CURL* curl;
+
+  /* copied from curl examples */
+
+  if ( ( curl = curl_easy_init() ) == NULL ) 
+    return NULL;
+
+  curl_easy_setopt( curl, CURLOPT_URL, dl->url );
+  curl_easy_setopt( curl, CURLOPT_PRIVATE, dl );
+  curl_easy_setopt( curl, CURLOPT_WRITEFUNCTION, write_data );
+  curl_easy_setopt( curl, CURLOPT_WRITEDATA, dl );
+  download_opts( curl );
+  curl_easy_setopt( curl, CURLOPT_XFERINFOFUNCTION, progress );
+  curl_easy_setopt( curl, CURLOPT_XFERINFODATA, dl );
+  curl_easy_setopt( curl, CURLOPT_NOPROGRESS, 0L );
+
+  return curl;
+}
+
+
+
+int download_export_zips( download_s* dls, int n_dls ) {
+  CURLM* multi;
+  CURLMsg* msg;
+  download_s* dl;
+  int running;
+  int n_msgs;
+  int n_ok = 0;
+  int i;
+
+  /* 
+   * All transfers share one multi handle and run concurrently, so a batch
+   * of toons takes about as long as the slowest one. There is no separate
+   * connection test, a toon that can't be reached fails its own transfer.
+   */
+
+  if ( ( multi = curl_multi_init() ) == NULL ) 
+    return 0;
+
+  fprintf( stderr, "Downloading %d export file(s) ...", n_dls );
+
+  for ( i = 0; i < n_dls; i++ ) {
+    dls[i].res = CURLE_FAILED_INIT;
+    if ( ( dls[i].curl = download_handle( &dls[i] ) ) != NULL ) 
+      curl_multi_add_handle( multi, dls[i].curl );
+  }
+
+  do {
+    if ( curl_multi_perform( multi, &running ) != CURLM_OK ) 
+      break;
+    if ( running ) 
+      curl_multi_wait( multi, NULL, 0, DL_POLL_TIMEOUT, NULL );
+  } while ( running );
+
+  while ( ( msg = curl_multi_info_read( multi, &n_msgs ) ) != NULL ) {
+    if ( msg->msg == CURLMSG_DONE ) {
+      curl_easy_getinfo( msg->easy_handle, CURLINFO_PRIVATE, (char**)&dl );
+      dl->res = msg->data.result;
+    }
+  }
+  fprintf( stderr, " done\n" );
+
+  for ( i = 0; i < n_dls; i++ ) {
+    dl = &dls[i];
+    if ( dl->curl ) {
+      curl_multi_remove_handle( multi, dl->curl );
+      curl_easy_cleanup( dl->curl );
+      dl->curl = NULL;
+    }
+    if ( dl->spool ) {
+      fclose( dl->spool );
+      dl->spool = NULL;
+    }
+
+    switch ( dl->res ) {
+    case CURLE_OK:
+      fprintf( stderr, "%s: %ld bytes\n", dl->host, (long)dl->len );
+      n_ok++;
+      break;
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+      fprintf( stderr, "%s: Cannot connect, invalid IP-address?\n", 
+	       dl->host );
+      break;
+    default:
+      fprintf( stderr, "%s: Download failed: error %d, %s\n", dl->host, 
+	       dl->res, curl_easy_strerror( dl->res ) );
+    }
+  }
+  curl_multi_cleanup( multi );
+
+  return n_ok;
+}
+
+
+
+int open_session( dl_session_s* session, char* host ) {
+
+  memset( session, 0, sizeof( dl_session_s ) );
+  session->host = host;
+
+  if ( ( session->curl = curl_easy_init() ) == NULL ) {
+    fprintf( stderr, "%s: Cannot set up a transfer\n", host );
+    return -1;
+  }
+  download_opts( session->curl );
+
+  /* curl drops the connection on an error status, fetch_file checks it */
+
+  curl_easy_setopt( session->curl, CURLOPT_FAILONERROR, 0L );
+  return 0;
+}
+
+
+
+int fetch_file( dl_session_s* session, char* name, char* dir ) {
+
+  FILE* fp;
+  CURLcode res;
+  long status = 0;
+  long n_connects = 0;
+  curl_off_t bytes = 0;
+
+  char url[2 * MAX_LEN];
+  char path[2 * MAX_LEN];
+  char part[2 * MAX_LEN + sizeof( DL_PART_EXT )];
+
+  /*
+   * Fetch http://<host>/<name> into dir/name. Returns 0 when done, 1 when
+   * the toon doesn't offer that file, -1 on any other error. The body goes
+   * to a .part file first, a failed transfer leaves no truncated copy. 
+   * Only a 200 is a file, redirects are not followed: their body is not.
+   */
+
+  snprintf( url, sizeof( url ), DL_FILE_URL, session->host, name );
+  snprintf( path, sizeof( path ), "%s%s", dir, name );
+  snprintf( part, sizeof( part ), "%s%s", path, DL_PART_EXT );
+
+  if ( ( fp = fopen( part, "wb" ) ) == NULL ) {
+    fprintf( stderr, "fetch_file: Cannot open %s for writing\n", part );
+    return -1;
+  }
+
+  /* curl's own write function fwrite()s the body to fp */
+
+  curl_easy_setopt( session->curl, CURLOPT_URL, url );
+  curl_easy_setopt( session->curl, CURLOPT_WRITEDATA, fp );
+  res = curl_easy_perform( session->curl );
+
+  if ( fclose( fp ) && ( res == CURLE_OK ) )
+    res = CURLE_WRITE_ERROR;
+
+  curl_easy_getinfo( session->curl, CURLINFO_NUM_CONNECTS, &n_connects );
+  curl_easy_getinfo( session->curl, CURLINFO_RESPONSE_CODE, &status );
+  session->n_connects += n_connects;
+
+  if ( ( res != CURLE_OK ) || ( status != 200 ) ) {
+    unlink( part );
+    if ( res != CURLE_OK ) {
+      fprintf( stderr, "%s: Download of %s failed: error %d, %s\n",
+	       session->host, name, res, curl_easy_strerror( res ) );
+      return -1;
+    }
+    if ( status == 404 ) {
+
+      /* nor a copy from an earlier run, that would be converted instead */
+
+      unlink( path );
+      return 1;
+    }
+    fprintf( stderr, "%s: Download of %s failed: HTTP status %ld\n",
+	     session->host, name, status );
+    return -1;
+  }
+
+  if ( rename( part, path ) ) {
+    fprintf( stderr, "fetch_file: Cannot rename %s to %s\n", part, path );
+    unlink( part );
+    return -1;
+  }
+
+  curl_easy_getinfo( session->curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes );
+  session->n_files++;
+  session->n_bytes += (long)bytes;
+
+  return 0;
+}
+
+
+
+void close_session( dl_session_s* session ) {
+
+  if ( session->curl ) {
+    curl_easy_cleanup( session->curl );
+    session->curl = NULL;
+  }
+}
+
+
+
+int pull_rra_files( tl_ctx_s* ctx, char* host, char* dir ) {
+
+  int i;
+  int k;
+  int err = 0;
+  int dat_cnt = 0;
+  dl_session_s session;
+  dev_index_s* devices;
+  dev_entry_s* entry;
+  dat_s* data;
+  arena_s* arena = &ctx->arena;
+
+  char name[2 * MAX_LEN];
+  char path[3 * MAX_LEN];
+
+  /*
+   * Fetch what -r needs from the old toon itself, over one connection:
+   * both config files, then the .dat file of every database listed in
+   * config_hcb_rrd.xml, then the .rra files of the subsets in it.
+   * Returns the number of .dat files, or minus an E_ code.
+   */
+
+  if ( make_directory( dir ) )
+    return -E_CANNOT_CREATE_DIR;
+
+  if ( open_session( &session, host ) )
+    return -E_BAD_DL_URL;
+
+  fprintf( stderr, "Downloading databases from %s\n", host );
+
+  if ( ( err = fetch_file( &session, "config_hcb_rrd.xml", dir ) ) ) {
+    if ( err > 0 )
+      fprintf( stderr, "%s: No config_hcb_rrd.xml found\n", host );
+    close_session( &session );
+    return -E_BAD_DL_URL;
+  }
+
+  /* without it, only the monthly totals are not transferred */
+
+  if ( fetch_file( &session, "config_happ_pwrusage.xml", dir ) < 0 ) {
+    close_session( &session );
+    return -E_BAD_DL_URL;
+  }
+
+  snprintf( path, sizeof( path ), "%sconfig_hcb_rrd.xml", dir );
+  devices = get_device_index( ctx, path );
+
+  for ( k = 0; devices && ( k < devices->n_buckets ); k++ ) {
+    for ( entry = devices->buckets[k]; entry; entry = entry->next ) {
+
+      /* 
+       * uuids and intervals come from the old toon and end up in local 
+       * paths, anything that could leave dir is not fetched
+       */
+
+      if ( !plain_name( entry->uuid ) ) {
+	fprintf( stderr, "%s: Invalid database name %s, skipped\n", host, 
+		 entry->uuid );
+	continue;
+      }
+
+      /* a database in the config may never have been written */
+
+      snprintf( name, sizeof( name ), "%s.dat", entry->uuid );
+      if ( ( err = fetch_file( &session, name, dir ) ) > 0 )
+	continue;
+      if ( err < 0 )
+	break;
+      dat_cnt++;
+
+      snprintf( path, sizeof( path ), "%s%s", dir, name );
+      data = read_dat_file( path, arena );
+      if ( strcmp( data->deviceUuid, "placeholder" ) == 0 )
+	continue;
+
+      /* a subset without .rra file is skipped by rra_to_csv */
+
+      for ( i = 0; ( i < data->n_sets ) && ( err == 0 ); i++ ) {
+	if ( !plain_name( data->subset[i]->interval ) ) {
+	  fprintf( stderr, "%s: Invalid interval %s in %s.dat, skipped\n", 
+		   host, data->subset[i]->interval, entry->uuid );
+	  continue;
+	}
+	snprintf( name, sizeof( name ), "%s-%s.rra", entry->uuid,
+		  data->subset[i]->interval );
+	if ( fetch_file( &session, name, dir ) < 0 )
+	  err = -1;
+      }
+      if ( err < 0 )
+	break;
+    }
+    if ( err < 0 )
+      break;
+  }
+  arena_reset( arena );
+
+  fprintf( stderr, "%s: %d files, %ld bytes over %ld connection(s)\n",
+	   host, session.n_files, session.n_bytes, session.n_connects );
+  close_session( &session );
+
+  if ( err < 0 )
+    return -E_BAD_DL_URL;
+
+  return dat_cnt;
+}
+
+
+
+int plain_name( char* name ) {
+
+  char* p;
+
+  /* 1 for a non-empty name of letters, digits, '_' and '-' only */
+
+  if ( ( name == NULL ) || ( *name == '\0' ) ) 
+    return 0;
+  for ( p = name; *p; p++ ) {
+    if ( !( ( ( *p >= 'a' ) && ( *p <= 'z' ) ) || 
+	    ( ( *p >= 'A' ) && ( *p <= 'Z' ) ) || 
+	    ( ( *p >= '0' ) && ( *p <= '9' ) ) || 
+	    ( *p == '_' ) || ( *p == '-' ) ) ) 
+      return 0;
+  }
+  return 1;
+}
+
+
+
+size_t write_data( void *ptr, size_t size, size_t nmemb, void *user_data ) {
+
+  download_s* dl = user_data;
+  size_t bytes = size * nmemb;
+  char* data;
+
+  /* curl takes anything but size * nmemb as an error and aborts */
+
+  if ( dl->spool ) {
+    dl->len += bytes;
+    return ( fwrite( ptr, 1, bytes, dl->spool ) == bytes ) ? bytes : 0;
+  }
+
+  if ( dl->len + bytes > DL_SPOOL_LIMIT ) {
+
+    /* too large to keep in memory, continue on disk */
+
+    if ( ( dl->spool = fopen( dl->spool_path, "wb" ) ) == NULL ) {
+      fprintf( stderr, "write_data: Cannot open %s for writing\n", 
+	       dl->spool_path );
+      return 0;
+    }
+    if ( fwrite( dl->data, 1, dl->len, dl->spool ) != dl->len ) 
+      return 0;
+    free( dl->data );
+    dl->data = NULL;
+    dl->streaming = 0;
+    dl->len += bytes;
+    return ( fwrite( ptr, 1, bytes, dl->spool ) == bytes ) ? bytes : 0;
+  }
+
+  if ( dl->len + bytes > dl->size ) {
+    size = dl->size ? dl->size : 65536;
+    while ( dl->len + bytes > size ) {
+      size *= 2;
+    }
+    if ( ( data = realloc( dl->data, size ) ) == NULL ) 
+      return 0;
+    dl->data = data;
+    dl->size = size;
+  }
+  memcpy( dl->data + dl->len, ptr, bytes );
+  dl->len += bytes;
+
+  /* unpack the entries that are complete by now */
+
+  stream_zip_entries( dl );
+
+  return bytes;
+}
+
+
+
+int progress( void *user_data, curl_off_t dl_total, curl_off_t dl_now, 
+	      curl_off_t ul_total, curl_off_t ul_now ) {
+
+  download_s* dl = user_data;
+
+  /* a dot per MB received */
+
+  while ( dl_now - dl->reported >= 1024 * 1024 ) {
+    fprintf( stderr, "." );
+    dl->reported += 1024 * 1024;
+  }
+  return 0;
+}
+
+
+
+void stream_zip_entries( download_s* dl ) {
+
+  JZLocalFileHeader local;
+  JZFile* zip;
+  size_t entry_len;
+
+  /* 
+   * Walk the local file headers in the part of the body received so far 
+   * and unpack every entry whose data is complete. This stops, and leaves
+   * the work to the central directory after the download, for entries 
+   * whose sizes are only given after their data (flag bit 3).
+   */
+
+  while ( dl->streaming ) {
+
+    if ( dl->len - dl->parsed < sizeof( JZLocalFileHeader ) ) 
+      return;
+
+    memcpy( &local, dl->data + dl->parsed, sizeof( JZLocalFileHeader ) );
+
+    if ( local.signature == 0x02014B50 ) {
+
+      /* start of central directory, all entries done */
+
+      dl->complete  = 1;
+      dl->streaming = 0;
+      return;
+    }
+
+    if ( ( local.signature != 0x04034B50 ) | 
+	 ( local.generalPurposeBitFlag & 0x0008 ) ) {
+      dl->streaming = 0;
+      return;
+    }
+
+    entry_len = sizeof( JZLocalFileHeader ) + local.fileNameLength + 
+      local.extraFieldLength + local.compressedSize;
+
+    if ( dl->len - dl->parsed < entry_len ) 
+      return;
+
+    zip = jzfile_from_memory( dl->data + dl->parsed, entry_len );
+    if ( dl->exports ) {
+      load_entry( zip, NULL, dl->exports );
+    } else {
+      process_file( zip, NULL, dl->dl_path, dl->gz );
+    }
+    zip->close( zip );
+
+    dl->parsed += entry_len;
+  }
+}
+
+
+
+int unzip( char* file, char* path, int gz ) {
+  
+  FILE* fp;
+  JZFile* zip;
+  int retval;
+
+  char* local_path;
+  local_path = calloc( MAX_LEN, sizeof( char ) );
+
+  strcpy( local_path, path );  
+  strcat( local_path, file );  
+
+  if ( ( fp = fopen( local_path, "r" ) ) > 0 ) {
+    zip = jzfile_from_stdio_file( fp );
+    retval = unzip_jzfile( zip, path, gz );
+    zip->close( zip );
+  } else {
+    fprintf( stderr, "unzip: Cannot open %s for reading\n", local_path );
+    retval = -3;
+  }
+  free( local_path );
+  return retval;
+}
+
+
+
+int unzip_jzfile( JZFile* zip, char* path, int gz ) {
+
+  JZEndRecord endRecord;
+  unzip_dest_s dest;
+
+  /* extract all entries of an opened zip file to path */
+
+  dest.path = path;
+  dest.gz   = gz;
+
+  if ( jzReadEndRecord( zip, &endRecord ) ) {
+    printf("unzip: Couldn't read ZIP file end record.");
+    return -1;
+  }
+  
+  if ( jzReadCentralDirectory( zip, &endRecord, record_callback, &dest ) ) {
+    printf("unzip: Couldn't read ZIP file central record.");
+    return -2;
+  } 
+  return 0;
+}
+
+
+int record_callback( JZFile *zip, int idx, JZFileHeader *header, 
+		    char *filename, void *user_data ) {
+  long offset;
+  unzip_dest_s *dest = user_data;
+  
+  offset = zip->tell( zip ); /* store current position */
+  
+  if ( zip->seek( zip, header->offset, SEEK_SET ) ) {
+    printf( "record_callback: Cannot seek in zip file!" );
+    return 0; /* abort */
+  }
+  
+  process_file( zip, header, dest->path, dest->gz ); /* alters file offset */
+  
+  zip->seek( zip, offset, SEEK_SET ); /* return to position */
+  
+  return 1; /* continue */
+}
+
+
+int process_file( JZFile *zip, JZFileHeader *central, char* dl_path, 
+		  int gz ) {
+  JZFileHeader header;
+  char filename[1024];
+  char path[1024];
+  char other[1024];
+  FILE *out;
+  gzFile gz_out;
+  int ret;
+  
+  if ( jzReadLocalFileHeader( zip, &header, filename, sizeof( filename ) ) ) {
+    printf( "process_file: Cannot read local file header of %s\n", filename );
+    return -1;
+  }
+  use_sizes( &header, central );
+
+  /* 
+   * csv files go in gzipped with gz. A copy of the other kind, from an 
+   * earlier run, would be merged instead or as well, so it goes.
+   */
+
+  gz = gz && is_csv_name( filename );
+  snprintf( path, sizeof( path ), "%s%s%s", dl_path, filename, 
+	    gz ? GZ_EXT : "" );
+  if ( is_csv_name( filename ) ) {
+    snprintf( other, sizeof( other ), "%s%s%s", dl_path, filename, 
+	      gz ? "" : GZ_EXT );
+    unlink( other );
+  }
+
+  /* 
+   * inflate in fixed size chunks straight to disk, memory use doesn't 
+   * depend on the size of the zip entry 
+   */
+
+  if ( gz ) {
+    if ( ( gz_out = gzopen( path, GZ_WRITE_MODE ) ) == NULL ) {
+      fprintf( stderr, "process_file: Cannot open %s for writing\n", path );
+      return -1;
+    }
+    ret = jzReadDataStream( zip, &header, write_gz_chunk, gz_out );
+    if ( gzclose( gz_out ) != Z_OK ) 
+      ret = Z_ERRNO;
+  } else {
+    if ( ( out = fopen( path, "w" ) ) == NULL ) {
+      fprintf( stderr, "process_file: Cannot open %s for writing\n", path );
+      return -1;
+    }
+    ret = jzReadDataStream( zip, &header, write_chunk, out );
+    fclose( out );
+  }
+
+  if ( ret != Z_OK ) {
+    printf( "Couldn't read file data\n" );
+    return -1;
+  }
+  
+  return 0;
+}
+
+
+  
+void use_sizes( JZFileHeader *local, JZFileHeader *central ) {
+
+  /* 
+   * Entries written in streaming mode (flag bit 3) have zero sizes in their
+   * local header, the real sizes are in the central directory.
+   */
+
+  if ( central && ( local->compressedSize == 0 ) ) {
+    local->crc32            = central->crc32;
+    local->compressedSize   = central->compressedSize;
+    local->uncompressedSize = central->uncompressedSize;
+  }
+}
+
+
+  
+int write_chunk( void *data, size_t bytes, void *user_data ) {
+
+  /* best effort is enough here */
+
+  fwrite( data, 1, bytes, (FILE*)user_data ); 
+  return 1;
+}
+
+
+
+int write_gz_chunk( void *data, size_t bytes, void *user_data ) {
+  return gzwrite( (gzFile)user_data, data, (unsigned)bytes ) == (int)bytes;
+}
+
+
+
+int is_csv_name( char* name ) {
+
+  size_t len = strlen( name );
+
+  return ( len > 4 ) && !strcmp( name + len - 4, ".csv" );
+}
+
+
+int make_directory( char *dir ) {
+
+  char path[2 * MAX_LEN];
+  char* p;
+  char c;
+
+  /* 
+   * mkdir -p, mode 0755. Each component is created by itself, dir is 
+   * never handed to a shell. 0 on success.
+   */
+
+  if ( *dir == '\0' ) 
+    return -1;
+  if ( snprintf( path, sizeof( path ), "%s", dir ) >= sizeof( path ) ) {
+    fprintf( stderr, "make_directory: Path too long: %s\n", dir );
+    return -1;
+  }
+
+  for ( p = path + 1; ; p++ ) {
+    if ( ( *p != '/' ) && ( *p != '\0' ) ) 
+      continue;
+    c  = *p;
+    *p = '\0';
+    if ( mkdir( path, 0755 ) && ( errno != EEXIST ) ) {
+      fprintf( stderr, "make_directory: Cannot create %s: %s\n", path, 
+	       strerror( errno ) );
+      return -1;
+    }
+    if ( ( *p = c ) == '\0' ) 
+      break;
+  }
+  return 0;
+}
+
+
+int rra_to_csv( tl_ctx_s* ctx, char* rra_location, int binary ) {
+
+  int i;
+  int k;
+  int dat_cnt = 0;
+  int n_jobs = 0;
+
+  char* csv_path;
+  char* rra_path;
+  char* dat_path;
+  char* uuid;
+  char* cfg_path;
+  manifest_s* man;
+  dev_index_s* devices;
+  struct dat_s *data;
+  job_s** jobs = NULL;
+  job_s* job;
+  arena_s* arena = &ctx->arena;
+  ring_s ring;
+  int first;
+  double t0;
+
+  /* 
+   * read old rra data and transform to csv data. Returns the number of 
+   * .dat files, or minus an E_ code.
+   */
+
+  if ( ( man = read_manifest( rra_location, arena ) ) == NULL ) {
+    /* could not open directory */
+    perror ("rra_to_csv: opendir: Can't open directory");
+    return -E_CANNOT_OPEN_DIR;
+  }
+
+  if ( ( dat_cnt = man->n_dats ) == 0 ) {
+    fprintf( stderr, "Cannot find any .dat files in %s, exiting\n", 
+	     rra_location );
+    arena_reset( arena );
+    return -E_NO_DAT_FILES_FOUND;
+  }
+
+  cfg_path = calloc( MAX_LEN, sizeof( char ) );
+  strcpy( cfg_path, rra_location );
+  strcat( cfg_path, "config_hcb_rrd.xml" );
+  devices = get_device_index( ctx, cfg_path );
+
+  dat_path = calloc( 2 * MAX_LEN, sizeof( char ) ); 
+
+  for ( k = 0; k < dat_cnt; k++ ) {
+
+    job = queue_job( &jobs, &n_jobs, JOB_PRINT, arena );
+    start_output( job );
+
+    fprintf( out_stream(), "\nfound .dat file : %s\n", man->dats[k].name );
+
+    /* open it and read */
+
+    sprintf( dat_path, "%s%s", rra_location, man->dats[k].name );
+    t0 = stats_start();
+    data = read_dat_file( dat_path, arena );
+    stats_phase( PH_READ_DAT, t0 );
+    job->data = data;
+
+    if ( strcmp( data->deviceUuid, "placeholder" ) != 0 ) {
+	    
+      uuid = man->dats[k].uuid;
+      fprintf( out_stream(), "uuid            : %s\n", uuid );
+      if ( ( data->rrd_device_name = get_device_name( devices, uuid ) ) ) {
+	data->rrd_device_name = arena_strdup( arena, data->rrd_device_name );
+      }
+	    
+      print_data( data );
+	    
+      /* construct filename for old data set */
+	    
+      for ( i = 0; i < data->n_sets; i++ ) {
+	if ( data->rrd_device_name != NULL ) {
+	  csv_path = get_csv_path( rra_location, data, i, binary, arena );
+	  rra_path = get_rra_path( data, uuid, rra_location, i, arena );
+
+	  if ( manifest_find( man, rra_path ) == NULL ) {
+	    fprintf( out_stream(), "subset %d (%s) has no .rra file, skipped\n",
+		     i, data->subset[i]->interval );
+	    continue;
+	  }
+
+	  /* 
+	   * subsets without samples in the --from/--to window are not 
+	   * exported at all. A file left by an earlier conversion would be
+	   * merged instead, so it goes.
+	   */
+
+	  ring_init( &ring, data->subset[i] );
+	  if ( ring_window( &ring, ctx->t_from, ctx->t_to, &first ) == 0 ) {
+	    fprintf( out_stream(), "subset %d (%s) outside the requested dates, skipped\n",
+		     i, data->subset[i]->interval );
+	    unlink( csv_path );
+	    continue;
+	  }
+		
+	  job = queue_job( &jobs, &n_jobs, JOB_EXPORT, arena );
+	  job->data     = data;
+	  job->subset   = i;
+	  job->csv_path = csv_path;
+	  job->rra_path = rra_path;
+	  job->t_from   = ctx->t_from;
+	  job->t_to     = ctx->t_to;
+	}
+      }
+
+    } else {
+      fprintf( out_stream(), "Corresponding database(s) not yet initialised, continuing ...\n"); 
+    }
+
+    end_output();
+  }
+
+  /* convert all subsets */
+
+  run_jobs( jobs, n_jobs, ctx->n_threads );
+  stats_collect( jobs, n_jobs );
+  free_jobs( jobs, n_jobs );
+  arena_reset( arena );
+   
+  free( dat_path );
+  free( cfg_path );
+
+  return dat_cnt;
+}
+
+
+int download_exports_and_unzip( char* hosts, char* dl_root, 
+				download_s **dls_out, int *n_dls_out, 
+				int mem_flag, int gz ) {
+
+  int i;
+  int n_dls = 0;
+  int n_ok;
+  char* list;
+  char* host;
+  download_s* dls;
+  download_s* dl;
+  double t0;
+
+  list = strdup( hosts );
+  dls = calloc( strlen( hosts ) / 2 + 1, sizeof( download_s ) );
+
+  for ( host = strtok( list, "," ); host; host = strtok( NULL, "," ) ) {
+    dls[n_dls++].host = strdup( host );
+  }
+  free( list );
+
+  *dls_out   = dls;
+  *n_dls_out = n_dls;
+
+  for ( i = 0; i < n_dls; i++ ) {
+    dl = &dls[i];
+
+    dl->url = calloc( MAX_LEN, sizeof( char ) );
+    snprintf( dl->url, MAX_LEN, "http://%s/export.zip", dl->host );
+
+    /* a staging directory of its own for each toon, when there are more */
+
+    dl->dl_path = calloc( MAX_LEN, sizeof( char ) );
+    if ( n_dls == 1 ) {
+      snprintf( dl->dl_path, MAX_LEN, "%s", dl_root );
+    } else {
+      snprintf( dl->dl_path, MAX_LEN, "%s%s/", dl_root, dl->host );
+    }
+    dl->spool_path = calloc( MAX_LEN, sizeof( char ) );
+    snprintf( dl->spool_path, MAX_LEN, "%sexport.zip", dl->dl_path );
+
+    /* recursively create directory to downlod into. */
+
+    if ( make_directory( dl->dl_path ) ) 
+      return 0;
+
+    /* entries are unpacked as soon as they have been received */
+
+    dl->streaming = 1;
+    dl->gz        = gz;
+    if ( mem_flag ) {
+      dl->exports = calloc( 1, sizeof( exports_s ) );
+    }
+  }
+
+  t0 = stats_start();
+  n_ok = download_export_zips( dls, n_dls );
+  stats_phase( PH_DOWNLOAD, t0 );
+  if ( n_ok == 0 ) 
+    return 0;
+
+  /* a source that cannot be unpacked is skipped, like a failed download */
+
+  t0 = stats_start();
+  for ( i = 0; i < n_dls; i++ ) {
+    if ( ( dls[i].res == CURLE_OK ) && unpack_download( &dls[i], mem_flag ) ) {
+      dls[i].res = CURLE_BAD_CONTENT_ENCODING;
+      n_ok--;
+    }
+  }
+  stats_phase( PH_UNZIP, t0 );
+
+  return n_ok;
+}
+
+
+
+int unpack_download( download_s* dl, int mem_flag ) {
+
+  int err = 0;
+  char* exp_file   = "export.zip";
+  char* therm_file = "thermostat.zip";
+  char* usage_file = "usage.zip";
+  JZFile* zip;
+
+  char path[1024];
+
+  strcpy( path, dl->dl_path );
+
+  if ( !dl->complete ) {
+
+    /* 
+     * Some entries could not be unpacked on the fly, start over from 
+     * the central directory, from memory, or from disk when spooled.
+     */
+
+    free_exports( dl->exports );
+    dl->exports = NULL;
+
+    if ( dl->data ) {
+      zip = jzfile_from_memory( dl->data, dl->len );
+      if ( mem_flag ) {
+	dl->exports = calloc( 1, sizeof( exports_s ) );
+	err = load_zip_entries( zip, dl->exports );
+      } else {
+	err = unzip_jzfile( zip, dl->dl_path, dl->gz );
+      }
+      zip->close( zip );
+    } else if ( mem_flag ) {
+      dl->exports = load_exports( path, exp_file );
+      err = ( dl->exports == NULL );
+    } else {
+      err = unzip( exp_file, dl->dl_path, dl->gz );
+    }
+
+    if ( err ) {
+      fprintf( stderr, "Error: Unable to unzip %s\n", 
+	       strcat( path, exp_file ) );
+      return E_UNZIP_FAILED;
+    }
+  }
+  free( dl->data );
+  dl->data = NULL;
+
+  /* nested zip files are already unpacked in memory */
+
+  if ( mem_flag ) {
+    fprintf( stderr, "%s: Unpacked %d files, %ld bytes, into memory\n", 
+	     dl->host, dl->exports->n_files, (long)dl->exports->n_bytes );
+    return 0;
+  }
+    
+  /* open zip files and extract all data to the staging directory */
+    
+  fprintf(stderr, "%s: Uncompressing data ... ", dl->host );
+  if ( unzip( therm_file, dl->dl_path, dl->gz ) ) { 
+    fprintf( stderr, "Error: Unable to unzip %s\n", 
+	     strcat( path, therm_file ) );
+    return E_UNZIP_FAILED;
+  } 
+  if ( unzip( usage_file, dl->dl_path, dl->gz ) ) { 
+    fprintf( stderr, "Error: Unable to unzip %s\n", 
+	     strcat( path, usage_file ) );
+    return E_UNZIP_FAILED;
+  } 
+  fprintf(stderr, "done\n");
+
+  return err;
+}
+
+
+
+void free_downloads( download_s* dls, int n_dls ) {
+  int i;
+
+  for ( i = 0; i < n_dls; i++ ) {
+    free( dls[i].host );
+    free( dls[i].url );
+    free( dls[i].dl_path );
+    free( dls[i].spool_path );
+    free( dls[i].data );
+    free_exports( dls[i].exports );
+  }
+  free( dls );
+}
+
+
+
+void csv_out_init( csv_out_s* out, FILE* fp ) {
+  out->fp  = fp;
+  out->buf = scratch_get( SCRATCH_OUT, CSV_CHUNK_LEN );
+  out->len = 0;
+  out->err = 0;
+}
+
+
+
+void csv_out_str( csv_out_s* out, char* str ) {
+
+  size_t len;
+
+  len = strlen( str );
+  if ( out->len + len > CSV_CHUNK_LEN ) 
+    csv_out_flush( out );
+  memcpy( out->buf + out->len, str, len );
+  out->len += len;
+}
+
+
+
+void csv_out_int( csv_out_s* out, int val ) {
+
+  static const char pairs[] = 
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+  char tmp[16];
+  char *p;
+  unsigned int u;
+
+  /* same as "%d", two digits per step from the digit pair table */
+
+  if ( out->len + CSV_FIELD_LEN > CSV_CHUNK_LEN ) 
+    csv_out_flush( out );
+
+  u = ( val < 0 ) ? -(unsigned int)val : (unsigned int)val;
+  p = tmp + sizeof( tmp );
+
+  while ( u >= 100 ) {
+    p -= 2;
+    memcpy( p, pairs + 2 * ( u % 100 ), 2 );
+    u /= 100;
+  }
+  if ( u >= 10 ) {
+    p -= 2;
+    memcpy( p, pairs + 2 * u, 2 );
+  } else {
+    *--p = '0' + u;
+  }
+  if ( val < 0 ) 
+    *--p = '-';
+
+  memcpy( out->buf + out->len, p, tmp + sizeof( tmp ) - p );
+  out->len += tmp + sizeof( tmp ) - p;
+}
+
+
+
+void csv_out_fixed( csv_out_s* out, double val, int decimals ) {
+
+  static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6 };
+  double scaled;
+  double frac;
+  long long fixed;
+  int i;
+  char *p;
+  char digits[32];
+  char tmp[DBL_MAX_10_EXP + 32];
+  int n;
+
+  /* 
+   * same as "%.<decimals>f", through integer arithmetic. Values printf 
+   * might round differently (ties, huge values, nan) are left to printf.
+   */
+
+  if ( out->len + CSV_FIELD_LEN > CSV_CHUNK_LEN ) 
+    csv_out_flush( out );
+
+  if ( ( decimals < 0 ) || ( decimals > 6 ) ) 
+    goto use_printf;
+
+  p = out->buf + out->len;
+  scaled = fabs( val ) * pow10[decimals];
+  frac = scaled - floor( scaled );
+
+  if ( !( scaled < 1e15 ) || ( fabs( frac - 0.5 ) < 1e-6 ) ) 
+    goto use_printf;
+
+  fixed = (long long)( scaled + 0.5 );
+
+  if ( signbit( val ) ) 
+    *p++ = '-';
+
+  n = 0;
+  do {
+    digits[n++] = '0' + fixed % 10;
+    fixed /= 10;
+  } while ( ( fixed > 0 ) | ( n <= decimals ) );
+
+  for ( i = n - 1; i >= 0; i-- ) {
+    *p++ = digits[i];
+    if ( ( i == decimals ) && ( decimals > 0 ) ) 
+      *p++ = '.';
+  }
+
+  out->len = p - out->buf;
+  return;
+
+  /* up to DBL_MAX_10_EXP digits before the point, more than a field */
+
+ use_printf:
+  snprintf( tmp, sizeof( tmp ), "%.*f", decimals, val );
+  csv_out_str( out, tmp );
+}
+
+
+
+int csv_out_flush( csv_out_s* out ) {
+
+  /* 
+   * a short write is remembered in out->err and returned by this and 
+   * every later flush, the buffered data are dropped either way
+   */
+
+  if ( out->len ) {
+    if ( fwrite( out->buf, 1, out->len, out->fp ) != out->len ) 
+      out->err = -1;
+    out->len = 0;
+  }
+  return out->err;
+}
+
+
+
+int write_data_to_csv( char *csv_path, char *rra_path, dat_s *data, int subset,
+		       int t_from, int t_to ) {
+
+  FILE *fp_csv;
+
+  int i;
+  int j;
+  int first;
+  int n;
+
+  int *int_rra;
+  double *dble_rra;
+  unsigned char *bitmap;
+
+  int data_type;
+  int n_samples;
+  ring_s ring;
+  csv_out_s out;
+
+  rra_s *rra;
+
+  if ( ( rra = rra_open( rra_path, data, subset, 0 ) ) == NULL ) {
+    fprintf( out_stream(), "write_data_to_csv: Cannot read %s\n", rra_path );
+    return -1;
+  }
+
+  if ( ( fp_csv = fopen( csv_path, "w" ) ) ) {
+
+    /* map data from rra file as vector */
+
+    data_type = rra->data_type;
+    int_rra   = rra->int_val;
+    dble_rra  = rra->dble_val;
+    n_samples = rra->n_samples;
+
+    ring_init( &ring, data->subset[subset] );
+    csv_out_init( &out, fp_csv );
+
+    /* 
+     * write to file in chronological order, skip not-yet-filled positions
+     * ( 0x7FFFFFFF and NaN ), found up front in the filled slot bitmap. 
+     * Empty stretches are skipped 8 slots at a time. Only the slots in
+     * [t_from, t_to) are looked at.
+     */
+
+    n = ring_window( &ring, t_from, t_to, &first );
+    bitmap = scratch_get( SCRATCH_CHUNK, n_samples / 8 + 2 );
+    memset( bitmap, 0, n_samples / 8 + 2 );
+    ring_mark_range( &ring, rra, bitmap, first, n );
+
+    for ( i = 0; i < n; i++ ) {
+      if ( bitmap[i >> 3] == 0 ) {
+	i |= 7;
+	continue;
+      }
+      if ( bitmap[i >> 3] & ( 1 << ( i & 7 ) ) ) {
+	j = ring_slot_at( &ring, first + i );
+	csv_out_int( &out, ring_time_at( &ring, first + i ) );
+	csv_out_str( &out, ", " );
+	if ( data_type ) {
+	  csv_out_int( &out, int_rra[j] );
+	} else {
+	  csv_out_fixed( &out, dble_rra[j], 3 );
+	}
+	csv_out_str( &out, "\n" );
+      }
+    }
+
+   /* clean up, a truncated csv would be merged as it is */
+    
+    if ( csv_out_flush( &out ) | ( fclose( fp_csv ) != 0 ) ) {
+      fprintf( out_stream(), "write_data_to_csv: Cannot write %s: %s\n", csv_path, 
+	       strerror( errno ) );
+      unlink( csv_path );
+      rra_close( rra );
+      return -1;
+    }
+    
+  } else {
+    fprintf( out_stream(), "write_data_to_csv: Cannot open file %s for writing\n", csv_path );
+    rra_close( rra );
+    return -1;
+  }
+  rra_close( rra );
+  return 0;
+}
+
+
+
+int write_data_to_rrb( char *rrb_path, char *rra_path, dat_s *data, int subset,
+		       int t_from, int t_to ) {
+
+  FILE *fp;
+  rra_s *rra;
+  rrb_head_s head;
+  dat_sub_s *sub;
+  unsigned char *bitmap;
+  char *values;
+  char *src;
+  size_t val_len;
+  size_t map_len;
+  int i;
+  int j;
+  int k;
+  int first;
+  ring_s ring;
+
+  if ( ( rra = rra_open( rra_path, data, subset, 0 ) ) == NULL ) {
+    fprintf( out_stream(), "write_data_to_rrb: Cannot read %s\n", rra_path );
+    return -1;
+  }
+
+  sub = data->subset[subset];
+
+  memset( &head, 0, sizeof( head ) );
+  memcpy( head.magic, RRB_MAGIC, sizeof( head.magic ) );
+  head.data_type = rra->data_type;
+  ring_init( &ring, sub );
+  head.interval  = ring.interval;
+  head.n_samples = ring_window( &ring, t_from, t_to, &first );
+  head.t_start   = ring_time_at( &ring, first );
+
+  val_len = rra->data_type ? sizeof( int ) : sizeof( double );
+  map_len = ( head.n_samples + 7 ) / 8;
+  bitmap  = scratch_get( SCRATCH_CHUNK, map_len + 1 );
+  values  = scratch_get( SCRATCH_RAW, head.n_samples * val_len + 1 );
+  memset( bitmap, 0, map_len + 1 );
+
+  /* 
+   * unroll the ring buffer, or the part of it in [t_from, t_to), in 
+   * chronological order. Not yet filled positions ( 0x7FFFFFFF and NaN ) 
+   * only leave a 0 in the bitmap.
+   */
+
+  head.n_valid = ring_mark_range( &ring, rra, bitmap, first, head.n_samples );
+
+  src = rra->data_type ? (char*)rra->int_val : (char*)rra->dble_val;
+
+  for ( i = 0, k = 0; k < head.n_valid; i++ ) {
+    if ( bitmap[i >> 3] == 0 ) {
+      i |= 7;
+      continue;
+    }
+    if ( bitmap[i >> 3] & ( 1 << ( i & 7 ) ) ) {
+      j = ring_slot_at( &ring, first + i );
+      memcpy( values + k * val_len, src + j * val_len, val_len );
+      k++;
+    }
+  }
+  rra_close( rra );
+
+  if ( ( fp = fopen( rrb_path, "w" ) ) == NULL ) {
+    fprintf( out_stream(), "write_data_to_rrb: Cannot open file %s for writing\n", rrb_path );
+    return -1;
+  }
+
+  /* a truncated .rrb would be merged as it is, so none is left */
+
+  if ( ( fwrite( &head, sizeof( head ), 1, fp ) != 1 ) | 
+       ( fwrite( bitmap, 1, map_len, fp ) != map_len ) | 
+       ( fwrite( values, val_len, head.n_valid, fp ) != (size_t)head.n_valid ) | 
+       ( fclose( fp ) != 0 ) ) {
+    fprintf( out_stream(), "write_data_to_rrb: Cannot write %s: %s\n", rrb_path, 
+	     strerror( errno ) );
+    unlink( rrb_path );
+    return -1;
+  }
+
+  return 0;
+}
+
+
+int inject_data( tl_ctx_s* ctx, char* dl_dir, exports_s* exports, 
+		 int binary, char* state_path ) {
+  int i;
+  int k;
+  int dat_cnt = 0;
+  int n_jobs = 0;
+  int n_failed = 0;
+
+  char *dat_path;
+  char *uuid;
+
+  char *csv_paths[N_SUBSETS];
+  char *rra_paths[N_SUBSETS];
+  char *csv_path;
+  char *fine_path;
+  char* csv_dir;
+
+  int max_time;
+
+  struct dat_s *data;
+  dev_index_s *devices;
+  job_s **jobs = NULL;
+  job_s *job;
+  arena_s *arena = &ctx->arena;
+  state_s *state = NULL;
+  char *rra_location = ctx->rra_location;
+  manifest_s *man;
+  manifest_s *csv_man = NULL;
+  journal_s *journal = NULL;
+  jentry_s *entry;
+  char journal_path[2 * MAX_LEN];
+  char source[2 * MAX_LEN];
+  int fine;
+  double t0;
+
+  /* 
+   * Merge the data in dl_dir, or in exports, into all databases. Returns 
+   * the number of .dat files, or minus an E_ code.
+   */
+  
+  csv_dir = calloc( MAX_LEN, sizeof( char ) );
+
+  if ( dl_dir == NULL ) {
+    /* processing downloaded export.zip */
+    strcpy( csv_dir, ctx->exports_location );
+  } else {
+    /* processing uploaded data, export.zip or otherwise */
+    strcpy( csv_dir, dl_dir );
+  }
+
+  max_time = test_date( ctx->max_date );
+
+  /* 
+   * the databases, and the csv files to merge unless they are in memory.
+   * Subsets without one of the two are not queued at all.
+   */
+
+  if ( ( man = read_manifest( rra_location, arena ) ) == NULL ) {
+    /* could not open directory */
+    perror ("inject_data: opendir: Can't open directory");
+    free( csv_dir );
+    return -E_CANNOT_OPEN_DIR;
+  }
+  dat_cnt = man->n_dats;
+
+  if ( exports == NULL ) {
+    if ( strcmp( csv_dir, rra_location ) == 0 ) {
+      csv_man = man;
+    } else if ( ( csv_man = read_manifest( csv_dir, arena ) ) == NULL ) {
+      perror ("inject_data: opendir: Can't open directory");
+      arena_reset( arena );
+      free( csv_dir );
+      return -E_CANNOT_OPEN_DIR;
+    }
+  }
+
+  /* 
+   * flush all file buffers, to make sure all .rra files are 
+   * up-to-date 
+   */
+  sync();
+
+  if ( state_path ) {
+    state = read_state( state_path );
+  }
+
+  /* an interrupted run of the same data is taken over */
+
+  if ( !ctx->plan ) {
+    snprintf( source, sizeof( source ), "%s %s %d %d", csv_dir, 
+	      exports ? "mem" : "disk", max_time, state_path != NULL );
+    snprintf( journal_path, sizeof( journal_path ), JOURNAL_FILE, 
+	      rra_location, hash_str( source ) );
+    journal = open_journal( journal_path, source );
+  }
+
+  devices  = get_device_index( ctx, ctx->hcb_rrd_cfg );
+  dat_path = calloc( 2 * MAX_LEN, sizeof( char ) ); 
+
+  for ( k = 0; k < dat_cnt; k++ ) {
+
+    job = queue_job( &jobs, &n_jobs, JOB_PRINT, arena );
+    start_output( job );
+
+    fprintf( out_stream(), "\nfound .dat file : %s\n", man->dats[k].name );
+
+    /*
+     * open .dat file and read. Arguably, you can read most of the info
+     * (but not all) from the xml file as well.
+     */
+
+    sprintf( dat_path, "%s%s", rra_location, man->dats[k].name );
+    t0 = stats_start();
+    data = read_dat_file( dat_path, arena );
+    stats_phase( PH_READ_DAT, t0 );
+    job->data = data;
+
+    /* 
+     * Workaround for not yet initialized databases. 
+     * Uuid is only assigned when there has been contact with the 
+     * meter adapter first. Until then, the word "placeholder"
+     * is used as uuid. 
+     */
+    if ( strcmp( data->deviceUuid, "placeholder" ) != 0 ) {
+
+      /* extract uuid for searching config_hcb_rrd.xml for device name */
+	    
+      uuid = man->dats[k].uuid;
+      fprintf( out_stream(), "uuid            : %s\n", uuid );
+	    
+      if ( ( data->rrd_device_name = get_device_name( devices, uuid ) ) ) {
+	data->rrd_device_name = arena_strdup( arena, data->rrd_device_name );
+      }
+      print_data( data );
+
+      if ( data->rrd_device_name == NULL ) {
+	fprintf( out_stream(), "No device for %s in %s, continuing ...\n", 
+		 uuid, ctx->hcb_rrd_cfg );
+      }
+	    
+      /* construct filename for old data set */
+	    
+      for ( i = 0; ( i < data->n_sets ) && data->rrd_device_name; i++ ) {
+	csv_paths[i] = get_csv_path( csv_dir, data, i, binary, arena );
+	rra_paths[i] = get_rra_path( data, uuid, rra_location, i, arena );
+      }
+
+      /* subsets without data of their own are derived from the finest one */
+
+      fine = finest_subset( data );
+      for ( i = 0; ( i < data->n_sets ) && data->rrd_device_name; i++ ) {
+	if ( manifest_find( man, rra_paths[i] ) == NULL ) {
+	  fprintf( out_stream(), "subset %d (%s) has no .rra file, skipped\n",
+		   i, data->subset[i]->interval );
+	  continue;
+	}
+
+	fine_path = NULL;
+	if ( ( csv_path = find_merge_source( csv_man, exports, csv_paths[i], 
+					     arena ) ) == NULL ) {
+	  fine_path = ( i == fine ) ? NULL : 
+	    find_merge_source( csv_man, exports, csv_paths[fine], arena );
+	}
+	if ( ( csv_path == NULL ) && ( fine_path == NULL ) ) {
+	  fprintf( out_stream(), "no data for subset %d (%s), skipped\n",
+		   i, data->subset[i]->interval );
+	  continue;
+	}
+
+	entry = journal ? journal_find( journal, uuid, 
+					data->subset[i]->interval ) : NULL;
+	switch ( resume_subset( entry, rra_paths[i] ) ) {
+	case 2:
+	  fprintf( out_stream(), "subset %d (%s) merged before, skipped\n",
+		   i, data->subset[i]->interval );
+	  if ( state_path ) {
+	    *state_entry( &state, uuid, data->subset[i]->interval ) = 
+	      entry->last_time;
+	  }
+	  continue;
+	case 1:
+	  job = queue_job( &jobs, &n_jobs, JOB_MERGE, arena );
+	  job->resumed  = 1;
+	  job->dirty[0] = entry->dirty[0];
+	  job->dirty[1] = entry->dirty[1];
+	  break;
+	default:
+	  job = queue_job( &jobs, &n_jobs, ctx->plan ? JOB_PLAN : JOB_MERGE, 
+			   arena );
+	  job->journal = journal;
+	  break;
+	}
+	job->data      = data;
+	job->subset    = i;
+	job->uuid      = uuid;
+	job->csv_path  = csv_path;
+	job->fine_path = fine_path;
+	job->rra_path  = rra_paths[i];
+	job->max_time  = max_time;
+	job->exports   = exports;
+	if ( state_path ) {
+	  job->last_time = state_entry( &state, uuid, 
+					data->subset[i]->interval );
+	  if ( job->resumed ) 
+	    job->t_last = entry->last_time;
+	}
+      }
+    } else {
+      fprintf( out_stream(), "Corresponding database(s) not yet initialised, continuing ...\n"); 
+    }
+
+    end_output();
+  }
+
+  /* merge all subsets, then put the results in place in one go */
+
+  run_jobs( jobs, n_jobs, ctx->n_threads );
+  stats_collect( jobs, n_jobs );
+  if ( ctx->plan ) {
+    print_plan( jobs, n_jobs );
+  } else {
+    t0 = stats_start();
+    printf( "\n%d .rra files updated\n", 
+	    commit_rra_files( jobs, n_jobs, rra_location, &n_failed ) );
+    stats_phase( PH_COMMIT, t0 );
+
+    /* -i: samples count as merged once they are in the live file */
+
+    for ( i = 0; i < n_jobs; i++ ) {
+      if ( ( jobs[i]->type == JOB_MERGE ) && jobs[i]->committed && 
+	   jobs[i]->last_time ) 
+	*jobs[i]->last_time = jobs[i]->t_last;
+    }
+  }
+  free_jobs( jobs, n_jobs );
+  arena_reset( arena );
+
+  /* 
+   * a plan leaves the state as it is, for the run it is a plan of. So does
+   * a partial commit, the journal lets the next run finish it.
+   */
+
+  if ( n_failed ) {
+    fprintf( stderr, "Error: %d .rra file(s) could not be updated, run again to retry\n",
+	     n_failed );
+  }
+  if ( state_path ) {
+    if ( !ctx->plan && !n_failed ) 
+      write_state( state_path, state );
+    free_state( state );
+  }
+  close_journal( journal, journal_path, !n_failed );
+  
+  free( dat_path );
+
+  /* clean up */
+
+  printf("\n%d .dat files read and processed.\n", dat_cnt );
+  free( csv_dir );
+  return n_failed ? -E_COMMIT_FAILED : dat_cnt;
+}
+
+
+
+state_s* read_state( char* state_path ) {
+
+  FILE* fp;
+  state_s* state = NULL;
+  state_s* entry;
+  char uuid[MAX_LEN];
+  char interval[MAX_LEN];
+  int last_time;
+
+  /* 
+   * one line per subset: <uuid> <interval> <last merged time>. A missing
+   * file just means nothing was merged incrementally before.
+   */
+
+  if ( ( fp = fopen( state_path, "r" ) ) == NULL ) 
+    return NULL;
+
+  while ( fscanf( fp, "%255s %255s %d", uuid, interval, &last_time ) == 3 ) {
+    entry = calloc( 1, sizeof( state_s ) );
+    entry->uuid      = strdup( uuid );
+    entry->interval  = strdup( interval );
+    entry->last_time = last_time;
+    entry->next      = state;
+    state = entry;
+  }
+  fclose( fp );
+
+  return state;
+}
+
+
+
+int* state_entry( state_s** state, char* uuid, char* interval ) {
+
+  state_s* entry;
+
+  /* last merged time of a subset, a new entry starts before all data */
+
+  for ( entry = *state; entry; entry = entry->next ) {
+    if ( !strcmp( entry->uuid, uuid ) && !strcmp( entry->interval, interval ) ) 
+      return &entry->last_time;
+  }
+
+  entry = calloc( 1, sizeof( state_s ) );
+  entry->uuid      = strdup( uuid );
+  entry->interval  = strdup( interval );
+  entry->last_time = T_NONE;
+  entry->next      = *state;
+  *state = entry;
+
+  return &entry->last_time;
+}
+
+
+
+int write_state( char* state_path, state_s* state ) {
+
+  FILE* fp;
+  state_s* entry;
+  char tmp_path[2 * MAX_LEN];
+
+  /* written aside and renamed, a crash never leaves half a state file */
+
+  snprintf( tmp_path, sizeof( tmp_path ), "%s.tmp", state_path );
+
+  if ( ( fp = fopen( tmp_path, "w" ) ) == NULL ) {
+    fprintf( stderr, "write_state: Cannot open %s for writing\n", tmp_path );
+    return -1;
+  }
+
+  for ( entry = state; entry; entry = entry->next ) {
+    if ( entry->last_time != T_NONE ) {
+      fprintf( fp, "%s %s %d\n", entry->uuid, entry->interval, 
+	       entry->last_time );
+    }
+  }
+
+  if ( ( fclose( fp ) != 0 ) | ( rename( tmp_path, state_path ) != 0 ) ) {
+    fprintf( stderr, "write_state: Cannot write %s\n", state_path );
+    return -1;
+  }
+  return 0;
+}
+
+
+
+void free_state( state_s* state ) {
+
+  state_s* next;
+
+  while ( state ) {
+    next = state->next;
+    free( state->uuid );
+    free( state->interval );
+    free( state );
+    state = next;
+  }
+}
+
+
+
+journal_s* open_journal( char* path, char* source ) {
+
+  FILE* fp;
+  journal_s* journal;
+  jentry_s* entry;
+  char line[2 * MAX_LEN];
+  char head[2 * MAX_LEN];
+  char uuid[MAX_LEN];
+  char interval[MAX_LEN];
+  unsigned long crc;
+  long size;
+  int last_time;
+  int dirty[2];
+  char* dir;
+  char* name;
+
+  /* 
+   * Read the journal of an interrupted run from the same source, then 
+   * continue it, or start a new one. NULL when it can't be written, the 
+   * run goes ahead without.
+   */
+
+  journal = calloc( 1, sizeof( journal_s ) );
+  snprintf( head, sizeof( head ), "%s %s\n", JOURNAL_MAGIC, source );
+
+  if ( ( fp = fopen( path, "r" ) ) ) {
+    if ( fgets( line, sizeof( line ), fp ) && !strcmp( line, head ) ) {
+      while ( fscanf( fp, "%255s %255s %lx %ld %d %d %d", uuid, interval, 
+		      &crc, &size, &last_time, &dirty[0], &dirty[1] ) == 7 ) {
+	entry = calloc( 1, sizeof( jentry_s ) );
+	entry->uuid      = strdup( uuid );
+	entry->interval  = strdup( interval );
+	entry->crc       = crc;
+	entry->size      = size;
+	entry->last_time = last_time;
+	entry->dirty[0]  = dirty[0];
+	entry->dirty[1]  = dirty[1];
+	entry->next      = journal->entries;
+	journal->entries = entry;
+      }
+    }
+    fclose( fp );
+  }
+
+  if ( journal->entries ) {
+    printf( "Resuming the interrupted run in %s\n", path );
+    journal->fd = open( path, O_WRONLY | O_APPEND );
+  } else {
+    journal->fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if ( ( journal->fd >= 0 ) && 
+	 write_all( journal->fd, head, strlen( head ) ) ) {
+      close( journal->fd );
+      journal->fd = -1;
+    }
+  }
+
+  if ( journal->fd < 0 ) {
+    fprintf( stderr, "open_journal: Cannot write %s: %s\n", path, 
+	     strerror( errno ) );
+    close_journal( journal, NULL, 0 );
+    return NULL;
+  }
+
+  /* the journal has to survive what it is for */
+
+  if ( journal->entries == NULL ) {
+    dir = strdup( path );
+    if ( ( name = strrchr( dir, '/' ) ) ) 
+      name[1] = '\0';
+    fsync( journal->fd );
+    fsync_dir( name ? dir : "." );
+    free( dir );
+  }
+  return journal;
+}
+
+
+
+jentry_s* journal_find( journal_s* journal, char* uuid, char* interval ) {
+
+  jentry_s* entry;
+
+  for ( entry = journal->entries; entry; entry = entry->next ) {
+    if ( !strcmp( entry->uuid, uuid ) && !strcmp( entry->interval, interval ) ) 
+      return entry;
+  }
+  return NULL;
+}
+
+
+
+int journal_add( journal_s* journal, job_s* job, unsigned long crc ) {
+
+  char line[2 * MAX_LEN];
+  dat_sub_s* sub = job->data->subset[job->subset];
+  long size;
+  int len;
+  int err;
+
+  /* 
+   * One line per subset, with a single write to the file opened for 
+   * appending, so that workers need no lock. Synced before returning.
+   */
+
+  size = (long)sub->n_samples * 
+    ( strcmp( job->data->sampleType, "integer" ) ? sizeof( double ) : 
+      sizeof( int ) );
+  len = snprintf( line, sizeof( line ), "%s %s %08lx %ld %d %d %d\n", 
+		  job->uuid, sub->interval, crc, size, 
+		  job->last_time ? job->t_last : T_NONE, job->dirty[0], 
+		  job->dirty[1] );
+
+  err = ( write( journal->fd, line, len ) != len ) || fdatasync( journal->fd );
+  if ( err ) {
+    fprintf( out_stream(), "journal_add: Cannot write journal: %s\n", 
+	     strerror( errno ) );
+  }
+  return err ? -1 : 0;
+}
+
+
+
+void close_journal( journal_s* journal, char* path, int done ) {
+
+  jentry_s* entry;
+  jentry_s* next;
+
+  /* a complete run leaves no journal */
+
+  if ( journal == NULL ) 
+    return;
+  if ( journal->fd >= 0 ) 
+    close( journal->fd );
+  if ( done && path ) 
+    unlink( path );
+
+  for ( entry = journal->entries; entry; entry = next ) {
+    next = entry->next;
+    free( entry->uuid );
+    free( entry->interval );
+    free( entry );
+  }
+  free( journal );
+}
+
+
+
+int resume_subset( jentry_s* entry, char* rra_path ) {
+
+  char tmp_path[2 * MAX_LEN];
+  unsigned long crc;
+
+  /* 
+   * what became of a subset in the journal: 1 when its merged copy is 
+   * still there for commit_rra_files, 2 when that has been committed 
+   * already, 0 when it has to be merged again
+   */
+
+  if ( entry == NULL ) 
+    return 0;
+
+  rra_tmp_path( rra_path, tmp_path, sizeof( tmp_path ) );
+  if ( !access( tmp_path, F_OK ) ) {
+    return ( !file_crc32( tmp_path, entry->size, &crc ) && 
+	     ( crc == entry->crc ) ) ? 1 : 0;
+  }
+  return ( !file_crc32( rra_path, entry->size, &crc ) && 
+	   ( crc == entry->crc ) ) ? 2 : 0;
+}
+
+
+
+int file_crc32( char* path, long size, unsigned long* crc ) {
+
+  char buf[COPY_BUF_LEN];
+  ssize_t n;
+  long left = size;
+  int fd;
+
+  /* crc32 of the first size bytes of path, -1 when it is shorter */
+
+  if ( ( fd = open( path, O_RDONLY ) ) < 0 ) 
+    return -1;
+
+  *crc = crc32( 0L, Z_NULL, 0 );
+  while ( left > 0 ) {
+    n = read( fd, buf, ( left < (long)sizeof( buf ) ) ? left : sizeof( buf ) );
+    if ( n <= 0 ) 
+      break;
+    *crc = crc32( *crc, (unsigned char*)buf, n );
+    left -= n;
+  }
+  close( fd );
+
+  return left ? -1 : 0;
+}
+
+
+
+manifest_s* read_manifest( char* dir, arena_s* arena ) {
+
+  DIR *dir_p;
+  struct dirent *entry;
+  struct stat st;
+  manifest_s *man;
+  dir_entry_s *files = NULL;
+  dir_entry_s *file;
+  man_dat_s *dat;
+  int size = 0;
+  int len;
+  int n;
+  int i;
+  int k;
+  char prefix[MAX_LEN];
+
+  /* 
+   * one pass over dir, NULL if it can't be read. Names and the manifest
+   * itself live in the arena, only the growing entry list does not.
+   */
+
+  if ( ( dir_p = opendir( dir ) ) == NULL ) 
+    return NULL;
+
+  man = arena_alloc( arena, sizeof( manifest_s ) );
+
+  while ( ( entry = readdir( dir_p ) ) != NULL ) {
+    if ( ( entry->d_type != DT_REG ) && ( entry->d_type != DT_UNKNOWN ) ) 
+      continue;
+    if ( fstatat( dirfd( dir_p ), entry->d_name, &st, 
+		  AT_SYMLINK_NOFOLLOW ) || !S_ISREG( st.st_mode ) ) 
+      continue;
+
+    if ( man->n_files == size ) {
+      size = size ? 2 * size : 64;
+      files = realloc( files, size * sizeof( dir_entry_s ) );
+    }
+    file = &files[man->n_files++];
+    file->name = arena_strdup( arena, entry->d_name );
+    file->size = st.st_size;
+
+    len = (int)strlen( file->name );
+    if ( ( len > 4 ) && !strcmp( ".dat", file->name + len - 4 ) ) 
+      man->n_dats++;
+  }
+  closedir( dir_p );
+
+  man->files = arena_alloc( arena, man->n_files * sizeof( dir_entry_s ) );
+  if ( man->n_files ) {
+    memcpy( man->files, files, man->n_files * sizeof( dir_entry_s ) );
+    qsort( man->files, man->n_files, sizeof( dir_entry_s ), cmp_dir_entry );
+  }
+  free( files );
+
+  /* the .dat files, with the .rra files of their database next to them */
+
+  man->dats = arena_alloc( arena, man->n_dats * sizeof( man_dat_s ) );
+  dat = man->dats;
+
+  for ( k = 0; k < man->n_files; k++ ) {
+    file = &man->files[k];
+    len = (int)strlen( file->name );
+    if ( ( len <= 4 ) || strcmp( ".dat", file->name + len - 4 ) ) 
+      continue;
+
+    dat->name = file->name;
+    dat->uuid = arena_strdup( arena, file->name );
+    dat->uuid[len - 4] = '\0';
+    dat->size = file->size;
+
+    snprintf( prefix, sizeof( prefix ), "%s-", dat->uuid );
+    len = (int)strlen( prefix );
+    for ( i = manifest_lower( man, prefix ); 
+	  ( i < man->n_files ) && !strncmp( man->files[i].name, prefix, len ); 
+	  i++ ) {
+      n = (int)strlen( man->files[i].name );
+      if ( ( n >= len + 4 ) && 
+	   !strcmp( ".rra", man->files[i].name + n - 4 ) ) 
+	dat->size += man->files[i].size;
+    }
+    dat++;
+  }
+
+  qsort( man->dats, man->n_dats, sizeof( man_dat_s ), cmp_man_dat );
+
+  return man;
+}
+
+
+
+int manifest_lower( manifest_s* man, char* name ) {
+
+  int lo = 0;
+  int hi = man->n_files;
+  int mid;
 
-    printf("read_csv_time: Cannot open file %s for reading\n", csv_path );
-    return NULL;
+  /* index of the first file not sorting before name */
 
+  while ( lo < hi ) {
+    mid = ( lo + hi ) / 2;
+    if ( strcmp( man->files[mid].name, name ) < 0 ) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
   }
+  return lo;
 }
 
 
 
-void* sort_data_for_rra( dat_s* data, int subset, 
-			 void* data_csv, void* data_rra, 
-			 int* time_csv, int* time_rra ) {
+dir_entry_s* manifest_find( manifest_s* man, char* path ) {
 
-  int data_type;
-  int index;
+  char *name;
   int i;
-  int t_min, t_max;
 
-  int* int_tmp;
-  int* int_rra;
-  int* int_csv;
+  /* the entry of path, only its file name counts */
 
-  double* dble_tmp;
-  double* dble_rra;
-  double* dble_csv;
+  name = strrchr( path, '/' );
+  name = name ? name + 1 : path;
 
-  /* 
-   * decide on data type and copy newest data into output vectors 
-   */
+  i = manifest_lower( man, name );
+  if ( ( i < man->n_files ) && !strcmp( man->files[i].name, name ) ) 
+    return &man->files[i];
+  return NULL;
+}
 
-  if ( !strcmp( data->sampleType, "integer" ) ) {
-    data_type = INTEGER;
-    int_csv = data_csv;
-    int_rra = data_rra;
-    int_tmp =  calloc( data->subset[subset]->n_samples, sizeof( int ) );
 
-    for ( i = 0; i< data->subset[subset]->n_samples; i++ ) {
-      // int_tmp[i] = 0x7fffffff;
-      int_tmp[i] = int_rra[i];
-    }
 
-  } else {
-    data_type = DOUBLE;
-    dble_csv = data_csv;
-    dble_rra = data_rra;
-    dble_tmp = calloc( data->subset[subset]->n_samples, sizeof( double ) );
+int cmp_dir_entry( const void* a, const void* b ) {
+  return strcmp( ((dir_entry_s*)a)->name, ((dir_entry_s*)b)->name );
+}
 
-    for ( i = 0; i< data->subset[subset]->n_samples; i++ ) {
-      //dble_tmp[i] = NAN;
-      dble_tmp[i] = dble_rra[i];
-    }
-  }
-    
-  /* 
-   * sort csv data according to time vector 
-   */
 
-  t_min = time_rra[data->subset[subset]->file_offset+1];
-  t_max = time_rra[data->subset[subset]->file_offset];
-  
-  for ( i = 0; i < data->subset[subset]->n_samples; i++ ) {
-    if ( ( time_csv[i]  >= t_min ) &  (time_csv[i]  <= t_max ) ) {
-      index = search( time_csv, 0, data->subset[subset]->n_samples, 
-		      time_rra[i] );
-      if (index >= 0 ) {
-	if ( data_type ) {
-	  //int_tmp[i] = int_rra[i];
-	  int_tmp[i] = int_csv[index];
-	} else {
-	  //dble_tmp[i] = dble_rra[i];
-	  dble_tmp[i] = dble_csv[index];
-	}
-      }
-    }
-  }
 
-  if ( data_type ) {
-    return int_tmp;
-  } else {
-    return dble_tmp;
-  }
-  
-}
+int cmp_man_dat( const void* a, const void* b ) {
 
+  man_dat_s *da = (man_dat_s*)a;
+  man_dat_s *db = (man_dat_s*)b;
 
-CURLcode download_export_zip( char* url, char* exp_file ) {
-  CURL* curl;
-  FILE* fp;
-  CURLcode res;
+  /* largest database first, by name when the same size */
+
+  if ( da->size != db->size ) 
+    return ( da->size < db->size ) ? 1 : -1;
+  return strcmp( da->name, db->name );
+}
 
-  size_t write_data( void *ptr, size_t size, size_t nmemb, FILE *stream ) {
-    size_t written = fwrite( ptr, size, nmemb, stream );
-    return written;
-  }
 
-  /* copied from curl examples */
 
-  curl = curl_easy_init();
-  if ( curl ) {
-    fprintf( stderr, "Downloading %s from %s ...", exp_file, url );
+char* find_merge_source( manifest_s* csv_man, exports_s* exports, 
+			 char* csv_path, arena_s* arena ) {
+
+  char *csv_name;
+  char *gz_path;
 
-    fp = fopen( exp_file,"wb");
+  /* 
+   * the file to merge for csv_path, in export.zip in memory or on disk, 
+   * as it is or gzipped (-z). NULL when there is none.
+   */
 
-    curl_easy_setopt( curl, CURLOPT_URL, url );
-    curl_easy_setopt( curl, CURLOPT_WRITEFUNCTION, write_data );
-    curl_easy_setopt( curl, CURLOPT_WRITEDATA, fp );
-    curl_easy_setopt( curl, CURLOPT_FAILONERROR, 1 );
-    curl_easy_setopt( curl, CURLOPT_TIMEOUT, 10 );
+  if ( exports ) {
+    csv_name = strrchr( csv_path, '/' );
+    csv_name = csv_name ? csv_name + 1 : csv_path;
+    return find_export( exports, csv_name ) ? csv_path : NULL;
+  }
+  if ( manifest_find( csv_man, csv_path ) ) 
+    return csv_path;
 
-    res = curl_easy_perform( curl );
+  gz_path = arena_alloc( arena, strlen( csv_path ) + sizeof( GZ_EXT ) );
+  sprintf( gz_path, "%s%s", csv_path, GZ_EXT );
+  return manifest_find( csv_man, gz_path ) ? gz_path : NULL;
+}
 
-    curl_easy_cleanup( curl );
 
-    fclose( fp );
-    fprintf( stderr, " done\n");
 
-    return res;
-  } else {
-    return (CURLcode)-1;
-  }
+FILE* out_stream( void ) {
+  return job_out ? job_out : stdout;
 }
 
 
 
-int unzip( char* file, char* path ) {
-  
-  FILE* fp;
-  JZFile* zip;
-  JZEndRecord endRecord;
-  int retval;
+job_s* queue_job( job_s*** jobs, int* n_jobs, int type, arena_s* arena ) {
 
-  char* local_path;
-  local_path = calloc( MAX_LEN, sizeof( char ) );
+  job_s* job;
 
-  strcpy( local_path, path );  
-  strcat( local_path, file );  
+  /* append a new, empty job to the job list, room for 64 more at a time */
 
-  if ( ( fp = fopen( local_path, "r" ) ) > 0 ) {
-  
-  zip = jzfile_from_stdio_file( fp );
-  
-  if ( jzReadEndRecord( zip, &endRecord ) ) {
-    printf("unzip: Couldn't read ZIP file end record.");
-    retval = -1;
-    goto endClose;
+  if ( *n_jobs % 64 == 0 ) {
+    *jobs = realloc( *jobs, ( *n_jobs + 64 ) * sizeof( job_s* ) );
   }
-  
-  if ( jzReadCentralDirectory( zip, &endRecord, record_callback, path ) ) {
-    printf("unzip: Couldn't read ZIP file central record.");
-    retval = -2;
-    goto endClose;
-  } 
-  retval = 0;
-  
- endClose:
+  job = arena_alloc( arena, sizeof( job_s ) );
+  job->type = type;
+  (*jobs)[(*n_jobs)++] = job;
 
-  zip->close( zip );
-  } else {
-    fprintf( stderr, "unzip: Cannot open %s for reading\n", local_path );
-    retval = -3;
-  }
-  free( local_path );
-  return retval;
+  return job;
 }
 
 
-int record_callback( JZFile *zip, int idx, JZFileHeader *header, 
-		    char *filename, void *user_data ) {
-  long offset;
-  
-  offset = zip->tell( zip ); /* store current position */
-  
-  if ( zip->seek( zip, header->offset, SEEK_SET ) ) {
-    printf( "record_callback: Cannot seek in zip file!" );
-    return 0; /* abort */
-  }
-  
-  process_file( zip, (char*)user_data ); /* alters file offset */
-  
-  zip->seek( zip, offset, SEEK_SET ); /* return to position */
-  
-  return 1; /* continue */
-}
 
+void start_output( job_s* job ) {
 
-int process_file( JZFile *zip, char* dl_path ) {
-  JZFileHeader header;
-  char filename[1024];
-  unsigned char *data;
-  
-  if ( jzReadLocalFileHeader( zip, &header, filename, sizeof( filename ) ) ) {
-    printf( "process_file: Cannot read local file header of %s\n", filename );
-    return -1;
-  }
-  
-  if ( ( data = (unsigned char *)malloc( header.uncompressedSize ) ) == 
-       NULL) {
-    printf( "process_file: Cannot allocate memory\n" );
-    return -1;
-  }
-  
-  if ( jzReadData( zip, &header, data ) != Z_OK ) {
-    printf( "Couldn't read file data\n" );
-    free( data );
-    return -1;
-  }
+  /* 
+   * Collect console output of this thread in the job's buffer, so that it 
+   * can be printed in order, no matter which thread produced it.
+   */
 
-  write_file( filename, dl_path, data, header.uncompressedSize );
-  free( data );
-  
-  return 0;
+  job_out = open_memstream( &job->out, &job->out_len );
+  job->done = ( job->type == JOB_PRINT );
 }
 
 
-  
-void write_file( char *filename, char* dl_path, void *data, long bytes ) {
-  FILE *out;
-  int i;
-  char* path;
-  
-  path = calloc( 1024, sizeof( char ) );
-  strcpy( path, dl_path );
-  strcat( path, filename );
-
-  out = fopen( path, "w" );
 
-  if ( out != NULL ) {
-    fwrite( data, 1, bytes, out ); /* best effort is enough here */
-    fclose( out );
-  } else {
-    fprintf( stderr, "write_file: Cannot open %s for writing\n", path );
+void end_output( void ) {
+  if ( job_out ) {
+    fclose( job_out );
+    job_out = NULL;
   }
-  free( path );
 }
 
 
-int make_directory( char *dir ) {
-    printf( "mkdir(%s)\n", dir );
-    return 0;
-}
 
+void run_job( job_s* job ) {
 
-int rra_to_csv( char* rra_location ) {
+  double t0;
+  int staged;
+  unsigned long crc = 0;
 
-  int i;
-  int len_o;
-  int dir_len_o;
+  stats_sink = &job->stats;
 
-  char* csv_path;
-  char* rra_path;
-  DIR *dir_old;
-  char *dir_o;
-  struct dirent *entry_o;
-  char *filename_o;
-  char *uuid;
-  FILE *fp_o;
-  struct dat_s *data;
-  int dat_cnt = 0;
-  char * cfg_path;
+  switch ( job->type ) {
+  case JOB_MERGE:
+    if ( job->resumed ) {
+      fprintf( out_stream(), "resumed         : %s, merged before\n", 
+	       job->rra_path );
+      job->staged = 1;
+      break;
+    }
 
-  dir_o =  calloc( 2 * MAX_LEN, sizeof( char ) ); 
-  memcpy( dir_o, rra_location, strlen( rra_location ) + 1 );
-  dir_len_o = (int)strlen( dir_o );
+    /* the state itself only advances once the merge has been committed */
+
+    if ( job->last_time ) 
+      job->t_last = *job->last_time;
+    staged = merge_data( job->csv_path, job->fine_path, job->rra_path, 
+			 job->data, job->subset, job->max_time, 
+			 job->last_time ? &job->t_last : NULL, job->exports, 
+			 &crc, job->dirty );
+    job->staged    = ( staged > 0 );
+    job->committed = ( staged == 0 );
+    if ( job->journal && ( staged >= 0 ) ) {
+      journal_add( job->journal, job, crc );
+    }
+    break;
+  case JOB_PLAN:
+    job->planned = plan_merge( job->csv_path, job->fine_path, job->rra_path, 
+			       job->data, job->subset, job->max_time, 
+			       job->last_time, job->exports );
+    break;
+  case JOB_EXPORT:
+    t0 = stats_start();
+    if ( is_rrb_path( job->csv_path ) ) {
+      write_data_to_rrb( job->csv_path, job->rra_path, job->data, 
+			 job->subset, job->t_from, job->t_to );
+    } else {
+      write_data_to_csv( job->csv_path, job->rra_path, job->data, 
+			 job->subset, job->t_from, job->t_to );
+    }
+    stats_phase( PH_EXPORT, t0 );
+    stats_count_file( CNT_BYTES_IN, job->rra_path );
+    stats_count_file( CNT_BYTES_OUT, job->csv_path );
+    break;
+  }
 
-  /* read old rra data and transform to csv data */
+  stats_sink = NULL;
+}
 
-  if ( ( dir_old = opendir( dir_o ) ) != NULL ) {
 
-    cfg_path = calloc( MAX_LEN, sizeof( char ) );
-    strcpy( cfg_path, rra_location );
-    strcat( cfg_path, "config_hcb_rrd.xml" );
 
-    while ( (entry_o = readdir( dir_old) ) != NULL) {
-       
-      /* find .dat files */
-      
-      if ( entry_o->d_type == DT_REG ) {
+void* job_worker( void* arg ) {
 
-	filename_o = calloc( MAX_LEN, sizeof( char ) ); 	
-	strcpy( filename_o, entry_o->d_name );
-	len_o = (int)strlen( filename_o );
+  pool_s* pool = arg;
+  job_s* job;
+  FILE* fp;
 
-	if ( !strcmp( ".dat", filename_o + len_o - 4 ) ) {
-	  printf( "\nfound .dat file : %s\n", filename_o );
-	  dat_cnt ++;
+  for ( ;; ) {
+    pthread_mutex_lock( &pool->lock );
+    if ( pool->next >= pool->n_jobs ) {
+      pthread_mutex_unlock( &pool->lock );
+      break;
+    }
+    job = pool->jobs[pool->next++];
+    pthread_mutex_unlock( &pool->lock );
+
+    if ( job->type != JOB_PRINT ) {
+      fp = open_memstream( &job->out, &job->out_len );
+      job_out = fp;
+      run_job( job );
+      job_out = NULL;
+      fclose( fp );
+    }
 
-	  /* open it and read */
+    pthread_mutex_lock( &pool->lock );
+    job->done = 1;
+    pthread_cond_broadcast( &pool->done );
+    pthread_mutex_unlock( &pool->lock );
+  }
+  scratch_release();
+  return NULL;
+}
 
-	  memcpy( dir_o + dir_len_o, filename_o, len_o + 1 );
 
-	  data = read_dat_file( dir_o );
 
-	  if ( strcmp( data->deviceUuid, "placeholder" ) != 0 ) {
-	    
-	    uuid = calloc( MAX_LEN , sizeof( char ) ); 
-	    memcpy( uuid, filename_o, len_o - 4 );
-	    printf( "uuid            : %s\n", uuid );
-	    data->rrd_device_name = get_device_name( cfg_path, uuid );
-	    
-	    print_data( data );
-	    
-	    /* construct filename for old data set */
-	    
-	    for ( i = 0; i < data->n_sets; i++ ) {
-	      if ( data->rrd_device_name != NULL ) {
-		csv_path = get_csv_path( rra_location, data, i );
-		rra_path = get_rra_path( data, uuid, rra_location, i );
-		
-		write_data_to_csv( csv_path, rra_path, data, i );
-		
-		free( csv_path );
-		free( rra_path );
-	      }
-	    }
-
-	    free( uuid );
-	  } else {
-	    printf("Corresponding database(s) not yet initialised, continuing ...\n"); 
-	  }
+void run_jobs( job_s** jobs, int n_jobs, int n_threads ) {
 
-	  free_dat_s( data );
-	}
-	free( filename_o );
-      } /* end if DT_REG */
-    } /* while ... */
-   
-    closedir( dir_old );
-    
-    free( cfg_path );
+  pool_s pool;
+  pthread_t threads[MAX_JOBS];
+  int i;
 
-    if ( dat_cnt == 0 ) {
-      fprintf( stderr, "Cannot find any .dat files in %s, exiting\n", 
-	       rra_location );
-      exit( E_NO_DAT_FILES_FOUND );
-    } else {
-      free( dir_o );
-      return dat_cnt;
-    }
-  } else {
-    /* could not open directory */
-    perror ("rra_to_csv: opendir: Can't open directory");
-    free( dir_o );
-    return EXIT_FAILURE;
-  }
-}
+  if ( n_threads > n_jobs ) 
+    n_threads = n_jobs;
 
+  if ( n_threads <= 1 ) {
 
-int download_exports_and_unzip( char * url ) {
+    /* serial, jobs write straight to stdout */
 
-  int err;
-  char* exp_file   = "export.zip";
-  char* therm_file = "thermostat.zip";
-  char* usage_file = "usage.zip";
-  CURLcode res;
+    for ( i = 0; i < n_jobs; i++ ) {
+      if ( jobs[i]->type == JOB_PRINT ) {
+	fwrite( jobs[i]->out, 1, jobs[i]->out_len, stdout );
+      } else {
+	run_job( jobs[i] );
+      }
+    }
+    return;
+  }
 
-  char path[1024];
-  char dl_path[1024];
-  char cmd[1024];
+  pool.jobs   = jobs;
+  pool.n_jobs = n_jobs;
+  pool.next   = 0;
+  pthread_mutex_init( &pool.lock, NULL );
+  pthread_cond_init( &pool.done, NULL );
 
-  /* recursively create directory to downlod into. */
+  for ( i = 0; i < n_threads; i++ ) {
+    pthread_create( &threads[i], NULL, job_worker, &pool );
+  }
 
-  sprintf(cmd, "mkdir -m 0755 -p %s\n",  EXPORTS_LOCATION );
-  err = system( cmd );
+  /* print job output in queue order, as soon as it becomes available */
 
-  if ( err ) {
-    fprintf( stderr, "%s failed.\n", cmd );
-  } else {
-    strcpy( path, EXPORTS_LOCATION );
-    
-    strcpy( dl_path, path );
-    strcat( dl_path, "/" );
-    strcat( dl_path, exp_file );
-    
-    /* download zip file and unpack */
-    
-    if (  ( res = download_export_zip( url, dl_path ) ) != CURLE_OK ) {
-      printf("Download failed: error %d\n", res );
-      exit( EXIT_FAILURE );
+  for ( i = 0; i < n_jobs; i++ ) {
+    pthread_mutex_lock( &pool.lock );
+    while ( !jobs[i]->done ) {
+      pthread_cond_wait( &pool.done, &pool.lock );
     }
-    
-    /* open zip files and extract all data to /tmp/exports */
-    
-    fprintf(stderr, "Uncompressing data ... " );
-    if ( unzip( exp_file, EXPORTS_LOCATION ) ) { 
-      fprintf( stderr, "Error: Unable to unzip %s\n", 
-	       strcat( path, exp_file ) );
-      exit( EXIT_FAILURE );
-    } 
-    if ( unzip( therm_file, EXPORTS_LOCATION ) ) { 
-      fprintf( stderr, "Error: Unable to unzip %s\n", 
-	       strcat( path, therm_file ) );
-      exit( EXIT_FAILURE );
-    } 
-    if ( unzip( usage_file, EXPORTS_LOCATION ) ) { 
-      fprintf( stderr, "Error: Unable to unzip %s\n", 
-	       strcat( path, usage_file ) );
-      exit( EXIT_FAILURE );
-    } 
-    fprintf(stderr, "done\n");
+    pthread_mutex_unlock( &pool.lock );
+    fwrite( jobs[i]->out, 1, jobs[i]->out_len, stdout );
+    fflush( stdout );
   }
-  return err;
+
+  for ( i = 0; i < n_threads; i++ ) {
+    pthread_join( threads[i], NULL );
+  }
+
+  pthread_mutex_destroy( &pool.lock );
+  pthread_cond_destroy( &pool.done );
 }
 
 
 
-int write_data_to_csv( char *csv_path, char *rra_path, dat_s *data, int subset ) {
+double stats_clock( void ) {
 
-  FILE *fp_csv;
+  struct timespec ts;
 
-  int j;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-  int *time_rra;
-  int *int_rra;
-  double *dble_rra;
 
-  int data_type;
 
-  if ( fp_csv = fopen( csv_path, "w" ) ) {
+double stats_start( void ) {
 
-    /*
-     * get data type for this file
-     */
+  /* start of a phase, no clock reading without --stats */
 
-    if ( !strcmp( data->sampleType, "integer" ) ) {
-      data_type = INTEGER;
-    } else {
-      data_type = DOUBLE;
-    }
+  return run_stats.enabled ? stats_clock() : 0.0;
+}
 
-    /* read data from rra file, store in vectors */
 
-    time_rra = create_rra_time( data, subset );
 
-    if ( data_type ) {
-      int_rra = read_rra_file( rra_path, data, subset );
-    } else {
-      dble_rra = read_rra_file( rra_path, data, subset );
-   }
+void stats_phase( int phase, double t0 ) {
 
-    /* 
-     * write to file, skip not-yet-filled positions
-     * ( 0x7FFFFFFF and NaN )
-     */
+  /* add the time since t0 (from stats_start) to phase */
 
-    if ( data->subset[subset]->n_samples != 0 ) {
-            
-      for ( j = 0; j< data->subset[subset]->n_samples; j++ ) {
-	if ( data_type ) {
-	  if ( int_rra[j] != 0x7fffffff ) {
-	    fprintf( fp_csv, "%d, %d\n", time_rra[j], int_rra[j] );
-	  }
-	} else {
-	  if ( !isnan( dble_rra[j]) ) {
-	    fprintf( fp_csv, "%d, %.3lf\n", time_rra[j], dble_rra[j] );
-	  }
-	}
-      }
-    }
+  if ( run_stats.enabled ) {
+    ( stats_sink ? stats_sink : &run_stats.total )->t[phase] += 
+      stats_clock() - t0;
+  }
+}
 
-   /* clean up */
-    
-    if ( data_type ) {
-      free( int_rra );
-    } else {
-      free( dble_rra );
-    }
-    
-    free( time_rra );
-    fclose( fp_csv );
-    
-  } else {
-    printf("write_data_to_csv: Cannot open file %s for writing\n", csv_path );
+
+
+void stats_count( int counter, long long n ) {
+  if ( run_stats.enabled ) {
+    ( stats_sink ? stats_sink : &run_stats.total )->n[counter] += n;
   }
-  return 0;
 }
 
 
-int inject_data( char* rra_location, char* dl_dir, char* max_date ) {
-  int i;
-  int dat_cnt = 0;
-  int len_n;
-  int dir_len_n;
-  DIR *dir_new;
 
-  char *dir_n;
+void stats_count_file( int counter, char* path ) {
 
-  struct dirent *entry_n;
+  struct stat st;
 
-  char *filename_n;
-  char *uuid;
+  /* add the size of a file read or written, costs a stat with --stats only */
 
-  FILE *fp_n;
+  if ( run_stats.enabled && !stat( path, &st ) ) {
+    stats_count( counter, st.st_size );
+  }
+}
 
-  char *csv_path;
-  char *rra_path;
-  char* csv_dir;
 
-  int max_time;
 
-  struct dat_s *data;
-  
-  csv_dir = calloc( MAX_LEN, sizeof( char ) );
+void stats_collect( job_s** jobs, int n_jobs ) {
 
-  if ( dl_dir == NULL ) {
-    /* processing downloaded export.zip */
-    strcpy( csv_dir, EXPORTS_LOCATION );
-  } else {
-    /* processing uploaded data, export.zip or otherwise */
-    strcpy( csv_dir, dl_dir );
-  }
+  stat_db_s* db;
+  char* path;
+  char* name;
+  int i;
+  int k;
 
-  max_time = test_date( max_date );
+  /* 
+   * keep the statistics of finished merge jobs per .rra file and of export 
+   * jobs per file written, and add them to the totals, before the jobs 
+   * are freed
+   */
 
-  dir_n =  malloc( 2 * MAX_LEN * sizeof( char ) ); 
-  memcpy( dir_n, rra_location, strlen( rra_location ) + 1 );
-  dir_len_n = (int)strlen( dir_n );
-  
-  if ( ( dir_new = opendir( dir_n ) ) != NULL ) {
-    while ( (entry_n = readdir( dir_new ) ) != NULL) {
-      
-      /* find .dat files */
-      
-      if ( entry_n->d_type == DT_REG ) {
+  if ( !run_stats.enabled ) 
+    return;
+
+  for ( i = 0; i < n_jobs; i++ ) {
+    if ( jobs[i]->type == JOB_PRINT ) 
+      continue;
+
+    if ( run_stats.n_dbs % 64 == 0 ) {
+      run_stats.dbs = realloc( run_stats.dbs, 
+			       ( run_stats.n_dbs + 64 ) * sizeof( stat_db_s ) );
+    }
+    db = &run_stats.dbs[run_stats.n_dbs++];
+    path = ( jobs[i]->type == JOB_EXPORT ) ? jobs[i]->csv_path : 
+      jobs[i]->rra_path;
+    name = strrchr( path, '/' );
+    db->name = strdup( name ? name + 1 : path );
+    db->set  = jobs[i]->stats;
+
+    for ( k = 0; k < N_PHASES; k++ ) {
+      run_stats.total.t[k] += db->set.t[k];
+    }
+    for ( k = 0; k < N_COUNTERS; k++ ) {
+      run_stats.total.n[k] += db->set.n[k];
+    }
+  }
+}
 
-	filename_n = calloc( MAX_LEN, sizeof( char ) ); 	
-	strcpy( filename_n, entry_n->d_name );
-	len_n = (int)strlen( filename_n );
 
-	if ( !strcmp( ".dat", filename_n + len_n - 4 ) ) {
-	  printf( "\nfound .dat file : %s\n", filename_n );
-	  dat_cnt ++;
 
-	  /* 
-	   * flush all file buffers, to make sure all .rra files are 
-	   * up-to-date 
-	   */
-	  sync();
+void print_stats( void ) {
 
-	  /*
-	   * open .dat file and read. Arguably, you can read most of the info
-	   * (but not all) from the xml file as well.
-	   */
+  static const char *phases[N_PHASES] = { 
+    "download", "unzip", "backup", "pwrusage", "read_dat", "parse", "sort", 
+    "write", "commit", "export" };
+  static const char *counters[N_COUNTERS] = { 
+    "samples", "merged", "filled", "bytes_in", "bytes_out" };
+  struct rusage ru;
+  stat_db_s* db;
+  stat_set_s* set;
+  double wall;
+  int i;
+  int k;
 
-	  memcpy( dir_n + dir_len_n, filename_n, len_n + 1 );
+  /* 
+   * Statistics of the run, as a table or as one line of JSON. Peak RSS 
+   * is in kB, as reported by getrusage.
+   */
 
-	  data = read_dat_file( dir_n );
-	  /* 
-	   * Workaround for not yet initialized databases. 
-	   * Uuid is only assigned when there has been contact with the 
-	   * meter adapter first. Until then, the word "placeholder"
-	   * is used as uuid. 
-	   */
-	  if ( strcmp( data->deviceUuid, "placeholder" ) != 0 ) {
+  wall = stats_clock() - run_stats.t_start;
+  if ( getrusage( RUSAGE_SELF, &ru ) ) {
+    ru.ru_maxrss = 0;
+  }
 
-	    /* extract uuid for searching config_hcb_rrd.xml for device name */
-	    
-	    uuid = calloc( MAX_LEN , sizeof( char ) ); 
-	    memcpy( uuid, filename_n, len_n - 4 );
-	    printf( "uuid            : %s\n", uuid );
-	    
-	    data->rrd_device_name = get_device_name( HCB_RRD_CFG, uuid );
-	    print_data( data );
-	    
-	    /* construct filename for old data set */
-	    
-	    for ( i = 0; i < data->n_sets; i++ ) {
-	      csv_path = get_csv_path( csv_dir, data, i );
-	      rra_path = get_rra_path( data, uuid, rra_location, i );
-
-	      merge_data( csv_path, rra_path, data, i, max_time );
-	      
-	      free( csv_path );
-	      free( rra_path );
-	    }
-	    free( uuid );
-	  } else {
-	    printf("Corresponding database(s) not yet initialised, continuing ...\n"); 
-	  }
-	  free_dat_s( data );
-	}
-	free( filename_n );
-      } /* end if DT_REG */
-    } /* while ... */
+  fflush( stdout );
+
+  if ( run_stats.json ) {
+    printf( "{\"wall\":%.6f,\"peak_rss_kb\":%ld,\"phases\":{", wall, 
+	    (long)ru.ru_maxrss );
+    for ( k = 0; k < N_PHASES; k++ ) {
+      printf( "%s\"%s\":%.6f", k ? "," : "", phases[k], 
+	      run_stats.total.t[k] );
+    }
+    printf( "},\"totals\":{" );
+    for ( k = 0; k < N_COUNTERS; k++ ) {
+      printf( "%s\"%s\":%lld", k ? "," : "", counters[k], 
+	      run_stats.total.n[k] );
+    }
+    printf( "},\"databases\":[" );
+    for ( i = 0; i < run_stats.n_dbs; i++ ) {
+      db = &run_stats.dbs[i];
+      printf( "%s{\"file\":\"%s\"", i ? "," : "", db->name );
+      for ( k = 0; k < N_COUNTERS; k++ ) {
+	printf( ",\"%s\":%lld", counters[k], db->set.n[k] );
+      }
+      for ( k = PH_PARSE; k < N_PHASES; k++ ) {
+	if ( db->set.t[k] > 0.0 ) 
+	  printf( ",\"%s\":%.6f", phases[k], db->set.t[k] );
+      }
+      printf( "}" );
+    }
+    printf( "]}\n" );
 
-    closedir( dir_new );
-    
   } else {
-    /* could not open directory */
-    perror ("inject_data: opendir: Can't open directory");
-    exit( E_CANNOT_OPEN_DIR );
+    printf( "\nRun statistics: %.3f s wall clock, peak RSS %ld kB\n\n", 
+	    wall, (long)ru.ru_maxrss );
+    printf( "  phase        seconds (jobs summed over threads)\n" );
+    for ( k = 0; k < N_PHASES; k++ ) {
+      printf( "  %-10s %9.3f\n", phases[k], run_stats.total.t[k] );
+    }
+    printf( "\n  %-40s %9s %9s %9s %11s %11s %9s %9s %9s\n", "database", 
+	    "samples", "merged", "filled", "bytes in", "bytes out", "parse", 
+	    "sort", "write" );
+    for ( i = 0; i <= run_stats.n_dbs; i++ ) {
+
+      /* one line per .rra file, then the totals */
+
+      set = ( i < run_stats.n_dbs ) ? &run_stats.dbs[i].set : &run_stats.total;
+      printf( "  %-40s %9lld %9lld %9lld %11lld %11lld %9.3f %9.3f %9.3f\n", 
+	      ( i < run_stats.n_dbs ) ? run_stats.dbs[i].name : "total", 
+	      set->n[CNT_SAMPLES], set->n[CNT_MERGED], set->n[CNT_FILLED],
+	      set->n[CNT_BYTES_IN], set->n[CNT_BYTES_OUT], set->t[PH_PARSE], 
+	      set->t[PH_SORT], set->t[PH_WRITE] + set->t[PH_EXPORT] );
+    }
   }
-  
-  free( dir_n );
 
-  /* clean up */
+  for ( i = 0; i < run_stats.n_dbs; i++ ) {
+    free( run_stats.dbs[i].name );
+  }
+  free( run_stats.dbs );
+  run_stats.dbs   = NULL;
+  run_stats.n_dbs = 0;
+}
 
-  printf("\n%d .dat files read and processed.\n", dat_cnt );
-  free( csv_dir );
-  return dat_cnt;
+
+
+void free_jobs( job_s** jobs, int n_jobs ) {
+
+  int i;
+
+  /* the jobs and their data are in the run's arena, only output is not */
+
+  for ( i = 0; i < n_jobs; i++ ) {
+    free( jobs[i]->out );
+  }
+  free( jobs );
 }
 
 
+
 void usage ( char* exec_name) {
   printf( "version: %s\n", VERSION );
-  printf( "\ncall:\n\n%s [-h] [-d <IP>] [-u <directory>] [-L <date>] -[e] [-r] [-b]\n\n", exec_name ); 
+  printf( "\ncall:\n\n%s [-h] [-d <IP>[,<IP>...]] [-R <IP>] [-u <directory>] [-L <date>] -[e] [-r] [--from <date>] [--to <date>] [-b] [-m] [-z] [-B] [-i] [-j <N>] [--plan] [--stats[=json]]\n\n", exec_name ); 
   printf( "options:\n" );
   printf( "    -h              Print this help message and exit.\n" );
   printf( "    -d <IP>         Download data from this IP-address. This option implies -e.\n" );
+  printf( "                    A comma separated list of IP-addresses downloads from all\n" );
+  printf( "                    of those toons at the same time. Their data are staged in\n" );
+  printf( "                    %s<IP>/ and merged in the order given.\n", EXPORTS_LOCATION );
+  printf( "    -R <IP>         Download config_hcb_rrd.xml, config_happ_pwrusage.xml and\n" );
+  printf( "                    all .dat and .rra files from the old toon at this\n" );
+  printf( "                    IP-address, over one connection, and continue as -r with\n" );
+  printf( "                    them. The toon has to serve these files by name from the\n" );
+  printf( "                    root of its web server. They are staged in\n" );
+  printf( "                    %s<IP>/.\n", EXPORTS_LOCATION );
   printf( "    -u <directory>  Read data from this upload directory. Required for options\n" );
   printf( "                    -e and -r.\n" ); 
   printf( "    -e              Read data from an uploaded export.zip file, as created\n" );
@@ -2037,11 +6694,38 @@ void usage ( char* exec_name) {
   printf( "                    <date> in the form YYYY-mm-dd, e.g., 2019-03-09.\n" );
   printf( "                    Monthly data will be processed until the last full month\n" );
   printf( "                    before this date, when available.\n" );
+  printf( "    --from <date>   With -r, only convert and merge the data of this date\n" );
+  printf( "    --to <date>     and later, or of this date and earlier. Slots outside\n" );
+  printf( "                    the range are not read, subsets without data in it are\n" );
+  printf( "                    skipped. Monthly data are not affected.\n" );
   printf( "    -b              Create back-ups of the rra databases and corresponding\n" );
   printf( "                    .dat files. This option also creates a script to restore\n" );
   printf( "                    the back-ups, in case something goes wrong. The script\n" );
   printf( "                    is called restore_logs.sh and is stored with the data in\n" );
   printf( "                    /HCBv2/rra_backups_<POSIX_timestamp>.\n" );
+  printf( "    -m              Unpack export.zip in memory and merge the data from there,\n" );
+  printf( "                    without writing the csv files to %s.\n", EXPORTS_LOCATION );
+  printf( "                    Use this option in combination with -d or -u/-e.\n" );
+  printf( "    -z              Store the csv files unpacked from export.zip, and the\n" );
+  printf( "                    .rra files in back-ups (-b), gzipped as %s files.\n", GZ_EXT );
+  printf( "                    They are inflated again while merging or restoring.\n" );
+  printf( "    -B              With -r, convert the old .rra files to compact binary\n" );
+  printf( "                    %s files instead of .csv files. Faster, smaller, and\n", RRB_EXT );
+  printf( "                    without rounding doubles to 3 decimals.\n" );
+  printf( "    -i              Incremental: only merge data newer than what earlier runs\n" );
+  printf( "                    with -i merged. The latest merged sample of every database\n" );
+  printf( "                    is kept in %s in the database directory.\n", STATE_FILE );
+  printf( "    -j <N>          Process up to N databases in parallel. Useful when running\n" );
+  printf( "                    on a multicore host against uploaded directories (-u).\n" );
+  printf( "                    Default: 1.\n" );
+  printf( "    --plan          Dry run: report per database how many slots the merge\n" );
+  printf( "                    would overwrite, at most, from the .dat files and the\n" );
+  printf( "                    first and last sample of each csv file. No database,\n" );
+  printf( "                    config file or -i state is changed. With -r, the old\n" );
+  printf( "                    .rra files are still converted in the upload directory.\n" );
+  printf( "    --stats         Print the time spent per phase and per database, with\n" );
+  printf( "                    sample and byte counts, at the end of the run.\n" );
+  printf( "    --stats=json    Same, as a single line of JSON.\n" );
   printf( " \nThis software will only work when your toon has been connected to a meter\nadapter previously. Prior to this first contact, no databases exist on your\ntoon, so there's nothing to write data into.\n" ); 
   printf( "\nPlease note that at least one choice of data files to be imported into the new\ndatabases is mandatory (options -d, -u/-r or -u/-e).\n\n");
   printf( "The new data become available after rebooting your toon.\n\n" );
@@ -2050,25 +6734,75 @@ void usage ( char* exec_name) {
 }
 
 
-void free_dat_s( dat_s *data ) {
+void* arena_alloc( arena_s* arena, size_t size ) {
 
-  /* free dat_s struct memory */
+  arena_s* block;
+  void* ptr;
 
-  int i;
-  for ( i = 0; i < N_SUBSETS; i++ ) {
-    if ( data->subset[i] ) {
-      free( data->subset[i]->consolidator );
-      free( data->subset[i]->interval );
-      free( data->subset[i]->binLength );
-      free( data->subset[i] );
-    }
+  /* 
+   * zeroed, 8 byte aligned memory from the current block. A new block is 
+   * started when it runs out, requests larger than a block get their own.
+   */
+
+  size = ( size + 7 ) & ~(size_t)7;
+
+  if ( arena->used + size > arena->size ) {
+    block = malloc( sizeof( arena_s ) );
+    *block = *arena;
+    arena->next = block;
+    arena->size = ( size > ARENA_BLOCK ) ? size : ARENA_BLOCK;
+    arena->base = malloc( arena->size );
+    arena->used = 0;
+  }
+
+  ptr = arena->base + arena->used;
+  arena->used += size;
+  memset( ptr, 0, size );
+
+  return ptr;
+}
+
+
+
+char* arena_strdup( arena_s* arena, char* str ) {
+  return strcpy( arena_alloc( arena, strlen( str ) + 1 ), str );
+}
+
+
+
+void arena_free( arena_s* arena ) {
+
+  arena_s* block;
+  arena_s* next;
+
+  free( arena->base );
+  for ( block = arena->next; block; block = next ) {
+    next = block->next;
+    free( block->base );
+    free( block );
+  }
+  memset( arena, 0, sizeof( arena_s ) );
+}
+
+
+
+void arena_reset( arena_s* arena ) {
+
+  arena_s* block;
+  arena_s* next;
+
+  /* 
+   * release everything but the newest block, the next run starts over in 
+   * that one without a malloc
+   */
+
+  for ( block = arena->next; block; block = next ) {
+    next = block->next;
+    free( block->base );
+    free( block );
   }
-  free( data->sampleType );
-  free( data->deviceSvc );
-  free( data->deviceVar );
-  free( data->rrd_device_name );
-  free( data->deviceUuid );
-  free( data );
+  arena->next = NULL;
+  arena->used = 0;
 }
 
 
@@ -2122,63 +6856,197 @@ int dir_exist( char* path ) {
 
 
 
-int unzip_exports( char* path ) {
+int unzip_exports( char* path, int gz ) {
 
-  int err;
-  char* file;
+  char* files[] = { "export.zip", "thermostat.zip", "usage.zip", NULL };
+  int i;
 
-  file = calloc( MAX_LEN, sizeof( char ) );
-  strcpy( file, path );
-  /* open zip files and extract all data to path */
+  /* open zip files and extract all data to path, 0 on success */
   
   fprintf(stderr, "Uncompressing data ... " );
 
-  if ( unzip( "export.zip", path ) ) { 
-    fprintf( stderr, "Error: Unable to unzip %s%s\n", path, "export.zip" );
-    exit( EXIT_FAILURE );
-  } 
+  for ( i = 0; files[i]; i++ ) {
+    if ( unzip( files[i], path, gz ) ) { 
+      fprintf( stderr, "Error: Unable to unzip %s%s\n", path, files[i] );
+      return E_UNZIP_FAILED;
+    } 
+  }
+ 
+  fprintf( stderr, "done\n" );
+  return 0;
+}
+
+
+exports_s* load_exports( char* path, char* file ) {
+
+  FILE* fp;
+  JZFile* zip;
+  exports_s* exports;
+  char* local_path;
+
+  /* 
+   * Unpack export.zip, and the zip files nested in it, into memory. All 
+   * other entries are kept as they are, indexed by their name.
+   */
+
+  local_path = calloc( MAX_LEN, sizeof( char ) );
+  snprintf( local_path, MAX_LEN, "%s%s", path, file );
+
+  if ( ( fp = fopen( local_path, "r" ) ) == NULL ) {
+    fprintf( stderr, "load_exports: Cannot open %s for reading\n", local_path );
+    free( local_path );
+    return NULL;
+  }
+
+  fprintf( stderr, "Uncompressing data into memory ... " );
+
+  exports = calloc( 1, sizeof( exports_s ) );
+  zip = jzfile_from_stdio_file( fp );
+
+  if ( load_zip_entries( zip, exports ) ) {
+    fprintf( stderr, "Error: Unable to unzip %s\n", local_path );
+    free_exports( exports );
+    exports = NULL;
+  } else {
+    fprintf( stderr, "done, %d files, %ld bytes\n", exports->n_files, 
+	     (long)exports->n_bytes );
+  }
+
+  zip->close( zip );
+  free( local_path );
+  return exports;
+}
 
-  strcpy( file, path );
-  if ( unzip( "thermostat.zip", path ) ) { 
-    fprintf( stderr, "Error: Unable to unzip %s%s\n", path, "thermostat.zip" );
-    exit( EXIT_FAILURE );
+
+
+int load_zip_entries( JZFile* zip, exports_s* exports ) {
+
+  JZEndRecord endRecord;
+
+  if ( jzReadEndRecord( zip, &endRecord ) ) {
+    printf("load_zip_entries: Couldn't read ZIP file end record.");
+    return -1;
+  }
+  
+  if ( jzReadCentralDirectory( zip, &endRecord, load_callback, exports ) ) {
+    printf("load_zip_entries: Couldn't read ZIP file central record.");
+    return -2;
   } 
+  return 0;
+}
 
-  strcpy( file, path );
-  if ( unzip( "usage.zip", path ) ) { 
-    fprintf( stderr, "Error: Unable to unzip %s%s\n", path, "usage.zip" );
-    exit( EXIT_FAILURE );
+
+
+int load_callback( JZFile *zip, int idx, JZFileHeader *header, 
+		   char *filename, void *user_data ) {
+  long offset;
+  int ret;
+  
+  offset = zip->tell( zip ); /* store current position */
+  
+  if ( zip->seek( zip, header->offset, SEEK_SET ) ) {
+    printf( "load_callback: Cannot seek in zip file!" );
+    return 0; /* abort */
   }
- 
-  fprintf( stderr, "done\n" );
-  free( file );
-  return err;
+
+  ret = load_entry( zip, header, (exports_s*)user_data ); /* alters offset */
+
+  zip->seek( zip, offset, SEEK_SET ); /* return to position */
+  
+  return ( ret == 0 ); /* continue, unless something went wrong */
 }
 
 
-int test_host( char* url ) {
-  CURL *curl;
-  CURLcode res = CURLE_OK;
 
-  /* taken from curl examples */
+int load_entry( JZFile *zip, JZFileHeader *central, exports_s* exports ) {
+  export_s* export;
+  JZFileHeader local;
+  JZFile* nested;
+  char name[1024];
+  char* data;
+  int len;
+  
+  /* unpack the zip entry at the current position into memory */
+
+  if ( jzReadLocalFileHeader( zip, &local, name, sizeof( name ) ) ) {
+    printf( "load_entry: Cannot read local file header\n" );
+    return -1;
+  }
+  use_sizes( &local, central );
+  
+  if ( ( data = malloc( local.uncompressedSize + 1 ) ) == NULL ) {
+    printf( "load_entry: Cannot allocate memory\n" );
+    return -1;
+  }
+
+  if ( jzReadData( zip, &local, data ) != Z_OK ) {
+    printf( "load_entry: Couldn't read data of %s\n", name );
+    free( data );
+    return -1;
+  }
+  
+  len = (int)strlen( name );
+
+  if ( ( len > 4 ) && !strcmp( ".zip", name + len - 4 ) ) {
+
+    /* nested zip file, unpack its entries as well */
+
+    nested = jzfile_from_memory( data, local.uncompressedSize );
+    if ( load_zip_entries( nested, exports ) ) {
+      fprintf( stderr, "Error: Unable to unzip %s\n", name );
+    }
+    nested->close( nested );
+    free( data );
+
+  } else {
+
+    export = malloc( sizeof( export_s ) );
+    export->name = strdup( name );
+    export->data = data;
+    export->size = local.uncompressedSize;
+    export->next = exports->first;
+    exports->first = export;
+    exports->n_files++;
+    exports->n_bytes += export->size;
+  }
+
+  return 0;
+}
 
-  curl = curl_easy_init();
 
-  if ( curl ) {
-    curl_easy_setopt( curl, CURLOPT_URL, url );
 
-    /* Do not do the transfer - only connect to host */
+export_s* find_export( exports_s* exports, char* name ) {
 
-    curl_easy_setopt( curl, CURLOPT_CONNECT_ONLY, 1L );
-    res = curl_easy_perform( curl );
+  export_s* export;
 
-    curl_easy_cleanup( curl );
+  for ( export = exports->first; export; export = export->next ) {
+    if ( !strcmp( export->name, name ) ) {
+      return export;
+    }
   }
+  return NULL;
+}
+
 
-   return (int)res;
+
+void free_exports( exports_s* exports ) {
+
+  export_s* export;
+  export_s* next;
+
+  if ( exports ) {
+    for ( export = exports->first; export; export = next ) {
+      next = export->next;
+      free( export->name );
+      free( export->data );
+      free( export );
+    }
+    free( exports );
+  }
 }
 
 
+
 int test_date( char* date ) {
   struct tm tm = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
   int t = 0x7fffffff;
@@ -2196,56 +7064,274 @@ int test_date( char* date ) {
 
 
 
-char* create_backups( char* rra_location ) {
+int create_backups( char* rra_location, char* backup_dir, char** configs, 
+		    int gz ) {
 
-  char* backup_dir = "/HCBv2/rra_backups";
-  char* cmd;
-  char* dir;
-  char* restore_script;
-  int err;
+  char dir[2 * MAX_LEN];
+  char prev[2 * MAX_LEN];
+  char src[2 * MAX_LEN];
+  char restore_script[2 * MAX_LEN];
+  char* name;
+  int n_copied = 0;
+  int n_linked = 0;
+  int n_failed = 0;
+  int i;
 
   FILE* fp;
+  DIR* rra_dir;
+  struct dirent* entry;
+  struct stat st;
+
+  /* 
+   * Snapshot the databases and the config files (NULL terminated list) 
+   * into a new backup_dir_<time> directory, plus a script to restore 
+   * them. Files that are unchanged (same size and mtime) since the 
+   * previous snapshot are hard linked to it, everything else is copied. 
+   * The live files are not linked, hcb_rrd keeps writing them in place. 
+   * With gz, the .rra files are stored gzipped. Returns the number of 
+   * files that could not be backed up.
+   */
 
-  struct timeval *tv;
+  snprintf( dir, sizeof( dir ), "%s_%ld/", backup_dir, (long)time( NULL ) );
 
-  tv = calloc( 1, sizeof( struct timeval ) );
+  if ( mkdir( dir, 0755 ) && ( errno != EEXIST ) ) {
+    fprintf( stderr, "create_backups: Cannot create %s: %s\n", dir, 
+	     strerror( errno ) );
+    return -1;
+  }
 
-  gettimeofday( tv, NULL );
+  printf( "Creating database backups and restoration script in %s\n", dir );
+  if ( find_last_backup( backup_dir, dir, prev, sizeof( prev ) ) ) {
+    printf( "Previous backup : %s\n", prev );
+  } else {
+    prev[0] = '\0';
+  }
 
-  cmd = calloc( MAX_LEN, sizeof( char ) );
-  dir = calloc( MAX_LEN, sizeof( char ) );
-  sprintf( dir, "%s_%d/", backup_dir, tv->tv_sec ); 
-  sprintf( cmd, "cp %s/* %s", rra_location, dir );
+  if ( ( rra_dir = opendir( rra_location ) ) != NULL ) {
+    while ( ( entry = readdir( rra_dir ) ) != NULL ) {
+      snprintf( src, sizeof( src ), "%s%s", rra_location, entry->d_name );
+      if ( stat( src, &st ) || !S_ISREG( st.st_mode ) ) 
+	continue;
+      switch ( backup_file( src, &st, dir, prev, gz ) ) {
+      case 0:  n_copied++; break;
+      case 1:  n_linked++; break;
+      default: n_failed++; break;
+      }
+    }
+    closedir( rra_dir );
+  } else {
+    fprintf( stderr, "create_backups: Cannot open %s\n", rra_location );
+    n_failed++;
+  }
 
-  err = mkdir( dir, 0755 );
+  for ( i = 0; configs[i]; i++ ) {
+    if ( stat( configs[i], &st ) ) {
+      fprintf( stderr, "create_backups: %s not found, not backed up\n", 
+	       configs[i] );
+      continue;
+    }
+    switch ( backup_file( configs[i], &st, dir, prev, 0 ) ) {
+    case 0:  n_copied++; break;
+    case 1:  n_linked++; break;
+    default: n_failed++; break;
+    }
+  }
 
-  printf( "Creating database backups and restoration script in %s\n", dir );
-  printf( "Executing: %s\n", cmd );  
-  system( cmd );
-  sprintf( cmd, "cp %s %s ", HCB_RRD_CFG, dir );
-  printf( "Executing: %s\n", cmd );  
-  system( cmd );
-  sprintf( cmd, "cp %s %s ", PWRUSAGE_CFG, dir );
-  printf( "Executing: %s\n", cmd );  
-  system( cmd );
+  printf( "Backed up %d files, %d copied, %d unchanged since the previous backup\n", 
+	  n_copied + n_linked, n_copied, n_linked );
 
   /* write restore script */
 
-  restore_script = calloc( MAX_LEN, sizeof( char ) );
-
-  sprintf( restore_script, "%s/restore_logs.sh", dir );
-  fp = fopen( restore_script, "w" );
+  snprintf( restore_script, sizeof( restore_script ), "%s/restore_logs.sh", 
+	    dir );
+  if ( ( fp = fopen( restore_script, "w" ) ) == NULL ) {
+    fprintf( stderr, "create_backups: Cannot write %s: %s\n", restore_script,
+	     strerror( errno ) );
+    return n_failed + 1;
+  }
   fprintf( fp, "#! /bin/sh\n#\n# Script for backup restoration. Generated by transfer-logs\n" );
-  fprintf( fp, "cp %s/*.rra %s\n", dir, rra_location );
-  fprintf( fp, "cp %s/*.dat %s\n", dir, rra_location );
-  fprintf( fp, "cp %s/config_hcb_rrd.xml /HCBv2/config/\n", dir );
-  fprintf( fp, "cp %s/config_happ_pwrusage.xml /HCBv2/config/\n", dir );
-  fclose( fp );
+  if ( gz ) {
+    fprintf( fp, "for f in \"%s\"*.rra%s; do gunzip -c \"$f\" > \"%s$(basename \"$f\" %s)\"; done\n",
+	     dir, GZ_EXT, rra_location, GZ_EXT );
+  } else {
+    fprintf( fp, "cp \"%s\"*.rra \"%s\"\n", dir, rra_location );
+  }
+  fprintf( fp, "cp \"%s\"*.dat \"%s\"\n", dir, rra_location );
+  for ( i = 0; configs[i]; i++ ) {
+    name = strrchr( configs[i], '/' );
+    name = name ? name + 1 : configs[i];
+    fprintf( fp, "cp \"%s%s\" \"%s\"\n", dir, name, configs[i] );
+  }
+  if ( fclose( fp ) ) {
+    n_failed++;
+  }
 
   chmod( restore_script, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IXGRP );
-  free( cmd );
-  free( dir );
-  free( tv );
-  free( restore_script );
+
+  return n_failed;
+}
+
+
+
+int backup_file( char* src, struct stat* st, char* dir, char* prev, int gz ) {
+
+  char dst[2 * MAX_LEN];
+  char old[2 * MAX_LEN];
+  char* name;
+  char* ext;
+  struct stat st_old;
+
+  /* 
+   * Back up src (with stat data st) into dir, .rra files gzipped with gz. 
+   * Returns 1 if the copy in the previous backup prev was still current 
+   * and got linked, 0 if src was copied, -1 on errors.
+   */
+
+  name = strrchr( src, '/' );
+  name = name ? name + 1 : src;
+  ext  = strrchr( name, '.' );
+  gz   = gz && ext && !strcmp( ext, ".rra" );
+  snprintf( dst, sizeof( dst ), "%s%s%s", dir, name, gz ? GZ_EXT : "" );
+
+  /* never write through a link into an older backup */
+
+  unlink( dst );
+
+  /* a gzipped copy has the size of the original in its trailer */
+
+  if ( prev[0] ) {
+    snprintf( old, sizeof( old ), "%s%s%s", prev, name, gz ? GZ_EXT : "" );
+    if ( !stat( old, &st_old ) && S_ISREG( st_old.st_mode ) &&
+	 ( gz ? ( gz_size( old ) == (long)( st->st_size & 0xffffffff ) ) : 
+	   ( st_old.st_size == st->st_size ) ) &&
+	 ( st_old.st_mtim.tv_sec  == st->st_mtim.tv_sec ) && 
+	 ( st_old.st_mtim.tv_nsec == st->st_mtim.tv_nsec ) &&
+	 !link( old, dst ) ) {
+      return 1;
+    }
+  }
+
+  /* copies keep their mtime, so they can be compared next time */
+
+  if ( gz ? gzip_file( src, dst, st ) : copy_file( src, dst ) ) {
+    fprintf( stderr, "create_backups: Cannot back up %s: %s\n", src, 
+	     strerror( errno ) );
+    unlink( dst );
+    return -1;
+  }
+  return 0;
+}
+
+
+
+int gzip_file( char* src, char* dst, struct stat* st ) {
+
+  struct timespec times[2];
+  gzFile out;
+  char* buf;
+  int in;
+  int n;
+  int err = 0;
+
+  /* gzipped copy of src with its permissions and times, 0 on success */
+
+  if ( ( in = open( src, O_RDONLY ) ) < 0 ) 
+    return -1;
+  if ( ( out = gzopen( dst, GZ_WRITE_MODE ) ) == NULL ) {
+    close( in );
+    return -1;
+  }
+
+  buf = malloc( COPY_BUF_LEN );
+  while ( ( n = read( in, buf, COPY_BUF_LEN ) ) > 0 ) {
+    if ( gzwrite( out, buf, n ) != n ) {
+      err = -1;
+      break;
+    }
+  }
+  if ( n < 0 ) 
+    err = -1;
+  free( buf );
+  close( in );
+  if ( gzclose( out ) != Z_OK ) 
+    err = -1;
+
+  times[0] = st->st_atim;
+  times[1] = st->st_mtim;
+  if ( !err && ( chmod( dst, st->st_mode & 07777 ) || 
+		 utimensat( AT_FDCWD, dst, times, 0 ) ) ) 
+    err = -1;
+  return err;
+}
+
+
+
+long gz_size( char* path ) {
+
+  unsigned char trailer[4];
+  off_t size;
+  int fd;
+  long len = -1;
+
+  /* 
+   * uncompressed size of a gzip file, modulo 2^32, from its trailer. -1 
+   * when it can't be read.
+   */
+
+  if ( ( fd = open( path, O_RDONLY ) ) < 0 ) 
+    return -1;
+  if ( ( ( size = lseek( fd, 0, SEEK_END ) ) >= 4 ) && 
+       ( pread( fd, trailer, 4, size - 4 ) == 4 ) ) {
+    len = (long)trailer[0] | ( (long)trailer[1] << 8 ) | 
+      ( (long)trailer[2] << 16 ) | ( (long)trailer[3] << 24 );
+  }
+  close( fd );
+  return len;
+}
+
+
+
+int find_last_backup( char* backup_dir, char* skip, char* buf, size_t len ) {
+
+  char parent[2 * MAX_LEN];
+  char *prefix;
+  char *end;
+  size_t prefix_len;
+  long ts;
+  long ts_max = -1;
+  DIR* dir;
+  struct dirent* entry;
+
+  /* 
+   * Find the latest backup_dir_<time> directory other than skip, its path 
+   * (with trailing '/') goes into buf. Returns 1 if found, 0 if not.
+   */
+
+  snprintf( parent, sizeof( parent ), "%s", backup_dir );
+  if ( ( prefix = strrchr( parent, '/' ) ) == NULL ) 
+    return 0;
+  *prefix++ = '\0';
+  prefix_len = strlen( prefix );
+
+  if ( ( dir = opendir( parent[0] ? parent : "/" ) ) == NULL ) 
+    return 0;
+
+  while ( ( entry = readdir( dir ) ) != NULL ) {
+    if ( strncmp( entry->d_name, prefix, prefix_len ) || 
+	 ( entry->d_name[prefix_len] != '_' ) ) 
+      continue;
+    ts = strtol( entry->d_name + prefix_len + 1, &end, 10 );
+    if ( *end || ( ts <= ts_max ) ) 
+      continue;
+    snprintf( buf, len, "%s_%ld/", backup_dir, ts );
+    if ( strcmp( buf, skip ) ) 
+      ts_max = ts;
+  }
+  closedir( dir );
+
+  if ( ts_max < 0 ) 
+    return 0;
+  snprintf( buf, len, "%s_%ld/", backup_dir, ts_max );
+  return 1;
 }
 
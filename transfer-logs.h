@@ -0,0 +1,89 @@
+/*
+ * transfer-logs.h
+ *
+ * library interface to transfer-logs, for running transfers from a long-lived
+ * process instead of calling the transfer-logs binary for each of them. Build
+ * with make lib, link with libtransferlogs.a -lcurl -lz -lpthread -lm.
+ *
+ * A context holds the options, the location of the databases, a cache of
+ * parsed config_hcb_rrd.xml files (parsed again only when changed on disk)
+ * and the memory used during a transfer, which is kept for the next one. All
+ * entry points return 0 on success or one of the E_ codes below, which are
+ * the exit codes of the transfer-logs binary as well.
+ *
+ * A context is meant to be used by one thread at a time.
+ */
+
+#ifndef __TRANSFER_LOGS_H
+#define __TRANSFER_LOGS_H
+
+#define E_DATABASE_DIR_NOT_FOUND     255
+#define E_INSUFFICIENT_CL_ARGS       254
+#define E_BAD_DL_URL                 253
+#define E_INVALID_DATA_DIR           252
+#define E_INVALID_END_DATE           251
+#define E_NO_DAT_FILES_FOUND         250
+#define E_CANNOT_OPEN_DIR            249
+#define E_BACKUP_FAILED              248
+#define E_UNZIP_FAILED               247
+#define E_CANNOT_CREATE_DIR          246
+#define E_COMMIT_FAILED              245
+
+/*
+ * Options, NULL or 0 selects the default, which is what the transfer-logs
+ * binary uses. Strings are copied by tl_open.
+ */
+
+typedef struct tl_opts_s {
+  char   *rra_location;      /* databases, default: found by searching the
+				toon's known locations */
+  char   *hcb_rrd_cfg;       /* config_hcb_rrd.xml of the databases */
+  char   *pwrusage_cfg;      /* config_happ_pwrusage.xml */
+  char   *exports_location;  /* download directory for tl_fetch */
+  char   *backup_dir;        /* prefix of backup directories, _<time> is
+				appended */
+  char   *max_date;          /* YYYY-mm-dd, merge data until this date */
+  char   *from_date;         /* YYYY-mm-dd, tl_convert only converts data
+				from this date on */
+  char   *to_date;           /* up to and including this date */
+  int    n_threads;          /* databases processed in parallel, default 1 */
+  int    mem;                /* keep export.zip contents in memory (-m) */
+  int    binary;             /* binary intermediate files for tl_convert (-B) */
+  int    incremental;        /* skip data merged before (-i) */
+  int    plan;               /* only report what would be merged (--plan) */
+  int    gz;                 /* gzip staged csv files and .rra backups (-z) */
+} tl_opts_s;
+
+typedef struct tl_ctx_s tl_ctx_s;
+
+/* NULL when max_date is invalid or the databases cannot be found */
+
+tl_ctx_s* tl_open( tl_opts_s* );
+void   tl_close( tl_ctx_s* );
+char*  tl_rra_location( tl_ctx_s* );
+
+/* snapshot databases and config files (-b) */
+
+int    tl_backup( tl_ctx_s* );
+
+/* convert the .rra files copied from the old toon into dir and merge (-r) */
+
+int    tl_convert( tl_ctx_s*, char* dir );
+
+/* unpack dir/export.zip and merge its contents (-e -u) */
+
+int    tl_inject( tl_ctx_s*, char* dir );
+
+/* download export.zip from a comma separated list of toons and merge (-d) */
+
+int    tl_fetch( tl_ctx_s*, char* hosts );
+
+/*
+ * download config_hcb_rrd.xml, config_happ_pwrusage.xml and the .dat and
+ * .rra files from an old toon over one connection, then convert and merge
+ * them as tl_convert does (-R)
+ */
+
+int    tl_pull( tl_ctx_s*, char* host );
+
+#endif /* __TRANSFER_LOGS_H */